@@ -0,0 +1,118 @@
+// hash index of the entries yfs_client caches per extent.
+
+#ifndef cache_table_h
+#define cache_table_h
+
+#include <stddef.h>
+
+// Entries of type T keyed by (eid, type), in an open-addressing table
+// with linear probing. Entries live in nodes of their own, so a pointer
+// to one stays good until that entry is erased, however the table grows.
+// Erasing shifts the rest of a probe run back instead of leaving
+// tombstones, so lookups never slow down with churn.
+template <class T>
+class cache_table {
+public:
+    cache_table() : slots(new slot[MIN_SLOTS]), mask(MIN_SLOTS - 1), used(0) {}
+    ~cache_table() {
+        clear();
+        delete[] slots;
+    }
+
+    T* find(unsigned long long eid, int type) const {
+        for (size_t i = home(eid, type);; i = (i + 1) & mask) {
+            if (slots[i].node == NULL)
+                return NULL;
+            if (slots[i].eid == eid && slots[i].type == type)
+                return slots[i].node;
+        }
+    }
+
+    // the entry for (eid, type), default-constructed if there was none
+    T& insert(unsigned long long eid, int type) {
+        T* e = find(eid, type);
+        if (e)
+            return *e;
+        if ((used + 1) * 4 > (mask + 1) * 3)
+            grow();
+        e = new T();
+        place(eid, type, e);
+        used++;
+        return *e;
+    }
+
+    void erase(unsigned long long eid, int type) {
+        size_t i = home(eid, type);
+        for (;; i = (i + 1) & mask) {
+            if (slots[i].node == NULL)
+                return;
+            if (slots[i].eid == eid && slots[i].type == type)
+                break;
+        }
+        delete slots[i].node;
+        used--;
+        // pull back any later entry of the run that may not skip the hole
+        size_t hole = i;
+        for (size_t j = (i + 1) & mask; slots[j].node; j = (j + 1) & mask) {
+            size_t h = home(slots[j].eid, slots[j].type);
+            if (((j - h) & mask) >= ((j - hole) & mask)) {
+                slots[hole] = slots[j];
+                hole = j;
+            }
+        }
+        slots[hole].node = NULL;
+    }
+
+    void clear() {
+        for (size_t i = 0; i <= mask; i++) {
+            delete slots[i].node;
+            slots[i].node = NULL;
+        }
+        used = 0;
+    }
+
+    size_t size() const { return used; }
+
+private:
+    enum { MIN_SLOTS = 64 };
+    struct slot {
+        slot() : eid(0), type(0), node(NULL) {}
+        unsigned long long eid;
+        int type;
+        T* node;
+    };
+    slot* slots;
+    size_t mask;  // slots - 1, slots being a power of two
+    size_t used;
+
+    cache_table(const cache_table&);
+    cache_table& operator=(const cache_table&);
+
+    // inums come in runs, so mix them up before taking the low bits
+    size_t home(unsigned long long eid, int type) const {
+        unsigned long long h = (eid * 2 + type) * 0x9e3779b97f4a7c15ULL;
+        return (h ^ (h >> 32)) & mask;
+    }
+
+    void place(unsigned long long eid, int type, T* node) {
+        size_t i = home(eid, type);
+        while (slots[i].node)
+            i = (i + 1) & mask;
+        slots[i].eid = eid;
+        slots[i].type = type;
+        slots[i].node = node;
+    }
+
+    void grow() {
+        slot* old = slots;
+        size_t n = mask + 1;
+        slots = new slot[n * 2];
+        mask = n * 2 - 1;
+        for (size_t i = 0; i < n; i++)
+            if (old[i].node)
+                place(old[i].eid, old[i].type, old[i].node);
+        delete[] old;
+    }
+};
+
+#endif
@@ -0,0 +1,134 @@
+// rsync-style deltas between two versions of an extent, shared by
+// yfs_client and extent_server
+
+#include "delta.h"
+#include <stdint.h>
+#include <string.h>
+#include <unordered_map>
+
+namespace {
+
+// rsync's weak checksum of a window: a is the sum of its bytes, b the sum
+// of a over its prefixes, both mod 2^16. Sliding the window one byte on
+// is O(1).
+struct rolling {
+    uint32_t a, b;
+    unsigned int n;
+
+    rolling(const unsigned char* p, unsigned int len) : a(0), b(0), n(len) {
+        for (unsigned int i = 0; i < len; i++) {
+            a += p[i];
+            b += (len - i) * p[i];
+        }
+    }
+    void roll(unsigned char out, unsigned char in) {
+        a += in - out;
+        b += a - n * out;
+    }
+    uint32_t sum() const { return (a & 0xffff) | (b << 16); }
+};
+
+// append a copy, merged into the last op when they are contiguous in base
+void copy(std::vector<extent_protocol::delta_op>& ops, unsigned int off,
+          unsigned int len) {
+    if (!ops.empty() && ops.back().data.empty() &&
+        ops.back().off + ops.back().len == off) {
+        ops.back().len += len;
+        return;
+    }
+    extent_protocol::delta_op op;
+    op.off = off;
+    op.len = len;
+    ops.push_back(op);
+}
+
+void literal(std::vector<extent_protocol::delta_op>& ops, const char* p,
+             unsigned int len) {
+    if (len == 0)
+        return;
+    extent_protocol::delta_op op;
+    op.off = 0;
+    op.len = len;
+    op.data.assign(p, len);
+    ops.push_back(op);
+}
+
+}  // namespace
+
+// The encoder holds both versions, so a weak match is confirmed with
+// memcmp rather than a strong hash, and a confirmed match is stretched a
+// byte at a time past the block it started in.
+unsigned int delta::encode(const std::string& base, const std::string& target,
+                           unsigned int block,
+                           std::vector<extent_protocol::delta_op>& ops) {
+    const unsigned char* b = (const unsigned char*)base.data();
+    const unsigned char* t = (const unsigned char*)target.data();
+    unsigned int bsize = base.size(), tsize = target.size();
+    unsigned int lits = 0;
+
+    ops.clear();
+    if (block == 0 || bsize < block || tsize < block) {
+        literal(ops, target.data(), tsize);
+        return tsize;
+    }
+
+    // weak checksum -> offsets of the aligned blocks of base with it
+    std::unordered_map<uint32_t, std::vector<unsigned int> > index;
+    for (unsigned int off = 0; off + block <= bsize; off += block)
+        index[rolling(b + off, block).sum()].push_back(off);
+
+    unsigned int pos = 0, lit = 0;  // window start, first unmatched byte
+    rolling w(t, block);
+    while (pos + block <= tsize) {
+        std::unordered_map<uint32_t, std::vector<unsigned int> >::iterator it =
+            index.find(w.sum());
+        unsigned int len = 0, from = 0;
+        if (it != index.end()) {
+            for (unsigned int i = 0; i < it->second.size(); i++) {
+                unsigned int off = it->second[i];
+                if (memcmp(b + off, t + pos, block) == 0) {
+                    from = off;
+                    len = block;
+                    break;
+                }
+            }
+        }
+        if (len == 0) {
+            if (pos + block < tsize)
+                w.roll(t[pos], t[pos + block]);
+            pos++;
+            continue;
+        }
+
+        while (from + len < bsize && pos + len < tsize &&
+               b[from + len] == t[pos + len])
+            len++;
+        literal(ops, target.data() + lit, pos - lit);
+        lits += pos - lit;
+        copy(ops, from, len);
+        pos += len;
+        lit = pos;
+        if (pos + block <= tsize)
+            w = rolling(t + pos, block);
+    }
+    literal(ops, target.data() + lit, tsize - lit);
+    lits += tsize - lit;
+    return lits;
+}
+
+bool delta::apply(const std::string& base,
+                  const std::vector<extent_protocol::delta_op>& ops,
+                  std::string& target) {
+    target.clear();
+    for (unsigned int i = 0; i < ops.size(); i++) {
+        const extent_protocol::delta_op& op = ops[i];
+        if (!op.data.empty()) {
+            target += op.data;
+            continue;
+        }
+        if (op.off > base.size() || op.len > base.size() - op.off)
+            return false;
+        target.append(base, op.off, op.len);
+    }
+    return true;
+}
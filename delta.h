@@ -0,0 +1,26 @@
+// rsync-style deltas between two versions of an extent, shared by
+// yfs_client and extent_server.
+
+#ifndef delta_h
+#define delta_h
+
+#include <string>
+#include <vector>
+#include "extent_protocol.h"
+
+class delta {
+public:
+    // Describe target as ops against base. Every block-sized run of base
+    // that turns up anywhere in target, even shifted, becomes a copy; the
+    // rest goes as data. Return the bytes of data in ops.
+    static unsigned int encode(const std::string& base,
+                               const std::string& target, unsigned int block,
+                               std::vector<extent_protocol::delta_op>& ops);
+    // Rebuild target from base and ops.
+    // false if a copy reaches past the end of base.
+    static bool apply(const std::string& base,
+                      const std::vector<extent_protocol::delta_op>& ops,
+                      std::string& target);
+};
+
+#endif
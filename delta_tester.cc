@@ -0,0 +1,110 @@
+//
+// delta tester: round trips of delta::encode and delta::apply
+//
+
+#include "delta.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static int failures = 0;
+
+static std::string random_bytes(unsigned int len) {
+    std::string s(len, '\0');
+    for (unsigned int i = 0; i < len; i++)
+        s[i] = rand() & 0xff;
+    return s;
+}
+
+// Encode target against base with block, apply the ops to base, and check
+// that target comes back with at most max_lits bytes sent as data.
+static void check(const char* name, const std::string& base,
+                  const std::string& target, unsigned int block,
+                  unsigned int max_lits) {
+    std::vector<extent_protocol::delta_op> ops;
+    std::string out;
+    unsigned int lits = delta::encode(base, target, block, ops);
+    if (!delta::apply(base, ops, out) || out != target) {
+        printf("%s: target not rebuilt\n", name);
+        failures++;
+    } else if (lits > max_lits) {
+        printf("%s: %u bytes of data, expected at most %u\n", name, lits,
+               max_lits);
+        failures++;
+    } else {
+        printf("%s: OK, %u ops, %u bytes of data\n", name,
+               (unsigned int)ops.size(), lits);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    const unsigned int B = 64;
+    std::string base = random_bytes(64 * B);
+    std::string t;
+
+    check("same", base, base, B, 0);
+    check("empty base", "", base, B, base.size());
+    check("empty target", base, "", B, 0);
+    check("smaller than a block", base.substr(0, B / 2), base.substr(0, B / 2),
+          B, B / 2);
+
+    // inserts: the bytes around them are still found in base
+    t = base.substr(0, 10 * B) + "inserted" + base.substr(10 * B);
+    check("insert", base, t, B, 8);
+    t = "head" + base + "tail";
+    check("insert at the ends", base, t, B, 8);
+    t = base;
+    for (unsigned int k = 8; k > 0; k--)
+        t.insert(k * 7 * B + 3, random_bytes(5));
+    check("inserts", base, t, B, 8 * (5 + B));
+
+    // deletes: what is left is copied, but for the rest of a block cut
+    // into, which matches no block of base
+    t = base.substr(0, 20 * B + 5) + base.substr(30 * B + 5);
+    check("delete", base, t, B, B);
+    t = base.substr(B, 40 * B);
+    check("delete at the ends", base, t, B, 0);
+    t = base;
+    for (unsigned int k = 6; k > 0; k--)
+        t.erase(k * 9 * B + 11, 17);
+    check("deletes", base, t, B, 6 * B);
+
+    // shifts: a one-byte shift moves every block off its alignment in base
+    t = "x" + base.substr(0, base.size() - 1);
+    check("shift right", base, t, B, 1);
+    t = base.substr(1) + "y";
+    check("shift left", base, t, B, B);
+    t = base.substr(32 * B) + base.substr(0, 32 * B);
+    check("halves swapped", base, t, B, 0);
+
+    // a mix, and many random edits
+    t = base.substr(5 * B + 3, 20 * B) + random_bytes(100) +
+        base.substr(40 * B, 10 * B) + base.substr(0, 3 * B);
+    check("mixed", base, t, B, 100 + 2 * B);
+    for (int i = 0; i < 20; i++) {
+        t = base;
+        for (int e = 0; e < 8; e++) {
+            unsigned int off = rand() % (t.size() + 1);
+            if (rand() % 2)
+                t.insert(off, random_bytes(rand() % 50));
+            else
+                t.erase(off, rand() % 50);
+        }
+        check("random edits", base, t, B, t.size());
+    }
+
+    // a copy reaching past the end of base is refused
+    std::vector<extent_protocol::delta_op> ops(1);
+    ops[0].off = base.size() - 10;
+    ops[0].len = 11;
+    if (delta::apply(base, ops, t)) {
+        printf("copy past the end: applied\n");
+        failures++;
+    }
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("./delta_tester: passed all tests successfully\n");
+    return 0;
+}
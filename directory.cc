@@ -0,0 +1,401 @@
+// directory format, shared by yfs_client and extent_server
+
+#include "directory.h"
+#include "inode_manager.h"
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// the most buckets an extent has room for
+static const unsigned int MAX_BUCKETS =
+    (NDIRECT + NINDIRECT) * BLOCK_SIZE / directory::DIR_BUCKET;
+// below MAX_BUCKETS, an add that would spill over more buckets than this
+// grows the directory instead
+static const unsigned int MAX_SPILL = 2;
+static const unsigned int ROOM = directory::DIR_BUCKET - 2;
+
+static unsigned int used_of(const char* b) {
+    uint16_t used;
+    memcpy(&used, b, 2);
+    return used;
+}
+
+static unsigned int hash_of(const char* p) {
+    uint32_t h;
+    memcpy(&h, p, 4);
+    return h;
+}
+
+// the length byte lets a scan step over an entry without reading its name
+static unsigned int size_of(const char* p) {
+    return 4 + 1 + (unsigned char)p[4] + 4;
+}
+
+static unsigned int node_of(const char* p) {
+    uint32_t inum;
+    memcpy(&inum, p + 5 + (unsigned char)p[4], 4);
+    return inum;
+}
+
+static void encode(std::string& out, unsigned int hash, const char* name,
+                   size_t len, extent_protocol::extentid_t inum) {
+    uint32_t tmp = hash;
+    out.append((const char*)&tmp, 4);
+    out.append(1, (char)len);
+    out.append(name, len);
+    tmp = inum;
+    out.append((const char*)&tmp, 4);
+}
+
+// A name being looked for, its first 16 bytes zero-padded so that they
+// can be checked against an entry in one compare.
+struct name_key {
+    name_key(const char* n, size_t l) : name(n), len(l) {
+        memset(prefix, 0, sizeof(prefix));
+        memcpy(prefix, n, l < 16 ? l : 16);
+    }
+    const char* name;
+    size_t len;
+    char prefix[16] __attribute__((aligned(16)));
+};
+
+// Whether the entry at p names k: the length first, then the first 16
+// bytes at once if buf has that many left from the name on, then the
+// rest.
+static bool matches(const name_key& k, const char* p, const char* end) {
+    if ((unsigned char)p[4] != k.len)
+        return false;
+    const char* name = p + 5;
+#ifdef __SSE2__
+    if (end - name >= 16) {
+        __m128i got = _mm_loadu_si128((const __m128i*)name);
+        __m128i want = _mm_load_si128((const __m128i*)k.prefix);
+        unsigned int same = _mm_movemask_epi8(_mm_cmpeq_epi8(got, want));
+        unsigned int mask = k.len >= 16 ? 0xffff : (1U << k.len) - 1;
+        if ((same & mask) != mask)
+            return false;
+        return k.len <= 16 ||
+               memcmp(name + 16, k.name + 16, k.len - 16) == 0;
+    }
+#endif
+    return memcmp(name, k.name, k.len) == 0;
+}
+
+// Fill bucket b with the entries in content, which fit.
+static void store(char* b, const std::string& content) {
+    uint16_t used = content.size();
+    memcpy(b, &used, 2);
+    memcpy(b + 2, content.data(), content.size());
+    memset(b + 2 + used, 0, ROOM - used);
+}
+
+// FNV-1a
+unsigned int directory::hash(const char* name, size_t len) {
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+unsigned int directory::bucket(unsigned int hash, unsigned int buckets) {
+    return ((unsigned long long)hash * buckets) >> 32;
+}
+
+unsigned int directory::next(const char* p, unsigned int& hash,
+                             extent_protocol::dirent& ent) {
+    hash = hash_of(p);
+    ent.name.assign(p + 5, (unsigned char)p[4]);
+    ent.inum = node_of(p);
+    return size_of(p);
+}
+
+// Look for name from its home bucket on. FOUND if it is there, with b,
+// at locating its entry; otherwise b, at locate where it would go: after
+// every entry with a hash no greater, but not before its home bucket.
+// MORE if that is not known by end.
+int directory::find(const char* data, unsigned int first, unsigned int end,
+                    unsigned int buckets, unsigned int h, const char* name,
+                    size_t len, unsigned int& b, unsigned int& at) {
+    name_key key(name, len);
+    const char* limit = data + (end - first) * DIR_BUCKET;
+    b = bucket(h, buckets);
+    at = 2;
+    for (unsigned int i = b; i < end; i++) {
+        const char* start = data + (i - first) * DIR_BUCKET;
+        const char* stop = start + 2 + used_of(start);
+        for (const char* p = start + 2; p < stop;) {
+            unsigned int eh = hash_of(p);
+            if (eh > h)
+                return MISSING;
+            if (eh == h && matches(key, p, limit)) {
+                b = i;
+                at = p - start;
+                return DONE;
+            }
+            p += size_of(p);
+            b = i;
+            at = p - start;
+        }
+    }
+    return end < buckets ? MORE : MISSING;
+}
+
+unsigned int directory::home(const char* name, unsigned int buckets) {
+    return bucket(hash(name, strlen(name)), buckets);
+}
+
+unsigned int directory::home(unsigned int cookie, unsigned int buckets) {
+    return bucket(cookie, buckets);
+}
+
+bool directory::lookup(const std::string& buf, const char* name,
+                       extent_protocol::extentid_t& inum) {
+    return lookup(buf, 0, buf.size() / DIR_BUCKET, name, inum) == DONE;
+}
+
+int directory::lookup(const std::string& part, unsigned int first,
+                      unsigned int buckets, const char* name,
+                      extent_protocol::extentid_t& inum) {
+    unsigned int end = first + part.size() / DIR_BUCKET;
+    if (buckets == 0)
+        return MISSING;
+    size_t len = strlen(name);
+    unsigned int b, at;
+    int r = find(part.data(), first, end, buckets, hash(name, len), name, len,
+                 b, at);
+    if (r == DONE)
+        inum = node_of(part.data() + (b - first) * DIR_BUCKET + at);
+    return r;
+}
+
+// Lay out the entries of buf, with entry added at its place, over the
+// given number of buckets, each entry in its home bucket or, if that is
+// full, the first after it with room. false if they run out of buckets.
+bool directory::spread(const std::string& buf, const std::string& entry,
+                       unsigned int buckets, std::string& out) {
+    out.assign(buckets * DIR_BUCKET, '\0');
+    unsigned int h = hash_of(entry.data());
+    bool placed = false;
+    unsigned int cur = 0;
+    std::string content;
+    const char* p = NULL;
+    const char* end = NULL;
+    for (unsigned int i = 0;;) {
+        // the next entry in hash order, from buf or the new one
+        while (p == end && i < buf.size() / DIR_BUCKET) {
+            p = buf.data() + i * DIR_BUCKET + 2;
+            end = p + used_of(p - 2);
+            i++;
+        }
+        const char* e;
+        unsigned int size;
+        if (!placed && (p == end || hash_of(p) > h)) {
+            e = entry.data();
+            size = entry.size();
+            placed = true;
+        } else if (p != end) {
+            e = p;
+            size = size_of(p);
+            p += size;
+        } else {
+            break;
+        }
+        unsigned int home = bucket(hash_of(e), buckets);
+        if (home > cur || content.size() + size > ROOM) {
+            store(&out[cur * DIR_BUCKET], content);
+            content.clear();
+            cur = home > cur ? home : cur + 1;
+            if (cur >= buckets)
+                return false;
+        }
+        content.append(e, size);
+    }
+    store(&out[cur * DIR_BUCKET], content);
+    return true;
+}
+
+// Put entry in at b, at, and push what no longer fits in a bucket on to
+// the front of the next. DONE with off, len covering the buckets changed;
+// GROW if that would spill over too many buckets, or past the last.
+int directory::place(char* data, unsigned int first, unsigned int end,
+                     unsigned int buckets, unsigned int b, unsigned int at,
+                     const std::string& entry, unsigned int& off,
+                     unsigned int& len) {
+    bool capped = buckets < MAX_BUCKETS;
+    std::vector<std::string> contents;
+    std::string carry;
+    unsigned int i = b;
+    for (; i < buckets && (i == b || !carry.empty()); i++) {
+        if (capped && contents.size() > MAX_SPILL)
+            return GROW;
+        if (i == end)
+            return MORE;
+        const char* start = data + (i - first) * DIR_BUCKET;
+        std::string content;
+        if (i == b) {
+            content.assign(start + 2, at - 2);
+            content += entry;
+            content.append(start + at, used_of(start) + 2 - at);
+        } else {
+            content = carry;
+            content.append(start + 2, used_of(start));
+        }
+        unsigned int keep = 0;
+        while (keep < content.size() &&
+               keep + size_of(content.data() + keep) <= ROOM)
+            keep += size_of(content.data() + keep);
+        carry = content.substr(keep);
+        content.resize(keep);
+        contents.push_back(content);
+    }
+    if (!carry.empty() || (capped && contents.size() > MAX_SPILL))
+        return GROW;
+    for (unsigned int j = 0; j < contents.size(); j++)
+        store(data + (b + j - first) * DIR_BUCKET, contents[j]);
+    off = b * DIR_BUCKET;
+    len = contents.size() * DIR_BUCKET;
+    return DONE;
+}
+
+bool directory::add(std::string& buf, const char* name,
+                    extent_protocol::extentid_t inum, unsigned int& off,
+                    unsigned int& len) {
+    size_t n = strlen(name);
+    if (n > 255)
+        return false;
+    unsigned int buckets = buf.size() / DIR_BUCKET;
+    if (add(buf, 0, buckets, name, inum, off, len) == DONE)
+        return true;
+
+    // spread the entries over more buckets: twice as many, or as many as
+    // fit
+    std::string entry, out;
+    encode(entry, hash(name, n), name, n, inum);
+    unsigned int more = buckets;
+    do {
+        if (more == MAX_BUCKETS)
+            return false;
+        more = more == 0 ? 1 : more * 2 < MAX_BUCKETS ? more * 2 : MAX_BUCKETS;
+    } while (!spread(buf, entry, more, out));
+    buf.swap(out);
+    off = 0;
+    len = buf.size();
+    return true;
+}
+
+int directory::add(std::string& part, unsigned int first,
+                   unsigned int buckets, const char* name,
+                   extent_protocol::extentid_t inum, unsigned int& off,
+                   unsigned int& len) {
+    unsigned int end = first + part.size() / DIR_BUCKET;
+    size_t n = strlen(name);
+    if (buckets == 0 || n > 255)
+        return GROW;
+    unsigned int h = hash(name, n);
+    std::string entry;
+    encode(entry, h, name, n, inum);
+    unsigned int b, at;
+    if (find(part.data(), first, end, buckets, h, name, n, b, at) == MORE)
+        return MORE;
+    return place(&part[0], first, end, buckets, b, at, entry, off, len);
+}
+
+// Take out the entry at b, at.
+void directory::take(char* data, unsigned int first, unsigned int b,
+                     unsigned int at, extent_protocol::extentid_t& inum,
+                     unsigned int& off, unsigned int& len) {
+    off = b * DIR_BUCKET;
+    len = DIR_BUCKET;
+    char* start = data + (b - first) * DIR_BUCKET;
+    char* p = start + at;
+    char* end = start + 2 + used_of(start);
+    unsigned int size = size_of(p);
+    inum = node_of(p);
+    memmove(p, p + size, end - p - size);
+    memset(end - size, 0, size);
+    uint16_t used = end - size - start - 2;
+    memcpy(start, &used, 2);
+}
+
+bool directory::remove(std::string& buf, const char* name,
+                       extent_protocol::extentid_t& inum, unsigned int& off,
+                       unsigned int& len) {
+    return remove(buf, 0, buf.size() / DIR_BUCKET, name, inum, off, len) ==
+           DONE;
+}
+
+int directory::remove(std::string& part, unsigned int first,
+                      unsigned int buckets, const char* name,
+                      extent_protocol::extentid_t& inum, unsigned int& off,
+                      unsigned int& len) {
+    unsigned int end = first + part.size() / DIR_BUCKET;
+    if (buckets == 0)
+        return MISSING;
+    size_t n = strlen(name);
+    unsigned int b, at;
+    int r = find(part.data(), first, end, buckets, hash(name, n), name, n, b,
+                 at);
+    if (r == DONE)
+        take(&part[0], first, b, at, inum, off, len);
+    return r;
+}
+
+// Append entries from cookie on, from the cookie's home bucket, until max
+// are taken and the next has another hash (DONE, with cookie moved on) or
+// the directory ends (MISSING).
+int directory::scan(const char* data, unsigned int first, unsigned int end,
+                    unsigned int buckets, unsigned int& cookie,
+                    unsigned int max,
+                    std::vector<extent_protocol::dirent>& ents) {
+    extent_protocol::dirent ent;
+    unsigned int h, last = 0, taken = 0;
+    size_t had = ents.size();
+    // entries come after their home bucket, if anything
+    for (unsigned int i = buckets ? bucket(cookie, buckets) : 0; i < end;
+         i++) {
+        const char* b = data + (i - first) * DIR_BUCKET;
+        const char* stop = b + 2 + used_of(b);
+        for (const char* p = b + 2; p < stop;) {
+            if (hash_of(p) < cookie) {
+                p += size_of(p);
+                continue;
+            }
+            p += next(p, h, ent);
+            // never stop between entries with the same hash
+            if (taken >= max && (taken == 0 || h != last)) {
+                cookie = h;
+                return DONE;
+            }
+            ents.push_back(ent);
+            last = h;
+            taken++;
+        }
+    }
+    if (end >= buckets)
+        return MISSING;
+    ents.resize(had);
+    return MORE;
+}
+
+bool directory::list(const std::string& buf, unsigned int& cookie,
+                     unsigned int max,
+                     std::vector<extent_protocol::dirent>& ents) {
+    unsigned int buckets = buf.size() / DIR_BUCKET;
+    return scan(buf.data(), 0, buckets, buckets, cookie, max, ents) ==
+           MISSING;
+}
+
+int directory::list(const std::string& part, unsigned int first,
+                    unsigned int buckets, unsigned int& cookie,
+                    unsigned int max,
+                    std::vector<extent_protocol::dirent>& ents, bool& eof) {
+    unsigned int end = first + part.size() / DIR_BUCKET;
+    int r = scan(part.data(), first, end, buckets, cookie, max, ents);
+    if (r == MORE)
+        return MORE;
+    eof = r == MISSING;
+    return DONE;
+}
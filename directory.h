@@ -0,0 +1,109 @@
+// directory format, shared by yfs_client and extent_server.
+
+#ifndef directory_h
+#define directory_h
+
+#include <string>
+#include <vector>
+#include "extent_protocol.h"
+
+/*
+directory format: buckets of DIR_BUCKET bytes, as many as the size says
+bucket  |  used(uint16)  |  entry  |  entry  |  ...  |  zeros  |
+entry   |  hash(uint32)  |  len(uint8)  |  name  |  node(uint32)  |
+
+A name's home is the bucket its hash falls in when the hash range is cut
+into as many equal parts as there are buckets. Entries are kept in hash
+order across the buckets, each in its home or, when that is full, pushed
+on to a later bucket. So a lookup reads a bucket or two, and the hash is
+a readdir cookie that stays good across adds, removes and growth. An
+empty string is an empty directory; one that spills too far grows.
+*/
+class directory {
+public:
+    enum { DIR_BUCKET = 512 };
+
+    static bool lookup(const std::string& buf, const char* name,
+                       extent_protocol::extentid_t& inum);
+    // false if the directory is full or the name longer than 255 bytes.
+    // The bytes changed are the len bytes at off: a bucket or two, or
+    // all of buf if it had to grow.
+    static bool add(std::string& buf, const char* name,
+                    extent_protocol::extentid_t inum, unsigned int& off,
+                    unsigned int& len);
+    static bool add(std::string& buf, const char* name,
+                    extent_protocol::extentid_t inum) {
+        unsigned int off, len;
+        return add(buf, name, inum, off, len);
+    }
+    // false if there is no such name. The bytes changed are the len
+    // bytes at off, the name's bucket.
+    static bool remove(std::string& buf, const char* name,
+                       extent_protocol::extentid_t& inum, unsigned int& off,
+                       unsigned int& len);
+    static bool remove(std::string& buf, const char* name,
+                       extent_protocol::extentid_t& inum) {
+        unsigned int off, len;
+        return remove(buf, name, inum, off, len);
+    }
+
+    // Append up to max entries from cookie on to ents, more if the last
+    // ones share a hash. Return true at the end of the directory, else
+    // leave in cookie where the next call carries on.
+    static bool list(const std::string& buf, unsigned int& cookie,
+                     unsigned int max,
+                     std::vector<extent_protocol::dirent>& ents);
+
+    // The same on part of a directory of `buckets` buckets: the buckets
+    // from first on, as many as part holds. first is the home of the name,
+    // or of the cookie for list. A call that runs past part returns MORE
+    // and changes nothing; call it again with more buckets. An add that
+    // has to grow the directory returns GROW, for a call on all of it.
+    // off is from the start of the directory.
+    enum { DONE, MISSING, MORE, GROW };
+    static unsigned int home(const char* name, unsigned int buckets);
+    static unsigned int home(unsigned int cookie, unsigned int buckets);
+    static int lookup(const std::string& part, unsigned int first,
+                      unsigned int buckets, const char* name,
+                      extent_protocol::extentid_t& inum);
+    static int add(std::string& part, unsigned int first,
+                   unsigned int buckets, const char* name,
+                   extent_protocol::extentid_t inum, unsigned int& off,
+                   unsigned int& len);
+    static int remove(std::string& part, unsigned int first,
+                      unsigned int buckets, const char* name,
+                      extent_protocol::extentid_t& inum, unsigned int& off,
+                      unsigned int& len);
+    // eof is set when it returns DONE
+    static int list(const std::string& part, unsigned int first,
+                    unsigned int buckets, unsigned int& cookie,
+                    unsigned int max,
+                    std::vector<extent_protocol::dirent>& ents, bool& eof);
+
+private:
+    static unsigned int hash(const char* name, size_t len);
+    static unsigned int bucket(unsigned int hash, unsigned int buckets);
+    // Decode the entry at p. Return its length.
+    static unsigned int next(const char* p, unsigned int& hash,
+                             extent_protocol::dirent& ent);
+    // The calls below take buckets [first, end) of a directory of
+    // `buckets` buckets, held at data.
+    static int find(const char* data, unsigned int first, unsigned int end,
+                    unsigned int buckets, unsigned int hash, const char* name,
+                    size_t len, unsigned int& b, unsigned int& at);
+    static int place(char* data, unsigned int first, unsigned int end,
+                     unsigned int buckets, unsigned int b, unsigned int at,
+                     const std::string& entry, unsigned int& off,
+                     unsigned int& len);
+    static void take(char* data, unsigned int first, unsigned int b,
+                     unsigned int at, extent_protocol::extentid_t& inum,
+                     unsigned int& off, unsigned int& len);
+    static int scan(const char* data, unsigned int first, unsigned int end,
+                    unsigned int buckets, unsigned int& cookie,
+                    unsigned int max,
+                    std::vector<extent_protocol::dirent>& ents);
+    static bool spread(const std::string& buf, const std::string& entry,
+                       unsigned int buckets, std::string& out);
+};
+
+#endif
@@ -0,0 +1,395 @@
+//
+// directory tester: the bucket layout of directory.h under adds, removes,
+// spills, growth and listing
+//
+
+#include "directory.h"
+#include "inode_manager.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <map>
+#include <set>
+
+static const unsigned int MAX_BUCKETS =
+    (NDIRECT + NINDIRECT) * BLOCK_SIZE / directory::DIR_BUCKET;
+
+static int failures = 0;
+
+#define CHECK(cond, ...)              \
+    do {                              \
+        if (!(cond)) {                \
+            printf(__VA_ARGS__);      \
+            failures++;               \
+        }                             \
+    } while (0)
+
+// directory's hash, FNV-1a
+static unsigned int hash(const std::string& name) {
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i < name.size(); i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static unsigned int home(unsigned int h, unsigned int buckets) {
+    return ((unsigned long long)h * buckets) >> 32;
+}
+
+static std::string name_of(const char* prefix, unsigned int i) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s%u", prefix, i);
+    return buf;
+}
+
+// Entries of buf that are not in their home bucket, after checking that
+// the hashes never go down from one entry to the next. Their names go in
+// out, if given.
+static unsigned int spilled(const std::string& buf,
+                            std::vector<std::string>* out = NULL) {
+    unsigned int buckets = buf.size() / directory::DIR_BUCKET, n = 0;
+    unsigned int last = 0;
+    for (unsigned int b = 0; b < buckets; b++) {
+        const char* start = buf.data() + b * directory::DIR_BUCKET;
+        uint16_t used;
+        memcpy(&used, start, 2);
+        for (const char* p = start + 2; p < start + 2 + used;) {
+            uint32_t h;
+            memcpy(&h, p, 4);
+            CHECK(h >= last, "hash order broken in bucket %u\n", b);
+            CHECK(home(h, buckets) <= b, "entry before its home %u\n", b);
+            if (home(h, buckets) != b) {
+                n++;
+                if (out)
+                    out->push_back(std::string(p + 5, (unsigned char)p[4]));
+            }
+            last = h;
+            p += 4 + 1 + (unsigned char)p[4] + 4;
+        }
+    }
+    return n;
+}
+
+// Whether buf holds exactly names, each with its inum.
+static void check_all(const char* test, const std::string& buf,
+                      const std::map<std::string, unsigned int>& names) {
+    for (std::map<std::string, unsigned int>::const_iterator it =
+             names.begin();
+         it != names.end(); ++it) {
+        extent_protocol::extentid_t inum = 0;
+        bool found = directory::lookup(buf, it->first.c_str(), inum);
+        CHECK(found && inum == it->second, "%s: %s lost\n", test,
+              it->first.c_str());
+    }
+    unsigned int cookie = 0;
+    std::vector<extent_protocol::dirent> ents;
+    directory::list(buf, cookie, ~0U, ents);
+    CHECK(ents.size() == names.size(), "%s: %u listed, %u expected\n", test,
+          (unsigned int)ents.size(), (unsigned int)names.size());
+}
+
+// Add names homed in bucket 0 of a directory of several buckets until one
+// of them has to go in a later bucket; then remove entries around it.
+static void test_spill() {
+    std::string buf;
+    std::map<std::string, unsigned int> names;
+    unsigned int i = 0;
+    for (; buf.size() < 8 * directory::DIR_BUCKET; i++) {
+        names[name_of("spread", i)] = i + 1;
+        directory::add(buf, name_of("spread", i).c_str(), i + 1);
+    }
+
+    unsigned int buckets = buf.size() / directory::DIR_BUCKET;
+    unsigned int before = spilled(buf);
+    std::vector<std::string> low;
+    for (unsigned int j = 0; spilled(buf) == before && j < 1000000; j++) {
+        std::string n = name_of("low", j);
+        if (home(hash(n), MAX_BUCKETS) != 0)
+            continue;
+        CHECK(directory::add(buf, n.c_str(), 1000 + j), "spill: add failed\n");
+        names[n] = 1000 + j;
+        low.push_back(n);
+    }
+    std::vector<std::string> moved;
+    CHECK(spilled(buf, &moved) > before, "spill: nothing spilled\n");
+    CHECK(buf.size() / directory::DIR_BUCKET == buckets,
+          "spill: grew instead of spilling\n");
+    check_all("spill", buf, names);
+
+    if (low.empty() || moved.empty())
+        return;
+
+    // entries are in hash order, so the lowest hash is in bucket 0, the
+    // home it filled
+    std::string first = low[0];
+    for (unsigned int j = 1; j < low.size(); j++)
+        if (hash(low[j]) < hash(first))
+            first = low[j];
+
+    // free room in the home bucket: what spilled stays where it is, and
+    // is still found
+    extent_protocol::extentid_t inum;
+    CHECK(directory::remove(buf, first.c_str(), inum) && inum == names[first],
+          "spill: remove failed\n");
+    names.erase(first);
+    CHECK(spilled(buf) == moved.size(), "spill: spilled entries moved\n");
+    check_all("remove in home", buf, names);
+
+    // and one that spilled
+    std::string last = moved.back();
+    CHECK(directory::remove(buf, last.c_str(), inum) && inum == names[last],
+          "spill: remove of a spilled entry failed\n");
+    names.erase(last);
+    CHECK(!directory::lookup(buf, last.c_str(), inum),
+          "spill: removed entry still found\n");
+    check_all("remove spilled", buf, names);
+    printf("spill: OK\n");
+}
+
+// Add until the directory is full: it grows to MAX_BUCKETS and no
+// further, and keeps everything added.
+static void test_growth() {
+    std::string buf;
+    std::map<std::string, unsigned int> names;
+    for (unsigned int i = 0;; i++) {
+        std::string n = name_of("a-name-of-some-length-", i);
+        if (!directory::add(buf, n.c_str(), i + 1))
+            break;
+        names[n] = i + 1;
+    }
+    CHECK(buf.size() == MAX_BUCKETS * directory::DIR_BUCKET,
+          "growth: full at %u buckets, expected %u\n",
+          (unsigned int)(buf.size() / directory::DIR_BUCKET), MAX_BUCKETS);
+    spilled(buf);
+    check_all("growth", buf, names);
+    printf("growth: OK, %u names in %u buckets\n", (unsigned int)names.size(),
+           MAX_BUCKETS);
+}
+
+// List a page at a time while names come and go between pages: every
+// name there all along is listed exactly once.
+static void test_cookies() {
+    std::string buf;
+    std::set<std::string> stable, gone;
+    std::vector<std::string> doomed;
+    for (unsigned int i = 0; i < 300; i++) {
+        std::string n = name_of("entry", i);
+        directory::add(buf, n.c_str(), i + 1);
+        if (i % 3)
+            stable.insert(n);
+        else
+            doomed.push_back(n);
+    }
+
+    std::map<std::string, unsigned int> seen;
+    unsigned int cookie = 0, added = 0;
+    extent_protocol::extentid_t inum;
+    while (true) {
+        std::vector<extent_protocol::dirent> ents;
+        bool eof = directory::list(buf, cookie, 7, ents);
+        for (unsigned int i = 0; i < ents.size(); i++)
+            seen[ents[i].name]++;
+        if (eof)
+            break;
+        // enough adds to grow the directory on the way
+        for (unsigned int i = 0; i < 10; i++, added++) {
+            std::string n = name_of("late", added);
+            directory::add(buf, n.c_str(), 5000 + added);
+            doomed.push_back(n);
+        }
+        for (unsigned int i = 0; i < 4 && !doomed.empty(); i++) {
+            directory::remove(buf, doomed.front().c_str(), inum);
+            gone.insert(doomed.front());
+            doomed.erase(doomed.begin());
+        }
+    }
+    for (std::set<std::string>::iterator it = stable.begin();
+         it != stable.end(); ++it)
+        CHECK(seen[*it] == 1, "cookies: %s listed %u times\n", it->c_str(),
+              seen[*it]);
+    for (std::map<std::string, unsigned int>::iterator it = seen.begin();
+         it != seen.end(); ++it)
+        CHECK(it->second == 1, "cookies: %s listed %u times\n",
+              it->first.c_str(), it->second);
+    printf("cookies: OK, %u listed, %u added and %u removed meanwhile\n",
+           (unsigned int)seen.size(), added, (unsigned int)gone.size());
+}
+
+// Names with the same hash share a cookie: a page never ends between
+// them, whatever its size.
+static void test_equal_hashes() {
+    std::map<unsigned int, std::string> by_hash;
+    std::vector<std::pair<std::string, std::string> > pairs;
+    for (unsigned int i = 0; pairs.size() < 4; i++) {
+        std::string n = name_of("c", i);
+        std::pair<std::map<unsigned int, std::string>::iterator, bool> r =
+            by_hash.insert(std::make_pair(hash(n), n));
+        if (!r.second)
+            pairs.push_back(std::make_pair(r.first->second, n));
+    }
+
+    std::string buf;
+    std::map<std::string, unsigned int> names;
+    unsigned int inum = 1;
+    for (unsigned int i = 0; i < 40; i++, inum++) {
+        names[name_of("other", i)] = inum;
+        directory::add(buf, name_of("other", i).c_str(), inum);
+    }
+    for (unsigned int i = 0; i < pairs.size(); i++, inum += 2) {
+        names[pairs[i].first] = inum;
+        names[pairs[i].second] = inum + 1;
+        directory::add(buf, pairs[i].first.c_str(), inum);
+        directory::add(buf, pairs[i].second.c_str(), inum + 1);
+    }
+    check_all("equal hashes", buf, names);
+
+    for (unsigned int max = 1; max <= names.size(); max++) {
+        std::map<std::string, unsigned int> seen;
+        unsigned int cookie = 0;
+        bool eof = false;
+        while (!eof) {
+            std::vector<extent_protocol::dirent> ents;
+            eof = directory::list(buf, cookie, max, ents);
+            for (unsigned int i = 0; i < ents.size(); i++)
+                seen[ents[i].name]++;
+            for (unsigned int i = 0; i < pairs.size(); i++) {
+                bool a = false, b = false;
+                for (unsigned int j = 0; j < ents.size(); j++) {
+                    a = a || ents[j].name == pairs[i].first;
+                    b = b || ents[j].name == pairs[i].second;
+                }
+                CHECK(a == b, "equal hashes: pages of %u split %s and %s\n",
+                      max, pairs[i].first.c_str(), pairs[i].second.c_str());
+            }
+        }
+        CHECK(seen.size() == names.size(),
+              "equal hashes: pages of %u listed %u of %u\n", max,
+              (unsigned int)seen.size(), (unsigned int)names.size());
+    }
+
+    // and one of a pair goes without the other
+    extent_protocol::extentid_t got;
+    CHECK(directory::remove(buf, pairs[0].second.c_str(), got) &&
+              got == names[pairs[0].second],
+          "equal hashes: remove failed\n");
+    names.erase(pairs[0].second);
+    check_all("equal hashes", buf, names);
+    printf("equal hashes: OK, %u pairs\n", (unsigned int)pairs.size());
+}
+
+// The bytes of buf a server would read for first: n buckets from it.
+static std::string part_of(const std::string& buf, unsigned int first,
+                           unsigned int n) {
+    if (first * directory::DIR_BUCKET >= buf.size())
+        return "";
+    return buf.substr(first * directory::DIR_BUCKET,
+                      n * directory::DIR_BUCKET);
+}
+
+// The calls on part of a directory, with windows grown from one bucket
+// until they are enough, give what the calls on all of it give.
+static void test_parts() {
+    std::string buf, whole;
+    unsigned int buckets, first, off, len, grew = 0, mores = 0;
+    extent_protocol::extentid_t got, want;
+    int r;
+
+    for (unsigned int i = 0; i < 3000; i++) {
+        std::string n = name_of("part", i);
+        buckets = buf.size() / directory::DIR_BUCKET;
+        first = directory::home(n.c_str(), buckets);
+        r = directory::MORE;
+        std::string part;
+        for (unsigned int w = 1; r == directory::MORE; w *= 2, mores++) {
+            part = part_of(buf, first, w);
+            r = directory::add(part, first, buckets, n.c_str(), i + 1, off,
+                               len);
+        }
+        mores--;
+        whole = buf;
+        directory::add(whole, n.c_str(), i + 1);
+        if (r == directory::GROW) {
+            grew++;
+            CHECK(directory::add(buf, n.c_str(), i + 1), "parts: add failed\n");
+        } else {
+            buf.replace(off, len,
+                        part.substr(off - first * directory::DIR_BUCKET, len));
+        }
+        CHECK(buf == whole, "parts: add of %s differs\n", n.c_str());
+    }
+    buckets = buf.size() / directory::DIR_BUCKET;
+
+    for (unsigned int i = 0; i < 3500; i++) {
+        std::string n = name_of("part", i);
+        bool found = directory::lookup(buf, n.c_str(), want);
+        first = directory::home(n.c_str(), buckets);
+        r = directory::MORE;
+        for (unsigned int w = 1; r == directory::MORE; w *= 2, mores++)
+            r = directory::lookup(part_of(buf, first, w), first, buckets,
+                                  n.c_str(), got);
+        mores--;
+        CHECK(found == (r == directory::DONE) && (!found || got == want),
+              "parts: lookup of %s differs\n", n.c_str());
+    }
+
+    for (unsigned int max = 1; max < 200; max *= 3) {
+        std::vector<extent_protocol::dirent> all, some;
+        unsigned int c1 = 0, c2 = 0;
+        bool eof = false;
+        while (!directory::list(buf, c1, max, all))
+            ;
+        while (!eof) {
+            first = directory::home(c2, buckets);
+            r = directory::MORE;
+            for (unsigned int w = 1; r == directory::MORE; w *= 2, mores++)
+                r = directory::list(part_of(buf, first, w), first, buckets,
+                                    c2, max, some, eof);
+            mores--;
+        }
+        CHECK(all.size() == some.size(), "parts: pages of %u list %u of %u\n",
+              max, (unsigned int)some.size(), (unsigned int)all.size());
+        for (unsigned int i = 0; i < all.size() && i < some.size(); i++)
+            CHECK(all[i].name == some[i].name, "parts: list differs at %u\n",
+                  i);
+    }
+
+    for (unsigned int i = 0; i < 3000; i += 2) {
+        std::string n = name_of("part", i);
+        first = directory::home(n.c_str(), buckets);
+        r = directory::MORE;
+        std::string part;
+        for (unsigned int w = 1; r == directory::MORE; w *= 2, mores++) {
+            part = part_of(buf, first, w);
+            r = directory::remove(part, first, buckets, n.c_str(), got, off,
+                                  len);
+        }
+        mores--;
+        CHECK(r == directory::DONE && got == i + 1,
+              "parts: remove of %s failed\n", n.c_str());
+        if (r == directory::DONE)
+            buf.replace(off, len,
+                        part.substr(off - first * directory::DIR_BUCKET, len));
+        CHECK(!directory::lookup(buf, n.c_str(), got),
+              "parts: %s still found\n", n.c_str());
+    }
+    spilled(buf);
+    printf("parts: OK, %u buckets, grew %u times, %u windows too small\n",
+           buckets, grew, mores);
+}
+
+int main(int argc, char* argv[]) {
+    test_spill();
+    test_growth();
+    test_cookies();
+    test_equal_hashes();
+    test_parts();
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("./directory_tester: passed all tests successfully\n");
+    return 0;
+}
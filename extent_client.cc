@@ -1,54 +1,487 @@
 // RPC stubs for clients to talk to extent_server
 
 #include "extent_client.h"
+#include "logger.h"
 #include <sstream>
 #include <iostream>
+#include <fstream>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 
-extent_client::extent_client(std::string dst) {
-    sockaddr_in dstsock;
-    make_sockaddr(dst.c_str(), &dstsock);
-    cl = new rpcc(dstsock);
-    if (cl->bind() != 0) {
-        printf("extent_client: bind failed\n");
+extent_client::extent_client(std::string dst, std::string xid) : id(xid) {
+    std::vector<std::string> addrs;
+    std::string addr;
+    std::ifstream conf(dst.c_str());
+    if (conf) {
+        while (conf >> addr)
+            addrs.push_back(addr);
+    } else {
+        std::istringstream ss(dst);
+        while (std::getline(ss, addr, ','))
+            if (!addr.empty())
+                addrs.push_back(addr);
     }
+
+    for (unsigned i = 0; i < addrs.size(); i++) {
+        sockaddr_in dstsock;
+        make_sockaddr(addrs[i].c_str(), &dstsock);
+        rpcc* c = new rpcc(dstsock);
+        if (c->bind() != 0) {
+            LOGE("extent_client: bind %s failed\n", addrs[i].c_str());
+        }
+        cls.push_back(c);
+        readers.push_back(std::vector<rpcc*>(1, c));
+    }
+    pthread_mutex_init(&readers_mutex, NULL);
+    for (unsigned i = 0; i < cls.size(); i++)
+        refresh(i);
+    pthread_mutex_init(&stream_mutex, NULL);
+    pthread_cond_init(&stream_cond, NULL);
+    pthread_cond_init(&chunk_cond, NULL);
+    for (unsigned i = 0; i + 1 < STREAM_WINDOW; i++) {
+        pthread_t th;
+        if (pthread_create(&th, NULL, stream_thread, this) == 0)
+            pthread_detach(th);
+    }
+    // clients start at different shards so their first directories spread
+    next_dir = getpid();
+    next_read = getpid();
+}
+
+// Ask shard s's primary which replicas it keeps up to date, and read
+// from those from now on. The primary calls us back for what a replica
+// it drops may have missed.
+void extent_client::refresh(unsigned s) {
+    std::vector<std::string> reps;
+    if (cls[s]->call(extent_protocol::replicas, id, reps) != extent_protocol::OK)
+        return;
+
+    std::vector<rpcc*> rs(1, cls[s]);
+    for (unsigned j = 0; j < reps.size(); j++) {
+        pthread_mutex_lock(&readers_mutex);
+        rpcc* rc = replica_cls[reps[j]];
+        pthread_mutex_unlock(&readers_mutex);
+        if (rc == NULL) {
+            sockaddr_in dstsock;
+            make_sockaddr(reps[j].c_str(), &dstsock);
+            rc = new rpcc(dstsock);
+            if (rc->bind() != 0) {
+                LOGW("extent_client: replica %s unreachable\n",
+                     reps[j].c_str());
+                delete rc;
+                continue;
+            }
+            pthread_mutex_lock(&readers_mutex);
+            replica_cls[reps[j]] = rc;
+            pthread_mutex_unlock(&readers_mutex);
+        }
+        rs.push_back(rc);
+    }
+    pthread_mutex_lock(&readers_mutex);
+    readers[s].swap(rs);
+    pthread_mutex_unlock(&readers_mutex);
+}
+
+rpcc* extent_client::reader(unsigned s) {
+    pthread_mutex_lock(&readers_mutex);
+    std::vector<rpcc*>& rs = readers[s];
+    rpcc* c = rs[0];
+    if (rs.size() > 1)
+        c = rs[__sync_fetch_and_add(&next_read, 1) % rs.size()];
+    pthread_mutex_unlock(&readers_mutex);
+    return c;
+}
+
+// Reads are spread over the shard's primary and replicas. The primary
+// forwards each mutation to its replicas before replying, and a replica
+// it has given up on stops serving reads before that reply, so a replica
+// that answers has every write that was flushed before our caller took
+// the extent's lock. A replica that is unreachable or refuses the read
+// falls back to the primary, and the replica list is fetched again. A
+// replica gets a lease's worth of time to answer.
+#define READ_CALL(s, ...)                                                \
+    do {                                                                 \
+        rpcc* c = reader(s);                                             \
+        if (c == cls[s]) {                                               \
+            ret = c->call(__VA_ARGS__);                                  \
+            break;                                                       \
+        }                                                                \
+        ret = c->call(__VA_ARGS__,                                       \
+                      rpcc::to(extent_protocol::REPLICA_LEASE_MS));      \
+        if (ret < 0 || ret == extent_protocol::STALE) {                  \
+            ret = cls[s]->call(__VA_ARGS__);                             \
+            refresh(s);                                                  \
+        }                                                                \
+    } while (0)
+
+// the shard owning eid; extent_server::local() is the other half
+unsigned extent_client::shard(extent_protocol::extentid_t eid) {
+    eid &= 0x7fffffff;
+    return eid == 0 ? 0 : (eid - 1) % cls.size();
 }
 
-// a demo to show how to use RPC
-extent_protocol::status extent_client::create(uint32_t type,
-                                              extent_protocol::extentid_t& id) {
+// Files live on their directory's shard, so a create and its directory
+// entry go out in one batch. Directories are dealt round-robin, which is
+// what spreads the tree across shards.
+unsigned extent_client::place(uint32_t type,
+                              extent_protocol::extentid_t parent) {
+    if (type == extent_protocol::T_DIR && cls.size() > 1)
+        return __sync_fetch_and_add(&next_dir, 1) % cls.size();
+    return shard(parent);
+}
+
+extent_protocol::status extent_client::create(
+    uint32_t type, extent_protocol::extentid_t parent,
+    extent_protocol::extentid_t& id) {
     extent_protocol::status ret = extent_protocol::OK;
-    ret = cl->call(extent_protocol::create, type, id);
+    ret = cls[place(type, parent)]->call(extent_protocol::create, type,
+                                         parent, id);
     return ret;
 }
 
 extent_protocol::status extent_client::get(extent_protocol::extentid_t eid,
                                            std::string& buf) {
-    extent_protocol::status ret = extent_protocol::OK;
-    ret = cl->call(extent_protocol::get, eid, buf);
+    extent_protocol::extent e;
+    extent_protocol::status ret = get_with_attr(eid, ~0U, e);
+    if (ret == extent_protocol::OK)
+        buf.swap(e.data);
     return ret;
 }
 
 extent_protocol::status extent_client::getattr(extent_protocol::extentid_t eid,
                                                extent_protocol::attr& attr) {
     extent_protocol::status ret = extent_protocol::OK;
-    ret = cl->call(extent_protocol::getattr, eid, attr);
+    READ_CALL(shard(eid), extent_protocol::getattr, eid, attr);
     return ret;
 }
 
+// A big extent is staged on the server a chunk at a time and then
+// committed, so no request is ever bigger than CHUNK_SIZE and the extent
+// changes in one step: no one sees it half written, and a failure
+// halfway leaves it as it was. The chunks go one at a time, in order.
+// Staging is kept by client id, so without one the chunks are written in
+// place instead, the first with a put that truncates.
 extent_protocol::status extent_client::put(extent_protocol::extentid_t eid,
-                                           std::string buf) {
+                                           const std::string& buf) {
     extent_protocol::status ret = extent_protocol::OK;
     int r;
-    ret = cl->call(extent_protocol::put, eid, buf, r);
+    if (buf.size() <= extent_protocol::CHUNK_SIZE)
+        return cl(eid)->call(extent_protocol::put, eid, buf, id, r);
+    for (unsigned int off = 0; ret == extent_protocol::OK && off < buf.size();
+         off += extent_protocol::CHUNK_SIZE) {
+        unsigned int len = buf.size() - off < extent_protocol::CHUNK_SIZE
+                               ? buf.size() - off
+                               : extent_protocol::CHUNK_SIZE;
+        if (!id.empty())
+            ret = cl(eid)->call(extent_protocol::stage, eid, off,
+                                buf.substr(off, len), id, r);
+        else if (off == 0)
+            ret = cl(eid)->call(extent_protocol::put, eid, buf.substr(0, len),
+                                id, r);
+        else
+            ret = cl(eid)->call(extent_protocol::put_range, eid, off,
+                                buf.substr(off, len), id, r);
+    }
+    if (id.empty())
+        return ret;
+    if (ret == extent_protocol::OK)
+        ret = cl(eid)->call(extent_protocol::commit, eid, id, r);
+    return ret;
+}
+
+extent_protocol::status extent_client::put_delta(
+    extent_protocol::extentid_t eid, unsigned long long base_version,
+    const std::vector<extent_protocol::delta_op>& ops,
+    extent_protocol::attr& a) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = cl(eid)->call(extent_protocol::put_delta, eid, base_version, ops, id,
+                        a);
     return ret;
 }
 
 extent_protocol::status extent_client::remove(extent_protocol::extentid_t eid) {
     extent_protocol::status ret = extent_protocol::OK;
     int r;
-    ret = cl->call(extent_protocol::remove, eid, r);
+    ret = cl(eid)->call(extent_protocol::remove, eid, id, r);
+    return ret;
+}
+
+extent_protocol::status extent_client::get_range(extent_protocol::extentid_t eid,
+                                                 unsigned int off,
+                                                 unsigned int len,
+                                                 std::string& buf) {
+    extent_protocol::status ret = extent_protocol::OK;
+    READ_CALL(shard(eid), extent_protocol::get_range, eid, off, len, id, buf);
+    return ret;
+}
+
+extent_protocol::status extent_client::put_range(extent_protocol::extentid_t eid,
+                                                 unsigned int off,
+                                                 const std::string& buf) {
+    extent_protocol::status ret = extent_protocol::OK;
+    int r;
+    ret = cl(eid)->call(extent_protocol::put_range, eid, off, buf, id, r);
+    return ret;
+}
+
+extent_protocol::status extent_client::truncate(extent_protocol::extentid_t eid,
+                                                unsigned int size) {
+    extent_protocol::status ret = extent_protocol::OK;
+    int r;
+    ret = cl(eid)->call(extent_protocol::truncate, eid, size, id, r);
+    return ret;
+}
+
+// One streamed read. The reading thread and the pool claim its chunks
+// in order and copy each into its place in the caller's buffer as it
+// arrives. All but eid and out are guarded by stream_mutex.
+struct extent_client::stream {
+    extent_protocol::extentid_t eid;
+    unsigned int size;
+    char* out;
+    unsigned int next;  // offset of the next unclaimed chunk
+    unsigned int busy;  // chunks claimed and not read yet
+    extent_protocol::status ret;
+};
+
+// Called with stream_mutex held.
+bool extent_client::claim(stream* st, unsigned int& off) {
+    if (st->next >= st->size || st->ret != extent_protocol::OK)
+        return false;
+    off = st->next;
+    st->next += extent_protocol::CHUNK_SIZE;
+    st->busy++;
+    return true;
+}
+
+// Called with stream_mutex held, which it lets go of around the RPC.
+void extent_client::read_chunk(stream* st, unsigned int off) {
+    unsigned int len = st->size - off < extent_protocol::CHUNK_SIZE
+                           ? st->size - off
+                           : extent_protocol::CHUNK_SIZE;
+    pthread_mutex_unlock(&stream_mutex);
+    std::string piece;
+    extent_protocol::status ret = get_range(st->eid, off, len, piece);
+    if (ret == extent_protocol::OK && piece.size() != len)
+        ret = extent_protocol::IOERR;
+    if (ret == extent_protocol::OK)
+        memcpy(st->out + off, piece.data(), len);
+    pthread_mutex_lock(&stream_mutex);
+    if (ret != extent_protocol::OK)
+        st->ret = ret;
+    st->busy--;
+    pthread_cond_broadcast(&chunk_cond);
+}
+
+void* extent_client::stream_thread(void* arg) {
+    extent_client* ec = (extent_client*)arg;
+    pthread_mutex_lock(&ec->stream_mutex);
+    while (true) {
+        stream* st = NULL;
+        unsigned int off = 0;
+        for (unsigned i = 0; i < ec->streams.size() && st == NULL; i++)
+            if (ec->claim(ec->streams[i], off))
+                st = ec->streams[i];
+        if (st == NULL)
+            pthread_cond_wait(&ec->stream_cond, &ec->stream_mutex);
+        else
+            ec->read_chunk(st, off);
+    }
+    return NULL;
+}
+
+// Read the first size bytes of eid in CHUNK_SIZE pieces, the calling
+// thread and the pool reading them together.
+extent_protocol::status extent_client::get_chunks(
+    extent_protocol::extentid_t eid, unsigned int size, std::string& buf) {
+    stream st;
+    st.eid = eid;
+    st.size = size;
+    buf.assign(size, '\0');
+    st.out = &buf[0];
+    st.next = 0;
+    st.busy = 0;
+    st.ret = extent_protocol::OK;
+
+    unsigned int off;
+    pthread_mutex_lock(&stream_mutex);
+    streams.push_back(&st);
+    pthread_cond_broadcast(&stream_cond);
+    while (claim(&st, off))
+        read_chunk(&st, off);
+    for (unsigned i = 0; i < streams.size(); i++)
+        if (streams[i] == &st) {
+            streams.erase(streams.begin() + i);
+            break;
+        }
+    while (st.busy > 0)
+        pthread_cond_wait(&chunk_cond, &stream_mutex);
+    pthread_mutex_unlock(&stream_mutex);
+
+    if (st.ret != extent_protocol::OK)
+        buf.clear();
+    return st.ret;
+}
+
+// Replies carry at most CHUNK_SIZE of data; anything bigger that the
+// caller asked for is streamed after the reply.
+extent_protocol::status extent_client::get_with_attr(
+    extent_protocol::extentid_t eid, unsigned int limit,
+    extent_protocol::extent& e) {
+    extent_protocol::status ret = extent_protocol::OK;
+    unsigned int first = limit < extent_protocol::CHUNK_SIZE
+                             ? limit
+                             : extent_protocol::CHUNK_SIZE;
+    READ_CALL(shard(eid), extent_protocol::get_with_attr, eid, first, id, e);
+    if (ret == extent_protocol::OK && !e.has_data && e.a.size <= limit) {
+        ret = get_chunks(eid, e.a.size, e.data);
+        e.has_data = ret == extent_protocol::OK;
+    }
+    return ret;
+}
+
+extent_protocol::status extent_client::get_if_changed(
+    extent_protocol::extentid_t eid, unsigned long long version,
+    extent_protocol::extent& e) {
+    extent_protocol::status ret = extent_protocol::OK;
+    READ_CALL(shard(eid), extent_protocol::get_if_changed, eid, version, id, e);
+    if (ret == extent_protocol::OK && !e.has_data && e.a.version != version) {
+        ret = get_chunks(eid, e.a.size, e.data);
+        e.has_data = ret == extent_protocol::OK;
+    }
+    return ret;
+}
+
+extent_protocol::status extent_client::getattr_many(
+    const std::vector<extent_protocol::extentid_t>& eids,
+    std::vector<extent_protocol::attr>& as) {
+    extent_protocol::status ret = extent_protocol::OK;
+    if (cls.size() == 1) {
+        READ_CALL(0, extent_protocol::getattr_many, eids, id, as);
+        return ret;
+    }
+
+    // one request per shard, answers put back in the caller's order
+    std::vector<std::vector<extent_protocol::extentid_t> > sub(cls.size());
+    std::vector<std::vector<unsigned> > idx(cls.size());
+    for (unsigned i = 0; i < eids.size(); i++) {
+        unsigned s = shard(eids[i]);
+        sub[s].push_back(eids[i]);
+        idx[s].push_back(i);
+    }
+    as.resize(eids.size());
+    for (unsigned s = 0; s < cls.size(); s++) {
+        if (sub[s].empty())
+            continue;
+        std::vector<extent_protocol::attr> r;
+        READ_CALL(s, extent_protocol::getattr_many, sub[s], id, r);
+        if (ret != extent_protocol::OK)
+            return ret;
+        if (r.size() != sub[s].size())
+            return extent_protocol::RPCERR;
+        for (unsigned j = 0; j < r.size(); j++)
+            as[idx[s][j]] = r[j];
+    }
+    return extent_protocol::OK;
+}
+
+extent_protocol::status extent_client::batch(
+    const std::vector<extent_protocol::op>& ops,
+    std::vector<extent_protocol::op_result>& rs) {
+    if (cls.size() == 1)
+        return cls[0]->call(extent_protocol::batch, ops, id, rs);
+
+    // Split into one batch per shard, keeping the order within each. A
+    // directory entry for an extent just created on another shard has to
+    // wait for that shard's reply to learn the id, so it goes out after.
+    std::vector<std::vector<extent_protocol::op> > sub(cls.size());
+    std::vector<std::vector<unsigned> > idx(cls.size());
+    std::vector<std::pair<unsigned, unsigned> > deferred;  // (op, its create)
+    int created = -1;
+    unsigned created_shard = 0;
+    for (unsigned i = 0; i < ops.size(); i++) {
+        const extent_protocol::op& o = ops[i];
+        unsigned s = shard(o.eid);
+        if (o.kind == extent_protocol::OP_CREATE) {
+            s = place(o.type, o.eid);
+            created = i;
+            created_shard = s;
+        } else if (o.kind == extent_protocol::OP_DIR_ADD && o.off == 0 &&
+                   created >= 0 && created_shard != s) {
+            deferred.push_back(std::make_pair(i, (unsigned)created));
+            continue;
+        }
+        sub[s].push_back(o);
+        idx[s].push_back(i);
+    }
+
+    extent_protocol::status ret = extent_protocol::OK;
+    rs.resize(ops.size());
+    for (unsigned s = 0; s < cls.size(); s++) {
+        if (sub[s].empty())
+            continue;
+        std::vector<extent_protocol::op_result> r;
+        extent_protocol::status st =
+            cls[s]->call(extent_protocol::batch, sub[s], id, r);
+        for (unsigned j = 0; j < idx[s].size(); j++) {
+            if (r.size() == idx[s].size()) {
+                rs[idx[s][j]] = r[j];
+            } else {
+                rs[idx[s][j]] = extent_protocol::op_result();
+                rs[idx[s][j]].status = extent_protocol::RPCERR;
+            }
+        }
+        if (st != extent_protocol::OK && ret == extent_protocol::OK)
+            ret = st;
+    }
+    for (unsigned j = 0; j < deferred.size(); j++) {
+        const extent_protocol::op& o = ops[deferred[j].first];
+        extent_protocol::op_result& res = rs[deferred[j].first];
+        const extent_protocol::op_result& c = rs[deferred[j].second];
+        res = extent_protocol::op_result();
+        res.eid = o.eid;
+        res.status = c.status == extent_protocol::OK
+                         ? dir_add(o.eid, o.data, c.eid)
+                         : c.status;
+        if (res.status != extent_protocol::OK && ret == extent_protocol::OK)
+            ret = res.status;
+    }
+    return ret;
+}
+
+extent_protocol::status extent_client::dir_lookup(
+    extent_protocol::extentid_t dir, std::string name,
+    extent_protocol::extentid_t& inum) {
+    extent_protocol::status ret = extent_protocol::OK;
+    READ_CALL(shard(dir), extent_protocol::dir_lookup, dir, name, id, inum);
+    return ret;
+}
+
+extent_protocol::status extent_client::dir_add(
+    extent_protocol::extentid_t dir, std::string name,
+    extent_protocol::extentid_t inum) {
+    extent_protocol::status ret = extent_protocol::OK;
+    int r;
+    ret = cl(dir)->call(extent_protocol::dir_add, dir, name, inum, id, r);
+    return ret;
+}
+
+extent_protocol::status extent_client::dir_remove(
+    extent_protocol::extentid_t dir, std::string name,
+    extent_protocol::extentid_t& inum) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = cl(dir)->call(extent_protocol::dir_remove, dir, name, id, inum);
+    return ret;
+}
+
+extent_protocol::status extent_client::dir_list(
+    extent_protocol::extentid_t dir, unsigned int cookie, unsigned int max,
+    extent_protocol::dir_page& page) {
+    extent_protocol::status ret = extent_protocol::OK;
+    READ_CALL(shard(dir), extent_protocol::dir_list, dir, cookie, max, id,
+              page);
     return ret;
 }
@@ -4,23 +4,96 @@
 #define extent_client_h
 
 #include <string>
+#include <vector>
+#include <map>
+#include <deque>
 #include "extent_protocol.h"
 #include "extent_server.h"
 
+// Talks to one extent server, or to n shards of the extent space. dst is
+// "host:port[,host:port...]" or the name of a file listing one server per
+// line, in shard order (the k-th runs with -s k/n). id is the address the
+// caller serves rextent_protocol on; servers call it back when extents it
+// read change. Without an id, nothing read is tracked.
 class extent_client {
  private:
-  rpcc *cl;
+  std::string id;
+  std::vector<rpcc *> cls;
+  // per shard, the primary and then its read replicas
+  std::vector<std::vector<rpcc *> > readers;
+  std::map<std::string, rpcc *> replica_cls;  // every replica bound so far
+  pthread_mutex_t readers_mutex;  // guards readers and replica_cls
+  unsigned next_dir;   // round-robin cursor for placing new directories
+  unsigned next_read;  // round-robin cursor over each shard's readers
+
+  unsigned shard(extent_protocol::extentid_t eid);
+  unsigned place(uint32_t type, extent_protocol::extentid_t parent);
+  rpcc *cl(extent_protocol::extentid_t eid) { return cls[shard(eid)]; }
+  rpcc *reader(unsigned s);
+  void refresh(unsigned s);
+
+  // Extents over CHUNK_SIZE are read with up to this many get_range
+  // calls in flight at once: the reading thread's own, and those of the
+  // STREAM_WINDOW - 1 threads of a pool shared by all reads.
+  static const unsigned int STREAM_WINDOW = 4;
+  struct stream;
+  std::deque<stream *> streams;  // reads with chunks left to claim
+  pthread_mutex_t stream_mutex;  // guards streams and their bookkeeping
+  pthread_cond_t stream_cond;    // a read was queued
+  pthread_cond_t chunk_cond;     // a chunk was read
+  static void *stream_thread(void *arg);
+  bool claim(stream *st, unsigned int &off);
+  void read_chunk(stream *st, unsigned int off);
+  extent_protocol::status get_chunks(extent_protocol::extentid_t eid,
+                                     unsigned int size, std::string &buf);
 
  public:
-  extent_client(std::string dst);
+  extent_client(std::string dst, std::string id = "");
 
-  extent_protocol::status create(uint32_t type, extent_protocol::extentid_t &eid);
+  extent_protocol::status create(uint32_t type, extent_protocol::extentid_t parent,
+                                 extent_protocol::extentid_t &eid);
   extent_protocol::status get(extent_protocol::extentid_t eid, 
 			                        std::string &buf);
   extent_protocol::status getattr(extent_protocol::extentid_t eid, 
 				                          extent_protocol::attr &a);
-  extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
+  extent_protocol::status put(extent_protocol::extentid_t eid,
+                              const std::string &buf);
+  // put the extent as ops against its version base_version, see delta.h
+  extent_protocol::status put_delta(
+      extent_protocol::extentid_t eid, unsigned long long base_version,
+      const std::vector<extent_protocol::delta_op> &ops,
+      extent_protocol::attr &a);
   extent_protocol::status remove(extent_protocol::extentid_t eid);
+  extent_protocol::status get_range(extent_protocol::extentid_t eid,
+                                    unsigned int off, unsigned int len,
+                                    std::string &buf);
+  extent_protocol::status put_range(extent_protocol::extentid_t eid,
+                                    unsigned int off, const std::string &buf);
+  extent_protocol::status truncate(extent_protocol::extentid_t eid,
+                                   unsigned int size);
+  extent_protocol::status get_with_attr(extent_protocol::extentid_t eid,
+                                        unsigned int limit,
+                                        extent_protocol::extent &e);
+  extent_protocol::status get_if_changed(extent_protocol::extentid_t eid,
+                                         unsigned long long version,
+                                         extent_protocol::extent &e);
+  extent_protocol::status getattr_many(
+      const std::vector<extent_protocol::extentid_t> &eids,
+      std::vector<extent_protocol::attr> &as);
+  extent_protocol::status batch(const std::vector<extent_protocol::op> &ops,
+                                std::vector<extent_protocol::op_result> &rs);
+  extent_protocol::status dir_lookup(extent_protocol::extentid_t dir,
+                                     std::string name,
+                                     extent_protocol::extentid_t &inum);
+  extent_protocol::status dir_add(extent_protocol::extentid_t dir,
+                                  std::string name,
+                                  extent_protocol::extentid_t inum);
+  extent_protocol::status dir_remove(extent_protocol::extentid_t dir,
+                                     std::string name,
+                                     extent_protocol::extentid_t &inum);
+  extent_protocol::status dir_list(extent_protocol::extentid_t dir,
+                                   unsigned int cookie, unsigned int max,
+                                   extent_protocol::dir_page &page);
 };
 
 #endif 
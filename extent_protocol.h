@@ -9,26 +9,148 @@ class extent_protocol {
 public:
     typedef int status;
     typedef unsigned long long extentid_t;
-    enum xxstatus { OK, RPCERR, NOENT, IOERR };
-    enum rpc_numbers { put = 0x6001, get, getattr, remove, create };
+    // STALE: the extent is no longer at the version the caller named, or a
+    // replica that may have fallen behind its primary refuses a read
+    enum xxstatus { OK, RPCERR, NOENT, IOERR, EXIST, STALE };
+    enum rpc_numbers {
+        put = 0x6001,
+        get,
+        getattr,
+        remove,
+        create,
+        get_range,
+        put_range,
+        truncate,
+        get_with_attr,
+        getattr_many,
+        batch,
+        dir_lookup,
+        dir_add,
+        dir_remove,
+        dir_list,
+        replicate,
+        replicas,
+        get_if_changed,
+        stats,
+        put_delta,
+        stage,
+        commit
+    };
 
     enum types { T_DIR = 1, T_FILE, T_SYMLINK };
 
+    // largest piece of extent data one RPC carries; bigger extents are
+    // streamed with get_range, and staged and committed, see
+    // extent_client.
+    static const unsigned int CHUNK_SIZE = 32768;
+
+    // A replica serves reads only this long after it last heard from its
+    // primary, which heartbeats it four times as often. A primary that
+    // gives up on a replica waits this long before acknowledging the write
+    // the replica missed, so the replica has stopped serving reads by then.
+    static const unsigned int REPLICA_LEASE_MS = 1000;
+
     struct attr {
         uint32_t type;
         unsigned int atime;
         unsigned int mtime;
         unsigned int ctime;
         unsigned int size;
+        // bumped by every change to the extent, never reused
+        unsigned long long version;
+    };
+
+    // reply of get_with_attr and get_if_changed: data is left empty when
+    // has_data is false.
+    struct extent {
+        attr a;
+        bool has_data;
+        std::string data;
+    };
+
+    struct dirent {
+        std::string name;
+        extentid_t inum;
+    };
+    // one page of dir_list; pass next as the cookie of the following call.
+    struct dir_page {
+        std::vector<dirent> entries;
+        unsigned int next;
+        bool eof;
+    };
+
+    // one step of a batch RPC. create uses eid as the parent and type;
+    // put_range uses off, truncate uses off as the new size. dir_add links
+    // data as a name in directory eid to inum off, or to the extent made by
+    // the last create of the batch if off is 0, and fails if that create
+    // failed or there was none. In a replicate RPC, ids are the primary's
+    // store ids, create makes extent eid itself, and version is the
+    // version the primary gave the result, or for remove the version
+    // removed. reset and resynced only come in a replicate RPC: reset
+    // removes every extent before the primary copies its own over, and the
+    // replica refuses reads until resynced says the copy is complete.
+    enum op_kinds {
+        OP_CREATE = 1,
+        OP_PUT,
+        OP_PUT_RANGE,
+        OP_TRUNCATE,
+        OP_REMOVE,
+        OP_GETATTR,
+        OP_DIR_ADD,
+        OP_RESET,
+        OP_RESYNCED
+    };
+    struct op {
+        op(uint32_t k = 0, extentid_t e = 0)
+            : kind(k), eid(e), type(0), off(0), version(0) {}
+        uint32_t kind;
+        extentid_t eid;
+        uint32_t type;
+        unsigned int off;
+        unsigned long long version;
+        std::string data;
+    };
+    // eid is the new extent for create, a the attributes for getattr.
+    struct op_result {
+        int status;
+        extentid_t eid;
+        attr a;
+    };
+    // one step of a put_delta: copy len bytes of the base extent from off,
+    // or, if data is not empty, insert data.
+    struct delta_op {
+        unsigned int off;
+        unsigned int len;
+        std::string data;
+    };
+
+    // one row of the stats reply: counts of one kind of op, and the
+    // buckets of a latency_hist (see stats.h) for each phase of it.
+    struct op_stats {
+        std::string name;
+        unsigned long long calls;
+        unsigned long long bytes;
+        std::vector<unsigned long long> rpc, store, block;
     };
 };
 
+// calls from extent_server to the clients caching an extent
+class rextent_protocol {
+public:
+    enum xxstatus { OK, RPCERR };
+    typedef int status;
+    // invalidate(std::vector<extentid_t> eids, int&): drop cached copies;
+    // an eid of 0 stands for every extent
+    enum rpc_numbers { invalidate = 0x9001 };
+};
+
 inline unmarshall& operator>>(unmarshall& u, extent_protocol::attr& a) {
     u >> a.type;
     u >> a.atime;
     u >> a.mtime;
     u >> a.ctime;
     u >> a.size;
+    u >> a.version;
     return u;
 }
 
@@ -38,6 +160,115 @@ inline marshall& operator<<(marshall& m, extent_protocol::attr a) {
     m << a.mtime;
     m << a.ctime;
     m << a.size;
+    m << a.version;
+    return m;
+}
+
+inline unmarshall& operator>>(unmarshall& u, extent_protocol::extent& e) {
+    u >> e.a;
+    u >> e.has_data;
+    u >> e.data;
+    return u;
+}
+
+inline marshall& operator<<(marshall& m, const extent_protocol::extent& e) {
+    m << e.a;
+    m << e.has_data;
+    m << e.data;
+    return m;
+}
+
+inline unmarshall& operator>>(unmarshall& u, extent_protocol::dirent& d) {
+    u >> d.name;
+    u >> d.inum;
+    return u;
+}
+
+inline marshall& operator<<(marshall& m, const extent_protocol::dirent& d) {
+    m << d.name;
+    m << d.inum;
+    return m;
+}
+
+inline unmarshall& operator>>(unmarshall& u, extent_protocol::dir_page& p) {
+    u >> p.entries;
+    u >> p.next;
+    u >> p.eof;
+    return u;
+}
+
+inline marshall& operator<<(marshall& m, const extent_protocol::dir_page& p) {
+    m << p.entries;
+    m << p.next;
+    m << p.eof;
+    return m;
+}
+
+inline unmarshall& operator>>(unmarshall& u, extent_protocol::op& o) {
+    u >> o.kind;
+    u >> o.eid;
+    u >> o.type;
+    u >> o.off;
+    u >> o.version;
+    u >> o.data;
+    return u;
+}
+
+inline marshall& operator<<(marshall& m, const extent_protocol::op& o) {
+    m << o.kind;
+    m << o.eid;
+    m << o.type;
+    m << o.off;
+    m << o.version;
+    m << o.data;
+    return m;
+}
+
+inline unmarshall& operator>>(unmarshall& u, extent_protocol::op_result& r) {
+    u >> r.status;
+    u >> r.eid;
+    u >> r.a;
+    return u;
+}
+
+inline marshall& operator<<(marshall& m, const extent_protocol::op_result& r) {
+    m << r.status;
+    m << r.eid;
+    m << r.a;
+    return m;
+}
+
+inline unmarshall& operator>>(unmarshall& u, extent_protocol::delta_op& d) {
+    u >> d.off;
+    u >> d.len;
+    u >> d.data;
+    return u;
+}
+
+inline marshall& operator<<(marshall& m, const extent_protocol::delta_op& d) {
+    m << d.off;
+    m << d.len;
+    m << d.data;
+    return m;
+}
+
+inline unmarshall& operator>>(unmarshall& u, extent_protocol::op_stats& s) {
+    u >> s.name;
+    u >> s.calls;
+    u >> s.bytes;
+    u >> s.rpc;
+    u >> s.store;
+    u >> s.block;
+    return u;
+}
+
+inline marshall& operator<<(marshall& m, const extent_protocol::op_stats& s) {
+    m << s.name;
+    m << s.calls;
+    m << s.bytes;
+    m << s.rpc;
+    m << s.store;
+    m << s.block;
     return m;
 }
 
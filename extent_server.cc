@@ -1,6 +1,11 @@
 // the extent server implementation
 
 #include "extent_server.h"
+#include "directory.h"
+#include "delta.h"
+#include "logger.h"
+#include "handle.h"
+#include "stats.h"
 #include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,72 +14,842 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
-extent_server::extent_server() 
+extent_server::extent_server(extent_store *s, unsigned k, unsigned n)
 {
-  im = new inode_manager();
+  store = s;
+  shard = k;
+  nshards = n;
+  lease_end = 0;
+  diverged = false;
+  syncing = false;
+  drops_seen = 0;
+  for(unsigned i = 0; i < DIR_STRIPES; i++)
+    pthread_mutex_init(&dir_locks[i], NULL);
+  pthread_mutex_init(&drops_mutex, NULL);
+  pthread_mutex_init(&readers_mutex, NULL);
+  pthread_mutex_init(&staged_mutex, NULL);
 }
 
-int extent_server::create(uint32_t type, extent_protocol::extentid_t &id)
+// Ids on the wire are global. Shard k of n owns ids k+1, k+1+n, k+1+2n,
+// ... and stores them as 1, 2, 3, ..., so each shard allocates from its
+// own engine without asking the others. Ids of other shards map to 0,
+// which no engine hands out.
+extent_protocol::extentid_t
+extent_server::local(extent_protocol::extentid_t id)
 {
-  // alloc a new inode and return inum
-  printf("extent_server: create inode\n");
-  id = im->alloc_inode(type);
+  id &= 0x7fffffff;
+  if(id == 0 || (id - 1) % nshards != shard)
+    return 0;
+  return (id - 1) / nshards + 1;
+}
+
+extent_protocol::extentid_t
+extent_server::global(extent_protocol::extentid_t id)
+{
+  if(id == 0)
+    return 0;
+  return (id - 1) * nshards + shard + 1;
+}
+
+bool extent_server::fenced()
+{
+  unsigned long long end = __atomic_load_n(&lease_end, __ATOMIC_ACQUIRE);
+  return end != 0 && (diverged || syncing || stat_now() > end);
+}
+
+// A forgotten client is told to drop everything it caches before it may
+// cache more. OK once it has, or if it was never forgotten.
+int extent_server::reach(const std::string &cid)
+{
+  if(cid.empty())
+    return extent_protocol::OK;
+  pthread_mutex_lock(&readers_mutex);
+  std::map<std::string, unsigned>::iterator it = forgotten.find(cid);
+  unsigned times = it == forgotten.end() ? 0 : it->second;
+  pthread_mutex_unlock(&readers_mutex);
+  if(times == 0)
+    return extent_protocol::OK;
 
+  if(!invalidate(cid, std::vector<extent_protocol::extentid_t>(1, 0)))
+    return extent_protocol::IOERR;
+  LOGI("extent_server: %s is back and dropped its cache\n", cid.c_str());
+  // unless a callback failed again meanwhile
+  pthread_mutex_lock(&readers_mutex);
+  it = forgotten.find(cid);
+  if(it != forgotten.end() && it->second == times)
+    forgotten.erase(it);
+  pthread_mutex_unlock(&readers_mutex);
   return extent_protocol::OK;
 }
 
-int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &)
+// Register before reading, so a change racing with the read still calls
+// the reader back. A client that cannot be reached gets nothing to
+// cache.
+int extent_server::add_reader(extent_protocol::extentid_t id,
+                              const std::string &cid)
 {
-  id &= 0x7fffffff;
-  
-  const char * cbuf = buf.c_str();
-  int size = buf.size();
-  im->write_file(id, cbuf, size);
-  
+  int ret;
+  if(cid.empty())
+    return extent_protocol::OK;
+  if((ret = reach(cid)) != extent_protocol::OK)
+    return ret;
+  pthread_mutex_lock(&readers_mutex);
+  readers[id].insert(cid);
+  pthread_mutex_unlock(&readers_mutex);
   return extent_protocol::OK;
 }
 
-int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
+// id has changed: every reader but the writer must drop its copy. The
+// writer may keep caching what it wrote, so it becomes the only reader.
+void extent_server::changed(extent_protocol::extentid_t id,
+                            const std::string &writer, callbacks &cbs)
 {
-  printf("extent_server: get %lld\n", id);
+  pthread_mutex_lock(&readers_mutex);
+  std::set<std::string> &rs = readers[id];
+  for(std::set<std::string>::iterator c = rs.begin(); c != rs.end(); ++c)
+    if(*c != writer)
+      cbs[*c].push_back(id);
+  rs.clear();
+  if(!writer.empty())
+    rs.insert(writer);
+  else
+    readers.erase(id);
+  pthread_mutex_unlock(&readers_mutex);
+}
 
-  id &= 0x7fffffff;
+// Tell cid to drop eids, trying CALLBACK_TRIES times. A client that
+// could not be bound is bound afresh on the next try.
+bool extent_server::invalidate(const std::string &cid,
+                               const std::vector<extent_protocol::extentid_t> &eids)
+{
+  for(int i = 0; i < CALLBACK_TRIES; i++){
+    if(i)
+      usleep(100000);
+    handle h(cid);
+    rpcc *cl = h.safebind();
+    int r;
+    if(cl == NULL){
+      mgr.delete_handle(cid);
+      continue;
+    }
+    if(cl->call(rextent_protocol::invalidate, eids, r, rpcc::to(1000)) ==
+       rextent_protocol::OK)
+      return true;
+  }
+  return false;
+}
+
+// Runs before the mutating request replies: once a writer's flush returns
+// and it gives up the lock, no other client still trusts the old data.
+// A client that cannot be reached is forgotten: it stops being a reader
+// of anything, so later writes do not wait on it, and it is made to drop
+// its cache when it shows up again.
+void extent_server::call_back(const callbacks &cbs)
+{
+  if(store->drops() != __atomic_load_n(&drops_seen, __ATOMIC_ACQUIRE))
+    replica_dropped();
+  send_callbacks(cbs);
+}
 
-  int size = 0;
-  char *cbuf = NULL;
+// A dropped replica called back none of the clients it served, so they
+// may cache what it missed. The store counts a drop once the replica has
+// stopped serving reads; from then on every client that was sent to
+// replicas drops everything, or is forgotten. Requests replying
+// meanwhile wait for that on drops_mutex.
+void extent_server::replica_dropped()
+{
+  callbacks all;
 
-  im->read_file(id, &cbuf, &size);
-  if (size == 0)
-    buf = "";
-  else {
-    buf.assign(cbuf, size);
-    free(cbuf);
+  pthread_mutex_lock(&drops_mutex);
+  unsigned long long n = store->drops();
+  if(n != drops_seen){
+    pthread_mutex_lock(&readers_mutex);
+    for(std::set<std::string>::iterator it = replica_readers.begin();
+        it != replica_readers.end(); ++it)
+      all[*it].push_back(0);
+    pthread_mutex_unlock(&readers_mutex);
+    LOGW("extent_server: a replica was dropped, %u clients drop their "
+         "caches\n", (unsigned)all.size());
+    send_callbacks(all);
+    __atomic_store_n(&drops_seen, n, __ATOMIC_RELEASE);
   }
+  pthread_mutex_unlock(&drops_mutex);
+}
 
-  return extent_protocol::OK;
+void extent_server::send_callbacks(const callbacks &cbs)
+{
+  for(callbacks::const_iterator it = cbs.begin(); it != cbs.end(); ++it){
+    if(invalidate(it->first, it->second))
+      continue;
+    LOGW("extent_server: invalidate %s failed, forgetting it\n",
+         it->first.c_str());
+    pthread_mutex_lock(&readers_mutex);
+    forgotten[it->first]++;
+    std::map<extent_protocol::extentid_t, std::set<std::string> >::iterator
+        r = readers.begin();
+    while(r != readers.end()){
+      r->second.erase(it->first);
+      if(r->second.empty())
+        readers.erase(r++);
+      else
+        ++r;
+    }
+    pthread_mutex_unlock(&readers_mutex);
+    // nor will it commit what it staged
+    pthread_mutex_lock(&staged_mutex);
+    staged_map::iterator st =
+        staged.lower_bound(
+        std::make_pair(it->first, (extent_protocol::extentid_t)0));
+    while(st != staged.end() && st->first.first == it->first)
+      staged.erase(st++);
+    pthread_mutex_unlock(&staged_mutex);
+  }
+}
+
+int extent_server::create(uint32_t type, extent_protocol::extentid_t parent,
+                          extent_protocol::extentid_t &id)
+{
+  // alloc a new inode near its parent and return inum
+  LOGD("extent_server: create inode\n");
+  stat_scope st(opstats, server_stats::CREATE);
+  parent = local(parent);
+  int ret = store->create(type, parent, id);
+  id = global(id);
+  return ret;
+}
+
+int extent_server::do_put(extent_protocol::extentid_t id,
+                          const std::string &buf, const std::string &cid,
+                          callbacks &cbs)
+{
+  stat_scope st(opstats, server_stats::PUT);
+  st.bytes = buf.size();
+  int ret = store->put(local(id), buf);
+  if(ret == extent_protocol::OK)
+    changed(id, cid, cbs);
+  return ret;
+}
+
+int extent_server::put(extent_protocol::extentid_t id, std::string buf,
+                       std::string cid, int &)
+{
+  callbacks cbs;
+  int ret = do_put(id, buf, cid, cbs);
+  call_back(cbs);
+  return ret;
+}
+
+int extent_server::put_delta(extent_protocol::extentid_t id,
+                             unsigned long long base_version,
+                             std::vector<extent_protocol::delta_op> ops,
+                             std::string cid, extent_protocol::attr &a)
+{
+  extent_protocol::extent base;
+  std::string buf;
+  callbacks cbs;
+  int ret;
+
+  // Counted as a delta rather than a put, with the bytes that came over
+  // the wire; the put below goes straight to the store so that it is not
+  // counted again.
+  stat_scope st(opstats, server_stats::DELTA);
+  for(unsigned i = 0; i < ops.size(); i++)
+    st.bytes += ops[i].data.size();
+  if((ret = store->get_with_attr(local(id), ~0U, base)) !=
+     extent_protocol::OK)
+    return ret;
+  // Only the client holding id's lock writes it, so the version cannot
+  // move between this check and the put.
+  if(base.a.version != base_version){
+    LOGD("extent_server: put_delta %lld stale\n", id);
+    return extent_protocol::STALE;
+  }
+  if(!delta::apply(base.data, ops, buf))
+    return extent_protocol::IOERR;
+  if((ret = store->put(local(id), buf)) == extent_protocol::OK){
+    changed(id, cid, cbs);
+    ret = store->getattr(local(id), a);
+  }
+  call_back(cbs);
+  return ret;
+}
+
+int extent_server::get(extent_protocol::extentid_t id, std::string cid,
+                       std::string &buf)
+{
+  LOGD("extent_server: get %lld\n", id);
+
+  stat_scope st(opstats, server_stats::GET);
+  if(fenced())
+    return extent_protocol::STALE;
+  int ret;
+  if((ret = add_reader(id, cid)) != extent_protocol::OK)
+    return ret;
+  id = local(id);
+  ret = store->get(id, buf);
+  st.bytes = buf.size();
+  return ret;
 }
 
 int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
 {
-  printf("extent_server: getattr %lld\n", id);
+  LOGD("extent_server: getattr %lld\n", id);
 
-  id &= 0x7fffffff;
-  
-  extent_protocol::attr attr;
-  memset(&attr, 0, sizeof(attr));
-  im->getattr(id, attr);
-  a = attr;
+  stat_scope st(opstats, server_stats::GETATTR);
+  if(fenced())
+    return extent_protocol::STALE;
+  id = local(id);
+  return store->getattr(id, a);
+}
+
+int extent_server::do_remove(extent_protocol::extentid_t id,
+                             const std::string &cid, callbacks &cbs)
+{
+  LOGD("extent_server: remove %lld\n", id);
+
+  stat_scope st(opstats, server_stats::REMOVE);
+  int ret = store->remove(local(id));
+  if(ret == extent_protocol::OK){
+    changed(id, cid, cbs);
+    pthread_mutex_lock(&readers_mutex);
+    readers.erase(id);
+    pthread_mutex_unlock(&readers_mutex);
+  }
+  return ret;
+}
+
+int extent_server::remove(extent_protocol::extentid_t id, std::string cid,
+                          int &)
+{
+  callbacks cbs;
+  int ret = do_remove(id, cid, cbs);
+  call_back(cbs);
+  return ret;
+}
+
+int extent_server::get_range(extent_protocol::extentid_t id, unsigned int off,
+                             unsigned int len, std::string cid,
+                             std::string &buf)
+{
+  stat_scope st(opstats, server_stats::GET);
+  if(fenced())
+    return extent_protocol::STALE;
+  int ret;
+  if((ret = add_reader(id, cid)) != extent_protocol::OK)
+    return ret;
+  id = local(id);
+  ret = store->get_range(id, off, len, buf);
+  st.bytes = buf.size();
+  return ret;
+}
+
+int extent_server::do_put_range(extent_protocol::extentid_t id,
+                                unsigned int off, const std::string &buf,
+                                const std::string &cid, callbacks &cbs)
+{
+  stat_scope st(opstats, server_stats::PUT);
+  st.bytes = buf.size();
+  int ret = store->put_range(local(id), off, buf);
+  if(ret == extent_protocol::OK)
+    changed(id, cid, cbs);
+  return ret;
+}
+
+int extent_server::put_range(extent_protocol::extentid_t id, unsigned int off,
+                             std::string buf, std::string cid, int &)
+{
+  callbacks cbs;
+  int ret = do_put_range(id, off, buf, cid, cbs);
+  call_back(cbs);
+  return ret;
+}
+
+// A client that gives up halfway leaves its staged bytes behind until it
+// stages the same extent again.
+int extent_server::stage(extent_protocol::extentid_t id, unsigned int off,
+                         std::string buf, std::string cid, int &)
+{
+  stat_scope st(opstats, server_stats::STAGE);
+  st.bytes = buf.size();
+  int ret = extent_protocol::OK;
+  time_t now = time(NULL);
+
+  if(cid.empty())
+    return extent_protocol::IOERR;
+  pthread_mutex_lock(&staged_mutex);
+  // puts abandoned halfway
+  for(staged_map::iterator it = staged.begin(); it != staged.end();){
+    if(now - it->second.touched > STAGE_TIMEOUT)
+      staged.erase(it++);
+    else
+      ++it;
+  }
+  staged_put &p = staged[std::make_pair(cid, id)];
+  p.touched = now;
+  if(off != 0 && off != p.data.size())
+    ret = extent_protocol::IOERR;
+  else if(off + buf.size() > MAX_STAGED)
+    ret = extent_protocol::IOERR;
+  else if(off == 0)
+    p.data.swap(buf);
+  else
+    p.data.append(buf);
+  if(ret != extent_protocol::OK)
+    staged.erase(std::make_pair(cid, id));
+  pthread_mutex_unlock(&staged_mutex);
+  return ret;
+}
+
+// Counted as one put of the whole extent; the chunks were counted as
+// stages.
+int extent_server::commit(extent_protocol::extentid_t id, std::string cid,
+                          int &)
+{
+  stat_scope st(opstats, server_stats::PUT);
+  std::string buf;
+  callbacks cbs;
+
+  if(cid.empty())
+    return extent_protocol::IOERR;
+  pthread_mutex_lock(&staged_mutex);
+  staged_map::iterator it = staged.find(std::make_pair(cid, id));
+  bool found = it != staged.end();
+  if(found){
+    buf.swap(it->second.data);
+    staged.erase(it);
+  }
+  pthread_mutex_unlock(&staged_mutex);
+  if(!found)
+    return extent_protocol::IOERR;
 
+  st.bytes = buf.size();
+  int ret = store->put(local(id), buf);
+  if(ret == extent_protocol::OK)
+    changed(id, cid, cbs);
+  call_back(cbs);
+  return ret;
+}
+
+int extent_server::do_truncate(extent_protocol::extentid_t id,
+                               unsigned int size, const std::string &cid,
+                               callbacks &cbs)
+{
+  stat_scope st(opstats, server_stats::PUT);
+  int ret = store->truncate(local(id), size);
+  if(ret == extent_protocol::OK)
+    changed(id, cid, cbs);
+  return ret;
+}
+
+int extent_server::truncate(extent_protocol::extentid_t id, unsigned int size,
+                            std::string cid, int &)
+{
+  callbacks cbs;
+  int ret = do_truncate(id, size, cid, cbs);
+  call_back(cbs);
+  return ret;
+}
+
+int extent_server::get_with_attr(extent_protocol::extentid_t id,
+                                 unsigned int limit, std::string cid,
+                                 extent_protocol::extent &e)
+{
+  stat_scope st(opstats, server_stats::GET);
+  if(fenced())
+    return extent_protocol::STALE;
+  int ret;
+  if((ret = add_reader(id, cid)) != extent_protocol::OK)
+    return ret;
+  id = local(id);
+  ret = store->get_with_attr(id, limit, e);
+  st.bytes = e.data.size();
+  return ret;
+}
+
+// the extent if its version is no longer `version`; otherwise just its
+// attributes, and the caller's copy is still good. Data over CHUNK_SIZE
+// is left for the caller to stream with get_range.
+int extent_server::get_if_changed(extent_protocol::extentid_t id,
+                                  unsigned long long version, std::string cid,
+                                  extent_protocol::extent &e)
+{
+  int ret;
+  stat_scope st(opstats, server_stats::GET);
+  if(fenced())
+    return extent_protocol::STALE;
+
+  if((ret = add_reader(id, cid)) != extent_protocol::OK)
+    return ret;
+  id = local(id);
+  e.has_data = false;
+  if ((ret = store->getattr(id, e.a)) != extent_protocol::OK)
+    return ret;
+  LOGD("extent_server: get_if_changed %lld %s\n", id,
+       e.a.version == version ? "unchanged" : "changed");
+  if (e.a.version == version)
+    return extent_protocol::OK;
+  ret = store->get_with_attr(id, extent_protocol::CHUNK_SIZE, e);
+  st.bytes = e.data.size();
+  return ret;
+}
+
+// attributes of many extents in one reply; missing ones come back with
+// type 0.
+int extent_server::getattr_many(std::vector<extent_protocol::extentid_t> ids,
+                                std::string cid,
+                                std::vector<extent_protocol::attr> &as)
+{
+  stat_scope st(opstats, server_stats::GETATTR);
+  if(fenced())
+    return extent_protocol::STALE;
+  as.resize(ids.size());
+  for (unsigned i = 0; i < ids.size(); i++) {
+    if (add_reader(ids[i], cid) != extent_protocol::OK ||
+        store->getattr(local(ids[i]), as[i]) != extent_protocol::OK)
+      memset(&as[i], 0, sizeof(as[i]));
+  }
   return extent_protocol::OK;
 }
 
-int extent_server::remove(extent_protocol::extentid_t id, int &)
+// run ops in order and reply once. Every op runs even if an earlier one
+// failed; the first failure is also the status of the whole batch.
+int extent_server::batch(std::vector<extent_protocol::op> ops, std::string cid,
+                         std::vector<extent_protocol::op_result> &rs)
 {
-  printf("extent_server: write %lld\n", id);
+  int ret = extent_protocol::OK;
+  extent_protocol::extentid_t created = 0;
+  callbacks cbs;
 
-  id &= 0x7fffffff;
-  im->remove_file(id);
- 
+  rs.resize(ops.size());
+  for (unsigned i = 0; i < ops.size(); i++) {
+    extent_protocol::op &o = ops[i];
+    extent_protocol::op_result &res = rs[i];
+    memset(&res.a, 0, sizeof(res.a));
+    res.eid = o.eid;
+    switch (o.kind) {
+    case extent_protocol::OP_CREATE:
+      if((res.status = reach(cid)) == extent_protocol::OK)
+        res.status = create(o.type, o.eid, res.eid);
+      // a failed create leaves nothing for a later dir_add to link
+      created = res.status == extent_protocol::OK ? res.eid : 0;
+      // the creator caches the new, empty extent
+      if(created)
+        add_reader(created, cid);
+      break;
+    case extent_protocol::OP_PUT:
+      res.status = do_put(o.eid, o.data, cid, cbs);
+      break;
+    case extent_protocol::OP_PUT_RANGE:
+      res.status = do_put_range(o.eid, o.off, o.data, cid, cbs);
+      break;
+    case extent_protocol::OP_TRUNCATE:
+      res.status = do_truncate(o.eid, o.off, cid, cbs);
+      break;
+    case extent_protocol::OP_REMOVE:
+      res.status = do_remove(o.eid, cid, cbs);
+      break;
+    case extent_protocol::OP_GETATTR:
+      res.status = getattr(o.eid, res.a);
+      break;
+    case extent_protocol::OP_DIR_ADD:
+      if(!o.off && !created)
+        res.status = extent_protocol::IOERR;
+      else
+        res.status = do_dir_add(o.eid, o.data, o.off ? o.off : created,
+                                cid, cbs);
+      break;
+    default:
+      res.status = extent_protocol::IOERR;
+    }
+    // writes report the new attributes, so the writer knows the version
+    // its copy now matches
+    if (res.status == extent_protocol::OK &&
+        (o.kind == extent_protocol::OP_PUT ||
+         o.kind == extent_protocol::OP_PUT_RANGE ||
+         o.kind == extent_protocol::OP_TRUNCATE))
+      store->getattr(local(o.eid), res.a);
+    if (res.status != extent_protocol::OK && ret == extent_protocol::OK)
+      ret = res.status;
+  }
+  call_back(cbs);
+  return ret;
+}
+
+// directory operations run against the directory extent here, so clients
+// need not fetch and ship back whole directories.
+
+pthread_mutex_t *extent_server::dir_lock(extent_protocol::extentid_t dir)
+{
+  return &dir_locks[dir % DIR_STRIPES];
+}
+
+// Read n buckets of store directory dir from the home of name, or of
+// cookie if name is NULL, and how many buckets it has. Both come from
+// the directory's size, so the reads start over if it changed in
+// between, which its version tells.
+int extent_server::dir_read(extent_protocol::extentid_t dir,
+                            const char *name, unsigned int cookie,
+                            unsigned int n, unsigned int &first,
+                            unsigned int &buckets, std::string &part)
+{
+  extent_protocol::attr a, b;
+  int ret;
+
+  do {
+    if ((ret = store->getattr(dir, a)) != extent_protocol::OK)
+      return ret;
+    buckets = a.size / directory::DIR_BUCKET;
+    first = name ? directory::home(name, buckets)
+                 : directory::home(cookie, buckets);
+    part.clear();
+    if (buckets > 0 &&
+        (ret = store->get_range(dir, first * directory::DIR_BUCKET,
+                                n * directory::DIR_BUCKET, part)) !=
+            extent_protocol::OK)
+      return ret;
+    if ((ret = store->getattr(dir, b)) != extent_protocol::OK)
+      return ret;
+  } while (a.version != b.version);
   return extent_protocol::OK;
 }
 
+int extent_server::dir_lookup(extent_protocol::extentid_t dir,
+                              std::string name, std::string cid,
+                              extent_protocol::extentid_t &inum)
+{
+  stat_scope st(opstats, server_stats::DIR);
+  std::string part;
+  unsigned int first, buckets;
+  int ret, r = directory::MORE;
+
+  if(fenced())
+    return extent_protocol::STALE;
+  if((ret = add_reader(dir, cid)) != extent_protocol::OK)
+    return ret;
+  dir = local(dir);
+  for (unsigned int n = DIR_WINDOW; r == directory::MORE; n *= 2) {
+    ret = dir_read(dir, name.c_str(), 0, n, first, buckets, part);
+    if (ret != extent_protocol::OK)
+      return ret;
+    r = directory::lookup(part, first, buckets, name.c_str(), inum);
+  }
+  return r == directory::DONE ? extent_protocol::OK : extent_protocol::NOENT;
+}
+
+int extent_server::do_dir_add(extent_protocol::extentid_t gdir,
+                              const std::string &name,
+                              extent_protocol::extentid_t inum,
+                              const std::string &cid, callbacks &cbs)
+{
+  stat_scope st(opstats, server_stats::DIR);
+  std::string part;
+  extent_protocol::extentid_t old;
+  extent_protocol::extentid_t dir = local(gdir);
+  unsigned int first, buckets, off, len;
+  int ret, r = directory::MORE;
+
+  pthread_mutex_lock(dir_lock(dir));
+  for (unsigned int n = DIR_WINDOW; r == directory::MORE; n *= 2) {
+    ret = dir_read(dir, name.c_str(), 0, n, first, buckets, part);
+    if (ret != extent_protocol::OK)
+      goto release;
+    r = directory::lookup(part, first, buckets, name.c_str(), old);
+    if (r == directory::DONE) {
+      ret = extent_protocol::EXIST;
+      goto release;
+    }
+    if (r == directory::MISSING)
+      r = directory::add(part, first, buckets, name.c_str(), inum, off, len);
+  }
+  // only the buckets the entry went in are written, unless it grew
+  if (r == directory::DONE) {
+    ret = store->put_range(dir, off,
+        part.substr(off - first * directory::DIR_BUCKET, len));
+  } else if ((ret = store->get(dir, part)) == extent_protocol::OK) {
+    if (directory::add(part, name.c_str(), inum, off, len))
+      ret = store->put_range(dir, off, part.substr(off, len));
+    else
+      ret = extent_protocol::IOERR;
+  }
+
+release:
+  pthread_mutex_unlock(dir_lock(dir));
+  if (ret == extent_protocol::OK)
+    changed(gdir, cid, cbs);
+  return ret;
+}
+
+int extent_server::dir_add(extent_protocol::extentid_t dir, std::string name,
+                           extent_protocol::extentid_t inum, std::string cid,
+                           int &)
+{
+  callbacks cbs;
+  int ret = do_dir_add(dir, name, inum, cid, cbs);
+  call_back(cbs);
+  return ret;
+}
+
+int extent_server::do_dir_remove(extent_protocol::extentid_t gdir,
+                                 const std::string &name,
+                                 extent_protocol::extentid_t &inum,
+                                 const std::string &cid, callbacks &cbs)
+{
+  stat_scope st(opstats, server_stats::DIR);
+  std::string part;
+  extent_protocol::extentid_t dir = local(gdir);
+  unsigned int first, buckets, off, len;
+  int ret, r = directory::MORE;
+
+  pthread_mutex_lock(dir_lock(dir));
+  for (unsigned int n = DIR_WINDOW; r == directory::MORE; n *= 2) {
+    ret = dir_read(dir, name.c_str(), 0, n, first, buckets, part);
+    if (ret != extent_protocol::OK)
+      goto release;
+    r = directory::remove(part, first, buckets, name.c_str(), inum, off,
+                          len);
+  }
+  if (r == directory::DONE)
+    ret = store->put_range(dir, off,
+        part.substr(off - first * directory::DIR_BUCKET, len));
+  else
+    ret = extent_protocol::NOENT;
+
+release:
+  pthread_mutex_unlock(dir_lock(dir));
+  if (ret == extent_protocol::OK)
+    changed(gdir, cid, cbs);
+  return ret;
+}
+
+int extent_server::dir_remove(extent_protocol::extentid_t dir,
+                              std::string name, std::string cid,
+                              extent_protocol::extentid_t &inum)
+{
+  callbacks cbs;
+  int ret = do_dir_remove(dir, name, inum, cid, cbs);
+  call_back(cbs);
+  return ret;
+}
+
+int extent_server::dir_list(extent_protocol::extentid_t dir,
+                            unsigned int cookie, unsigned int max,
+                            std::string cid, extent_protocol::dir_page &page)
+{
+  stat_scope st(opstats, server_stats::DIR);
+  std::string part;
+  unsigned int first, buckets;
+  int ret, r = directory::MORE;
+
+  if(fenced())
+    return extent_protocol::STALE;
+  if((ret = add_reader(dir, cid)) != extent_protocol::OK)
+    return ret;
+  dir = local(dir);
+  for (unsigned int n = DIR_WINDOW; r == directory::MORE; n *= 2) {
+    ret = dir_read(dir, NULL, cookie, n, first, buckets, part);
+    if (ret != extent_protocol::OK)
+      return ret;
+    r = directory::list(part, first, buckets, cookie, max, page.entries,
+                        page.eof);
+  }
+  page.next = cookie;
+  return extent_protocol::OK;
+}
+
+// mutations from our primary, already applied there. Ids are store ids,
+// so they bypass the shard translation. Clients that read from this
+// replica are called back here; the writer is not known, so it may be
+// called back too, which only costs it a revalidation.
+int extent_server::replicate(std::vector<extent_protocol::op> ops, int &)
+{
+  int ret = extent_protocol::OK;
+  int r;
+  callbacks cbs;
+  extent_protocol::attr cur;
+
+  for (unsigned i = 0; i < ops.size(); i++) {
+    extent_protocol::op &o = ops[i];
+    if (o.kind == extent_protocol::OP_RESET) {
+      // the primary copies everything over next
+      std::vector<extent_protocol::extentid_t> ids;
+      syncing = true;
+      diverged = false;
+      store->ids(ids);
+      for (unsigned j = 0; j < ids.size(); j++) {
+        store->remove(ids[j]);
+        changed(global(ids[j]), "", cbs);
+      }
+      continue;
+    }
+    if (o.kind == extent_protocol::OP_RESYNCED) {
+      syncing = false;
+      continue;
+    }
+    // A mutation held up on a connection the primary gave up on may
+    // arrive after the copy that replaced it: its version gives it away.
+    if (o.version != 0 && store->getattr(o.eid, cur) == extent_protocol::OK &&
+        (o.kind == extent_protocol::OP_REMOVE ? cur.version > o.version
+                                              : cur.version >= o.version))
+      continue;
+    // keep the primary's version, so versions read here mean the same
+    // as versions read there
+    store->pin_version(o.eid, o.version);
+    switch (o.kind) {
+    case extent_protocol::OP_CREATE:
+      r = store->create_at(o.type, o.eid);
+      break;
+    case extent_protocol::OP_PUT:
+      r = store->put(o.eid, o.data);
+      break;
+    case extent_protocol::OP_PUT_RANGE:
+      r = store->put_range(o.eid, o.off, o.data);
+      break;
+    case extent_protocol::OP_TRUNCATE:
+      r = store->truncate(o.eid, o.off);
+      break;
+    case extent_protocol::OP_REMOVE:
+      r = store->remove(o.eid);
+      break;
+    default:
+      r = extent_protocol::IOERR;
+    }
+    store->pin_version(o.eid, 0);
+    if (r != extent_protocol::OK) {
+      LOGE("extent_server: replicate op %u on %llu failed: %d\n", o.kind,
+           o.eid, r);
+      // we no longer match the primary, so stop serving reads
+      diverged = true;
+      if (ret == extent_protocol::OK)
+        ret = r;
+    } else if (o.kind != extent_protocol::OP_CREATE) {
+      changed(global(o.eid), "", cbs);
+    }
+  }
+
+  // An empty batch is a heartbeat, which only renews the lease. Renewed
+  // last, so a reset is in force before reads are let in again.
+  __atomic_store_n(&lease_end,
+                   stat_now() + extent_protocol::REPLICA_LEASE_MS * 1000000ULL,
+                   __ATOMIC_RELEASE);
+  call_back(cbs);
+  return ret;
+}
+
+// the replicas clients may read from; cid is remembered, see
+// replica_dropped()
+int extent_server::replicas(std::string cid, std::vector<std::string> &addrs)
+{
+  store->replicas(addrs);
+  if(!cid.empty() && !addrs.empty()){
+    pthread_mutex_lock(&readers_mutex);
+    replica_readers.insert(cid);
+    pthread_mutex_unlock(&readers_mutex);
+  }
+  return extent_protocol::OK;
+}
+
+int extent_server::get_stats(int, std::vector<extent_protocol::op_stats> &out)
+{
+  opstats.snapshot(out);
+  return extent_protocol::OK;
+}
@@ -5,28 +5,157 @@
 
 #include <string>
 #include <map>
+#include <set>
+#include <time.h>
 #include "extent_protocol.h"
-#include "inode_manager.h"
+#include "extent_store.h"
+#include "stats.h"
 
 class extent_server {
  protected:
-#if 0
-  typedef struct extent {
+  extent_store *store;
+  // Directory changes made here are serialized per directory, by a lock
+  // of DIR_STRIPES picked by its id. They and directory reads only touch
+  // the buckets they need, DIR_WINDOW of them at first.
+  enum { DIR_STRIPES = 64, DIR_WINDOW = 2 };
+  pthread_mutex_t dir_locks[DIR_STRIPES];
+  // this server is shard `shard` of `nshards`; see local()
+  unsigned shard;
+  unsigned nshards;
+  server_stats opstats;
+
+  extent_protocol::extentid_t local(extent_protocol::extentid_t id);
+  extent_protocol::extentid_t global(extent_protocol::extentid_t id);
+
+  // Clients that read, create or write an extent through a call carrying
+  // their id are called back when someone else changes it, and forgotten
+  // until they read it again.
+  // cbs collects the callbacks of one request, to send one invalidate
+  // per client.
+  typedef std::map<std::string, std::vector<extent_protocol::extentid_t> >
+      callbacks;
+  std::map<extent_protocol::extentid_t, std::set<std::string> > readers;
+  // Clients a callback never reached, with how often. They may still
+  // cache what changed, so before their next read they are told to drop
+  // everything.
+  std::map<std::string, unsigned> forgotten;
+  // clients given replicas to read from, which call back only those they
+  // served
+  std::set<std::string> replica_readers;
+  pthread_mutex_t readers_mutex;  // guards the three above
+  unsigned long long drops_seen;  // store->drops() already called back for
+  pthread_mutex_t drops_mutex;
+  // tries of an invalidate before its client is forgotten
+  static const int CALLBACK_TRIES = 3;
+
+  // the bytes of puts too big for one RPC, by client and extent, until
+  // they are committed, the client is forgotten, or STAGE_TIMEOUT seconds
+  // pass without a chunk. No more than an extent can hold.
+  struct staged_put {
     std::string data;
-    struct extent_protocol::attr attr;
-  } extent_t;
-  std::map <extent_protocol::extentid_t, extent_t> extents;
-#endif
-  inode_manager *im;
+    time_t touched;
+  };
+  typedef std::map<std::pair<std::string, extent_protocol::extentid_t>,
+                   staged_put> staged_map;
+  staged_map staged;
+  pthread_mutex_t staged_mutex;
+  static const int STAGE_TIMEOUT = 60;
+  static const unsigned int MAX_STAGED = MAXFILE * BLOCK_SIZE;
+
+  // Set while a primary replicates to us: reads are refused once it has
+  // not been heard from for REPLICA_LEASE_MS, while it copies everything
+  // over afresh, and from when one of its mutations fails here until
+  // such a copy.
+  unsigned long long lease_end;  // stat_now() ns, 0 on a primary
+  bool diverged;
+  bool syncing;
+  bool fenced();
+
+  int reach(const std::string &cid);
+  int add_reader(extent_protocol::extentid_t id, const std::string &cid);
+  bool invalidate(const std::string &cid,
+                  const std::vector<extent_protocol::extentid_t> &eids);
+  void changed(extent_protocol::extentid_t id, const std::string &writer,
+               callbacks &cbs);
+  void call_back(const callbacks &cbs);
+  void send_callbacks(const callbacks &cbs);
+  void replica_dropped();
+
+  pthread_mutex_t *dir_lock(extent_protocol::extentid_t dir);
+  int dir_read(extent_protocol::extentid_t dir, const char *name,
+               unsigned int cookie, unsigned int n, unsigned int &first,
+               unsigned int &buckets, std::string &part);
+
+  int do_put(extent_protocol::extentid_t id, const std::string &buf,
+             const std::string &cid, callbacks &cbs);
+  int do_remove(extent_protocol::extentid_t id, const std::string &cid,
+                callbacks &cbs);
+  int do_put_range(extent_protocol::extentid_t id, unsigned int off,
+                   const std::string &buf, const std::string &cid,
+                   callbacks &cbs);
+  int do_truncate(extent_protocol::extentid_t id, unsigned int size,
+                  const std::string &cid, callbacks &cbs);
+  int do_dir_add(extent_protocol::extentid_t dir, const std::string &name,
+                 extent_protocol::extentid_t inum, const std::string &cid,
+                 callbacks &cbs);
+  int do_dir_remove(extent_protocol::extentid_t dir, const std::string &name,
+                    extent_protocol::extentid_t &inum, const std::string &cid,
+                    callbacks &cbs);
 
  public:
-  extent_server();
+  extent_server(extent_store *s, unsigned shard = 0, unsigned nshards = 1);
 
-  int create(uint32_t type, extent_protocol::extentid_t &id);
-  int put(extent_protocol::extentid_t id, std::string, int &);
-  int get(extent_protocol::extentid_t id, std::string &);
+  int create(uint32_t type, extent_protocol::extentid_t parent,
+             extent_protocol::extentid_t &id);
+  // cid, where taken, is the caller's callback address, or "" for a
+  // caller that caches nothing.
+  int put(extent_protocol::extentid_t id, std::string, std::string cid,
+          int &);
+  int get(extent_protocol::extentid_t id, std::string cid, std::string &);
   int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
-  int remove(extent_protocol::extentid_t id, int &);
+  int remove(extent_protocol::extentid_t id, std::string cid, int &);
+  int get_range(extent_protocol::extentid_t id, unsigned int off,
+                unsigned int len, std::string cid, std::string &);
+  // put the extent rebuilt from its version base_version and ops; STALE
+  // if it has moved on since. Returns the new attributes. The caller
+  // must hold id's lock, see put_delta in extent_server.cc.
+  int put_delta(extent_protocol::extentid_t id,
+                unsigned long long base_version,
+                std::vector<extent_protocol::delta_op> ops, std::string cid,
+                extent_protocol::attr &);
+  int put_range(extent_protocol::extentid_t id, unsigned int off,
+                std::string, std::string cid, int &);
+  // hold data at off of a put of id to come; off 0 starts it afresh.
+  // Staging needs a cid, to tell one client's put from another's.
+  int stage(extent_protocol::extentid_t id, unsigned int off, std::string,
+            std::string cid, int &);
+  // put the bytes staged for id as its content, in one step
+  int commit(extent_protocol::extentid_t id, std::string cid, int &);
+  int truncate(extent_protocol::extentid_t id, unsigned int size,
+               std::string cid, int &);
+  int get_with_attr(extent_protocol::extentid_t id, unsigned int limit,
+                    std::string cid, extent_protocol::extent &);
+  int get_if_changed(extent_protocol::extentid_t id,
+                     unsigned long long version, std::string cid,
+                     extent_protocol::extent &);
+  int getattr_many(std::vector<extent_protocol::extentid_t> ids,
+                   std::string cid, std::vector<extent_protocol::attr> &);
+  int batch(std::vector<extent_protocol::op> ops, std::string cid,
+            std::vector<extent_protocol::op_result> &);
+
+  int dir_lookup(extent_protocol::extentid_t dir, std::string name,
+                 std::string cid, extent_protocol::extentid_t &inum);
+  int dir_add(extent_protocol::extentid_t dir, std::string name,
+              extent_protocol::extentid_t inum, std::string cid, int &);
+  int dir_remove(extent_protocol::extentid_t dir, std::string name,
+                 std::string cid, extent_protocol::extentid_t &inum);
+  int dir_list(extent_protocol::extentid_t dir, unsigned int cookie,
+               unsigned int max, std::string cid,
+               extent_protocol::dir_page &);
+  int replicate(std::vector<extent_protocol::op> ops, int &);
+  int replicas(std::string cid, std::vector<std::string> &addrs);
+  // per-op counts, bytes and latency histograms since startup
+  int get_stats(int, std::vector<extent_protocol::op_stats> &);
 };
 
 #endif 
@@ -4,18 +4,57 @@
 #include <stdio.h>
 #include "extent_server.h"
 #include <unistd.h>
+#include <sstream>
 // Main loop of extent server
 
 int
 main(int argc, char *argv[])
 {
   int count = 0;
+  std::string engine = "inode";
+  unsigned shard = 0, nshards = 1;
+  std::vector<std::string> replicas;
+  int ch;
 
-  if(argc != 2){
-    fprintf(stderr, "Usage: %s port\n", argv[0]);
+  // -s k/n: serve shard k of n; clients list all n servers in shard order
+  // -r host:port,...: be the primary of these replicas, which run with
+  //    the same -e and -s but no -r
+  while((ch = getopt(argc, argv, "e:s:r:")) != -1){
+    switch(ch){
+    case 'e':
+      engine = optarg;
+      break;
+    case 's':
+      if(sscanf(optarg, "%u/%u", &shard, &nshards) != 2 ||
+         nshards == 0 || shard >= nshards){
+        fprintf(stderr, "%s: bad shard %s\n", argv[0], optarg);
+        exit(1);
+      }
+      break;
+    case 'r':
+      {
+        std::istringstream ss(optarg);
+        std::string addr;
+        while(std::getline(ss, addr, ','))
+          if(!addr.empty())
+            replicas.push_back(addr);
+      }
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-e inode|mem] [-s k/n] [-r replicas] port\n",
+              argv[0]);
+      exit(1);
+    }
+  }
+
+  if(argc - optind != 1){
+    fprintf(stderr, "Usage: %s [-e inode|mem] [-s k/n] [-r replicas] port\n",
+            argv[0]);
     exit(1);
   }
 
+  // jsl_log inside the prebuilt librpc still prints with printf; unbuffered,
+  // its lines reach stdout in order with the logger's writes
   setvbuf(stdout, NULL, _IONBF, 0);
 
   char *count_env = getenv("RPC_COUNT");
@@ -23,14 +62,42 @@ main(int argc, char *argv[])
     count = atoi(count_env);
   }
 
-  rpcs server(atoi(argv[1]), count);
-  extent_server ls;
+  extent_store *store = extent_store::make(engine);
+  if(store == NULL){
+    fprintf(stderr, "%s: unknown storage engine %s\n", argv[0], engine.c_str());
+    exit(1);
+  }
+  if(!replicas.empty())
+    store = new replicated_store(store, replicas);
+  store = new coalescing_store(store);
+  store = new timed_store(store);
+
+  rpcs server(atoi(argv[optind]), count);
+  extent_server ls(store, shard, nshards);
 
   server.reg(extent_protocol::get, &ls, &extent_server::get);
   server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
   server.reg(extent_protocol::put, &ls, &extent_server::put);
   server.reg(extent_protocol::remove, &ls, &extent_server::remove);
   server.reg(extent_protocol::create, &ls, &extent_server::create);
+  server.reg(extent_protocol::get_range, &ls, &extent_server::get_range);
+  server.reg(extent_protocol::put_range, &ls, &extent_server::put_range);
+  server.reg(extent_protocol::truncate, &ls, &extent_server::truncate);
+  server.reg(extent_protocol::get_with_attr, &ls, &extent_server::get_with_attr);
+  server.reg(extent_protocol::getattr_many, &ls, &extent_server::getattr_many);
+  server.reg(extent_protocol::batch, &ls, &extent_server::batch);
+  server.reg(extent_protocol::dir_lookup, &ls, &extent_server::dir_lookup);
+  server.reg(extent_protocol::dir_add, &ls, &extent_server::dir_add);
+  server.reg(extent_protocol::dir_remove, &ls, &extent_server::dir_remove);
+  server.reg(extent_protocol::dir_list, &ls, &extent_server::dir_list);
+  server.reg(extent_protocol::replicate, &ls, &extent_server::replicate);
+  server.reg(extent_protocol::replicas, &ls, &extent_server::replicas);
+  server.reg(extent_protocol::get_if_changed, &ls,
+             &extent_server::get_if_changed);
+  server.reg(extent_protocol::stats, &ls, &extent_server::get_stats);
+  server.reg(extent_protocol::put_delta, &ls, &extent_server::put_delta);
+  server.reg(extent_protocol::stage, &ls, &extent_server::stage);
+  server.reg(extent_protocol::commit, &ls, &extent_server::commit);
 
   while(1)
     sleep(1000);
@@ -0,0 +1,83 @@
+//
+// Print the per-op stats of extent servers
+//
+
+#include "extent_protocol.h"
+#include "stats.h"
+#include "rpc.h"
+#include <arpa/inet.h>
+#include <sstream>
+#include <vector>
+#include <stdlib.h>
+#include <stdio.h>
+
+// add the counts of b into a
+static void
+merge(std::vector<unsigned long long> &a, const std::vector<unsigned long long> &b)
+{
+  if(a.size() < b.size())
+    a.resize(b.size());
+  for(unsigned i = 0; i < b.size(); i++)
+    a[i] += b[i];
+}
+
+static void
+print_phase(const char *phase, const std::vector<unsigned long long> &h)
+{
+  printf("  %-6s %10.1f %10.1f %10.1f\n", phase,
+         latency_hist::percentile(h, 0.50) / 1000.0,
+         latency_hist::percentile(h, 0.99) / 1000.0,
+         latency_hist::percentile(h, 0.999) / 1000.0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  if(argc != 2){
+    fprintf(stderr, "Usage: %s host:port[,host:port...]\n", argv[0]);
+    fprintf(stderr, "sums the stats of all servers listed, e.g. all shards\n");
+    exit(1);
+  }
+
+  std::vector<extent_protocol::op_stats> total;
+  std::istringstream ss(argv[1]);
+  std::string addr;
+  while(std::getline(ss, addr, ',')){
+    if(addr.empty())
+      continue;
+    sockaddr_in dstsock;
+    make_sockaddr(addr.c_str(), &dstsock);
+    rpcc cl(dstsock);
+    std::vector<extent_protocol::op_stats> st;
+    int r = 0;
+    if(cl.bind() != 0 ||
+       cl.call(extent_protocol::stats, r, st) != extent_protocol::OK){
+      fprintf(stderr, "%s: no stats from %s\n", argv[0], addr.c_str());
+      exit(1);
+    }
+    if(total.empty()){
+      total = st;
+      continue;
+    }
+    for(unsigned i = 0; i < st.size() && i < total.size(); i++){
+      total[i].calls += st[i].calls;
+      total[i].bytes += st[i].bytes;
+      merge(total[i].rpc, st[i].rpc);
+      merge(total[i].store, st[i].store);
+      merge(total[i].block, st[i].block);
+    }
+  }
+
+  printf("latencies in microseconds\n");
+  for(unsigned i = 0; i < total.size(); i++){
+    const extent_protocol::op_stats &s = total[i];
+    printf("%-8s calls %llu bytes %llu\n", s.name.c_str(), s.calls, s.bytes);
+    if(s.calls == 0)
+      continue;
+    printf("  %-6s %10s %10s %10s\n", "phase", "p50", "p99", "p999");
+    print_phase("rpc", s.rpc);
+    print_phase("store", s.store);
+    print_phase("block", s.block);
+  }
+  return 0;
+}
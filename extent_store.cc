@@ -0,0 +1,1043 @@
+// storage engines behind extent_server
+
+#include "extent_store.h"
+#include "logger.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <ctime>
+#include "lang/verify.h"
+
+extent_store* extent_store::make(const std::string& name) {
+    if (name == "inode")
+        return new inode_store();
+    if (name == "mem")
+        return new mem_store();
+    return NULL;
+}
+
+extent_protocol::status extent_store::get_with_attr(
+    extent_protocol::extentid_t id, unsigned int limit,
+    extent_protocol::extent& e) {
+    extent_protocol::status ret = getattr(id, e.a);
+    e.has_data = false;
+    if (ret != extent_protocol::OK || e.a.size > limit)
+        return ret;
+    ret = get(id, e.data);
+    e.has_data = ret == extent_protocol::OK;
+    return ret;
+}
+
+// inode engine -----------------------------------------
+
+inode_store::inode_store() { im = new inode_manager(); }
+
+inode_store::~inode_store() { delete im; }
+
+extent_protocol::status inode_store::create(uint32_t type,
+                                            extent_protocol::extentid_t parent,
+                                            extent_protocol::extentid_t& id) {
+    id = im->alloc_inode(type, parent);
+    if (id == 0)
+        return extent_protocol::IOERR;  // out of inodes
+    return extent_protocol::OK;
+}
+
+extent_protocol::status inode_store::create_at(uint32_t type,
+                                               extent_protocol::extentid_t id) {
+    if (!im->alloc_inode_at(type, id))
+        return extent_protocol::EXIST;
+    return extent_protocol::OK;
+}
+
+extent_protocol::status inode_store::get(extent_protocol::extentid_t id,
+                                         std::string& buf) {
+    int size = 0;
+    char* cbuf = NULL;
+
+    extent_protocol::status ret = im->read_file(id, &cbuf, &size);
+    if (size == 0)
+        buf = "";
+    else
+        buf.assign(cbuf, size);
+    free(cbuf);
+    return ret;
+}
+
+extent_protocol::status inode_store::get_range(extent_protocol::extentid_t id,
+                                               unsigned int off,
+                                               unsigned int len,
+                                               std::string& buf) {
+    int size = 0;
+    char* cbuf = NULL;
+
+    extent_protocol::status ret =
+        im->read_file_range(id, off, len, &cbuf, &size);
+    buf.assign(cbuf ? cbuf : "", size);
+    free(cbuf);
+    return ret;
+}
+
+extent_protocol::status inode_store::put(extent_protocol::extentid_t id,
+                                         const std::string& buf) {
+    return im->write_file(id, buf.data(), buf.size());
+}
+
+extent_protocol::status inode_store::put_range(extent_protocol::extentid_t id,
+                                               unsigned int off,
+                                               const std::string& buf) {
+    return im->write_file_range(id, off, buf.data(), buf.size());
+}
+
+extent_protocol::status inode_store::truncate(extent_protocol::extentid_t id,
+                                              unsigned int size) {
+    return im->truncate_file(id, size);
+}
+
+extent_protocol::status inode_store::getattr(extent_protocol::extentid_t id,
+                                             extent_protocol::attr& a) {
+    memset(&a, 0, sizeof(a));
+    im->getattr(id, a);
+    return a.type == 0 ? extent_protocol::NOENT : extent_protocol::OK;
+}
+
+extent_protocol::status inode_store::get_with_attr(
+    extent_protocol::extentid_t id, unsigned int limit,
+    extent_protocol::extent& e) {
+    int size = 0;
+    char* cbuf = NULL;
+
+    memset(&e.a, 0, sizeof(e.a));
+    im->read_file_attr(id, limit, e.a, &cbuf, &size);
+    if (e.a.type == 0)
+        return extent_protocol::NOENT;
+    e.has_data = e.a.size <= limit;
+    e.data.assign(cbuf ? cbuf : "", size);
+    free(cbuf);
+    return extent_protocol::OK;
+}
+
+extent_protocol::status inode_store::remove(extent_protocol::extentid_t id) {
+    return im->remove_file(id);
+}
+
+void inode_store::pin_version(extent_protocol::extentid_t id,
+                              unsigned long long v) {
+    im->pin_version(id, v);
+}
+
+void inode_store::ids(std::vector<extent_protocol::extentid_t>& out) {
+    extent_protocol::attr a;
+    out.clear();
+    for (extent_protocol::extentid_t id = 1; id < INODE_NUM; id++)
+        if (getattr(id, a) == extent_protocol::OK)
+            out.push_back(id);
+}
+
+// memory engine -----------------------------------------
+
+mem_store::mem_store() {
+    pthread_mutex_init(&mutex, NULL);
+    // id 1 is the root directory, as in inode_manager
+    next_id = 1;
+    version_seq = 0;
+    extent_protocol::extentid_t root;
+    create(extent_protocol::T_DIR, 0, root);
+}
+
+mem_store::~mem_store() { pthread_mutex_destroy(&mutex); }
+
+// no blocks to place, so the parent hint goes unused
+extent_protocol::status mem_store::create(uint32_t type,
+                                          extent_protocol::extentid_t,
+                                          extent_protocol::extentid_t& id) {
+    pthread_mutex_lock(&mutex);
+    id = next_id++;
+    init(id, type);
+    pthread_mutex_unlock(&mutex);
+    return extent_protocol::OK;
+}
+
+extent_protocol::status mem_store::create_at(uint32_t type,
+                                             extent_protocol::extentid_t id) {
+    extent_protocol::status ret = extent_protocol::OK;
+    pthread_mutex_lock(&mutex);
+    if (extents.count(id)) {
+        ret = extent_protocol::EXIST;
+    } else {
+        init(id, type);
+        if (id >= next_id)
+            next_id = id + 1;
+    }
+    pthread_mutex_unlock(&mutex);
+    return ret;
+}
+
+// called with mutex held
+void mem_store::init(extent_protocol::extentid_t id, uint32_t type) {
+    extent& e = extents[id];
+    memset(&e.attr, 0, sizeof(e.attr));
+    e.attr.type = type;
+    int tm = std::time(0);
+    e.attr.atime = tm;
+    e.attr.mtime = tm;
+    e.attr.ctime = tm;
+    e.attr.version = next_version(id);
+}
+
+// called with mutex held
+unsigned long long mem_store::next_version(extent_protocol::extentid_t id) {
+    if (!pinned.empty()) {
+        std::unordered_map<extent_protocol::extentid_t,
+                           unsigned long long>::iterator it = pinned.find(id);
+        if (it != pinned.end())
+            return it->second;
+    }
+    return ++version_seq;
+}
+
+extent_protocol::status mem_store::get(extent_protocol::extentid_t id,
+                                       std::string& buf) {
+    extent_protocol::status ret = extent_protocol::OK;
+    pthread_mutex_lock(&mutex);
+    table_t::iterator it = extents.find(id);
+    if (it == extents.end()) {
+        ret = extent_protocol::NOENT;
+    } else {
+        it->second.attr.atime = std::time(0);
+        buf = it->second.data;
+    }
+    pthread_mutex_unlock(&mutex);
+    return ret;
+}
+
+extent_protocol::status mem_store::get_range(extent_protocol::extentid_t id,
+                                             unsigned int off,
+                                             unsigned int len,
+                                             std::string& buf) {
+    extent_protocol::status ret = extent_protocol::OK;
+    pthread_mutex_lock(&mutex);
+    table_t::iterator it = extents.find(id);
+    if (it == extents.end()) {
+        ret = extent_protocol::NOENT;
+    } else {
+        it->second.attr.atime = std::time(0);
+        if (off >= it->second.data.size())
+            buf = "";
+        else
+            buf = it->second.data.substr(off, len);
+    }
+    pthread_mutex_unlock(&mutex);
+    return ret;
+}
+
+extent_protocol::status mem_store::put(extent_protocol::extentid_t id,
+                                       const std::string& buf) {
+    extent_protocol::status ret = extent_protocol::OK;
+    pthread_mutex_lock(&mutex);
+    table_t::iterator it = extents.find(id);
+    if (it == extents.end()) {
+        ret = extent_protocol::NOENT;
+    } else {
+        it->second.data = buf;
+        it->second.attr.size = buf.size();
+        int tm = std::time(0);
+        it->second.attr.mtime = tm;
+        it->second.attr.ctime = tm;
+        it->second.attr.version = next_version(id);
+    }
+    pthread_mutex_unlock(&mutex);
+    return ret;
+}
+
+extent_protocol::status mem_store::put_range(extent_protocol::extentid_t id,
+                                             unsigned int off,
+                                             const std::string& buf) {
+    extent_protocol::status ret = extent_protocol::OK;
+    pthread_mutex_lock(&mutex);
+    table_t::iterator it = extents.find(id);
+    if (it == extents.end()) {
+        ret = extent_protocol::NOENT;
+    } else {
+        std::string& data = it->second.data;
+        if (off + buf.size() > data.size())
+            data.resize(off + buf.size());
+        data.replace(off, buf.size(), buf);
+        it->second.attr.size = data.size();
+        int tm = std::time(0);
+        it->second.attr.mtime = tm;
+        it->second.attr.ctime = tm;
+        it->second.attr.version = next_version(id);
+    }
+    pthread_mutex_unlock(&mutex);
+    return ret;
+}
+
+extent_protocol::status mem_store::truncate(extent_protocol::extentid_t id,
+                                            unsigned int size) {
+    extent_protocol::status ret = extent_protocol::OK;
+    pthread_mutex_lock(&mutex);
+    table_t::iterator it = extents.find(id);
+    if (it == extents.end()) {
+        ret = extent_protocol::NOENT;
+    } else {
+        it->second.data.resize(size);
+        it->second.attr.size = size;
+        int tm = std::time(0);
+        it->second.attr.mtime = tm;
+        it->second.attr.ctime = tm;
+        it->second.attr.version = next_version(id);
+    }
+    pthread_mutex_unlock(&mutex);
+    return ret;
+}
+
+extent_protocol::status mem_store::getattr(extent_protocol::extentid_t id,
+                                           extent_protocol::attr& a) {
+    extent_protocol::status ret = extent_protocol::OK;
+    pthread_mutex_lock(&mutex);
+    table_t::iterator it = extents.find(id);
+    if (it == extents.end()) {
+        ret = extent_protocol::NOENT;
+    } else {
+        it->second.attr.atime = std::time(0);
+        a = it->second.attr;
+    }
+    pthread_mutex_unlock(&mutex);
+    return ret;
+}
+
+extent_protocol::status mem_store::remove(extent_protocol::extentid_t id) {
+    extent_protocol::status ret = extent_protocol::OK;
+    pthread_mutex_lock(&mutex);
+    if (extents.erase(id) == 0)
+        ret = extent_protocol::NOENT;
+    pthread_mutex_unlock(&mutex);
+    return ret;
+}
+
+void mem_store::pin_version(extent_protocol::extentid_t id,
+                            unsigned long long v) {
+    pthread_mutex_lock(&mutex);
+    if (v)
+        pinned[id] = v;
+    else
+        pinned.erase(id);
+    pthread_mutex_unlock(&mutex);
+}
+
+void mem_store::ids(std::vector<extent_protocol::extentid_t>& out) {
+    out.clear();
+    pthread_mutex_lock(&mutex);
+    for (table_t::iterator it = extents.begin(); it != extents.end(); ++it)
+        out.push_back(it->first);
+    pthread_mutex_unlock(&mutex);
+}
+
+// replication -----------------------------------------
+
+replicated_store::replicated_store(extent_store* s,
+                                   const std::vector<std::string>& replicas) {
+    inner = s;
+    addrs = replicas;
+    ndrops = 0;
+    stopping = false;
+    pthread_mutex_init(&mutex, NULL);
+    for (unsigned i = 0; i < STRIPES; i++)
+        pthread_mutex_init(&stripes[i], NULL);
+    // a copy would wait forever behind a steady stream of mutations
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&sync_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_cond_init(&stop_cond, NULL);
+    for (unsigned i = 0; i < addrs.size(); i++) {
+        sockaddr_in dstsock;
+        make_sockaddr(addrs[i].c_str(), &dstsock);
+        rpcc* cl = new rpcc(dstsock);
+        if (cl->bind() != 0)
+            LOGE("replicated_store: bind %s failed\n", addrs[i].c_str());
+        cls.push_back(cl);
+        stale.push_back(false);
+        missed.push_back(false);
+        fenced_at.push_back(0);
+    }
+    VERIFY(pthread_create(&heartbeat_th, NULL, heartbeat_thread, this) == 0);
+}
+
+replicated_store::~replicated_store() {
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_signal(&stop_cond);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(heartbeat_th, NULL);
+    for (unsigned i = 0; i < cls.size(); i++)
+        delete cls[i];
+    pthread_cond_destroy(&stop_cond);
+    pthread_rwlock_destroy(&sync_lock);
+    for (unsigned i = 0; i < STRIPES; i++)
+        pthread_mutex_destroy(&stripes[i]);
+    pthread_mutex_destroy(&mutex);
+    delete inner;
+}
+
+pthread_mutex_t* replicated_store::stripe(extent_protocol::extentid_t id) {
+    return &stripes[id % STRIPES];
+}
+
+void replicated_store::start(extent_protocol::extentid_t id) {
+    pthread_rwlock_rdlock(&sync_lock);
+    pthread_mutex_lock(stripe(id));
+}
+
+// Ends a mutation begun with start(). A replica dropped on its way out
+// may still serve reads of what it missed until its lease runs out, so
+// the caller does not acknowledge the mutation before until; it waits
+// with the locks released, not holding up the rest of the stripe.
+void replicated_store::finish(extent_protocol::extentid_t id,
+                              unsigned long long until) {
+    pthread_mutex_unlock(stripe(id));
+    pthread_rwlock_unlock(&sync_lock);
+    unsigned long long now = stat_now();
+    if (until > now)
+        usleep((until - now) / 1000);
+}
+
+// cls[i] with a reference taken, or NULL. Called with mutex held.
+rpcc* replicated_store::hold(unsigned i) {
+    rpcc* cl = cls[i];
+    if (cl != NULL)
+        refs[cl]++;
+    return cl;
+}
+
+// Drops a reference taken by hold(). The last one on a client that was
+// dropped frees it.
+void replicated_store::release(rpcc* cl) {
+    pthread_mutex_lock(&mutex);
+    bool last = --refs[cl] == 0;
+    if (last)
+        refs.erase(cl);
+    for (unsigned i = 0; last && i < cls.size(); i++)
+        if (cls[i] == cl)
+            last = false;
+    pthread_mutex_unlock(&mutex);
+    if (last)
+        delete cl;
+}
+
+// Called between start() and finish() for o.eid, and returns the time to
+// pass to finish(). Only a failed RPC drops a replica: it may have missed
+// a mutation we are about to acknowledge and cannot be told to stop
+// serving reads, so we wait out its lease, and the renewal a heartbeat
+// already in flight may give it. So does every mutation skipping it
+// meanwhile. A replica that answers with an error has fenced itself; it
+// stays in line for mutations, but clients are no longer sent to it.
+unsigned long long replicated_store::forward(const extent_protocol::op& o) {
+    std::vector<extent_protocol::op> ops(1, o);
+    extent_protocol::attr a;
+    unsigned long long until = 0;
+    if (o.kind != extent_protocol::OP_REMOVE &&
+        inner->getattr(o.eid, a) == extent_protocol::OK)
+        ops[0].version = a.version;
+    for (unsigned i = 0; i < cls.size(); i++) {
+        pthread_mutex_lock(&mutex);
+        rpcc* cl = hold(i);
+        if (cl == NULL && fenced_at[i] > until)
+            until = fenced_at[i];
+        pthread_mutex_unlock(&mutex);
+        if (cl == NULL)
+            continue;
+
+        int r;
+        int ret = cl->call(extent_protocol::replicate, ops, r,
+                           rpcc::to(4 * extent_protocol::REPLICA_LEASE_MS));
+        if (ret == extent_protocol::OK) {
+            release(cl);
+            continue;
+        }
+        pthread_mutex_lock(&mutex);
+        bool first = ret < 0 ? cls[i] == cl : !stale[i];
+        if (ret < 0 && first) {
+            cls[i] = NULL;
+            fenced_at[i] =
+                stat_now() + (HEARTBEAT_MS + extent_protocol::REPLICA_LEASE_MS) *
+                                 1000000ULL;
+            ndrops++;
+            pending.push_back(fenced_at[i]);
+        } else if (ret > 0) {
+            stale[i] = true;
+        }
+        if (ret < 0 && fenced_at[i] > until)
+            until = fenced_at[i];
+        pthread_mutex_unlock(&mutex);
+        release(cl);
+        if (!first)
+            continue;
+        if (ret > 0)
+            LOGW("replicated_store: replica %s failed op %u on %llu: %d\n",
+                 addrs[i].c_str(), o.kind, o.eid, ret);
+        else
+            LOGE("replicated_store: replica %s unreachable, dropping it\n",
+                 addrs[i].c_str());
+    }
+    return until;
+}
+
+// Sends a reset, then every extent with its version, then resynced. Called
+// with sync_lock held for writing, so no mutation is missed meanwhile.
+bool replicated_store::copy(rpcc* cl) {
+    std::vector<extent_protocol::extentid_t> ids;
+    std::vector<extent_protocol::op> ops;
+    unsigned int bytes = 0;
+    int r;
+
+    inner->ids(ids);
+    ops.push_back(extent_protocol::op(extent_protocol::OP_RESET));
+    for (unsigned k = 0; k <= ids.size(); k++) {
+        extent_protocol::attr a;
+        extent_protocol::op c(extent_protocol::OP_CREATE),
+            p(extent_protocol::OP_PUT);
+        if (k == ids.size()) {
+            ops.push_back(extent_protocol::op(extent_protocol::OP_RESYNCED));
+        } else if (inner->getattr(ids[k], a) == extent_protocol::OK &&
+                   inner->get(ids[k], p.data) == extent_protocol::OK) {
+            c.eid = p.eid = ids[k];
+            c.type = a.type;
+            c.version = p.version = a.version;
+            ops.push_back(c);
+            ops.push_back(p);
+            bytes += p.data.size();
+        }
+        if (k < ids.size() && bytes < COPY_BYTES)
+            continue;
+        if (cl->call(extent_protocol::replicate, ops, r,
+                     rpcc::to(4 * extent_protocol::REPLICA_LEASE_MS)) !=
+            extent_protocol::OK)
+            return false;
+        ops.clear();
+        bytes = 0;
+    }
+    return true;
+}
+
+// Brings back replica i, dropped or fenced: binds it afresh if it was
+// dropped, then copies everything over.
+void replicated_store::rejoin(unsigned i) {
+    pthread_mutex_lock(&mutex);
+    rpcc* cl = hold(i);
+    pthread_mutex_unlock(&mutex);
+    bool fresh = cl == NULL;
+    if (fresh) {
+        sockaddr_in dstsock;
+        make_sockaddr(addrs[i].c_str(), &dstsock);
+        cl = new rpcc(dstsock);
+        if (cl->bind(rpcc::to(HEARTBEAT_MS)) != 0) {
+            delete cl;
+            return;
+        }
+    }
+
+    pthread_rwlock_wrlock(&sync_lock);
+    bool ok = copy(cl);
+    pthread_mutex_lock(&mutex);
+    if (ok) {
+        if (fresh)
+            cls[i] = cl;
+        stale[i] = false;
+        missed[i] = false;
+    }
+    pthread_mutex_unlock(&mutex);
+    pthread_rwlock_unlock(&sync_lock);
+
+    if (!fresh)
+        release(cl);
+    else if (!ok)
+        delete cl;
+    if (ok)
+        LOGI("replicated_store: replica %s is back\n", addrs[i].c_str());
+}
+
+void* replicated_store::heartbeat_thread(void* arg) {
+    ((replicated_store*)arg)->heartbeat();
+    return NULL;
+}
+
+// An empty replicate renews a replica's lease. A missed heartbeat drops
+// nothing: the replica refuses reads until one gets through, and is not
+// offered to clients meanwhile. Replicas that were dropped or fenced
+// themselves are brought back instead. Other replicas go without a
+// heartbeat while one is copied to, and may miss their lease.
+void replicated_store::heartbeat() {
+    std::vector<extent_protocol::op> none;
+
+    pthread_mutex_lock(&mutex);
+    while (!stopping) {
+        for (unsigned i = 0; i < cls.size(); i++) {
+            bool behind = cls[i] == NULL || stale[i];
+            rpcc* cl = behind ? NULL : hold(i);
+            pthread_mutex_unlock(&mutex);
+            if (behind) {
+                rejoin(i);
+                pthread_mutex_lock(&mutex);
+                continue;
+            }
+            int r;
+            int ret = cl->call(extent_protocol::replicate, none, r,
+                               rpcc::to(HEARTBEAT_MS));
+            release(cl);
+            pthread_mutex_lock(&mutex);
+            if (ret < 0 && !missed[i])
+                LOGW("replicated_store: replica %s missed a heartbeat\n",
+                     addrs[i].c_str());
+            missed[i] = ret < 0;
+        }
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += HEARTBEAT_MS * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        if (!stopping)
+            pthread_cond_timedwait(&stop_cond, &mutex, &ts);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+extent_protocol::status replicated_store::create(
+    uint32_t type, extent_protocol::extentid_t parent,
+    extent_protocol::extentid_t& id) {
+    pthread_rwlock_rdlock(&sync_lock);
+    extent_protocol::status ret = inner->create(type, parent, id);
+    if (ret != extent_protocol::OK) {
+        pthread_rwlock_unlock(&sync_lock);
+        return ret;
+    }
+    // No one else knows the new id yet, so the stripe can be taken after
+    // the create. If the id was just freed, this waits for the forwarding
+    // of that remove.
+    pthread_mutex_lock(stripe(id));
+    extent_protocol::op o(extent_protocol::OP_CREATE, id);
+    o.type = type;
+    finish(id, forward(o));
+    return ret;
+}
+
+extent_protocol::status replicated_store::create_at(
+    uint32_t type, extent_protocol::extentid_t id) {
+    unsigned long long until = 0;
+    start(id);
+    extent_protocol::status ret = inner->create_at(type, id);
+    if (ret == extent_protocol::OK) {
+        extent_protocol::op o(extent_protocol::OP_CREATE, id);
+        o.type = type;
+        until = forward(o);
+    }
+    finish(id, until);
+    return ret;
+}
+
+extent_protocol::status replicated_store::get(extent_protocol::extentid_t id,
+                                              std::string& buf) {
+    return inner->get(id, buf);
+}
+
+extent_protocol::status replicated_store::get_range(
+    extent_protocol::extentid_t id, unsigned int off, unsigned int len,
+    std::string& buf) {
+    return inner->get_range(id, off, len, buf);
+}
+
+extent_protocol::status replicated_store::put(extent_protocol::extentid_t id,
+                                              const std::string& buf) {
+    unsigned long long until = 0;
+    start(id);
+    extent_protocol::status ret = inner->put(id, buf);
+    if (ret == extent_protocol::OK) {
+        extent_protocol::op o(extent_protocol::OP_PUT, id);
+        o.data = buf;
+        until = forward(o);
+    }
+    finish(id, until);
+    return ret;
+}
+
+extent_protocol::status replicated_store::put_range(
+    extent_protocol::extentid_t id, unsigned int off, const std::string& buf) {
+    unsigned long long until = 0;
+    start(id);
+    extent_protocol::status ret = inner->put_range(id, off, buf);
+    if (ret == extent_protocol::OK) {
+        extent_protocol::op o(extent_protocol::OP_PUT_RANGE, id);
+        o.off = off;
+        o.data = buf;
+        until = forward(o);
+    }
+    finish(id, until);
+    return ret;
+}
+
+extent_protocol::status replicated_store::getattr(
+    extent_protocol::extentid_t id, extent_protocol::attr& a) {
+    return inner->getattr(id, a);
+}
+
+extent_protocol::status replicated_store::truncate(
+    extent_protocol::extentid_t id, unsigned int size) {
+    unsigned long long until = 0;
+    start(id);
+    extent_protocol::status ret = inner->truncate(id, size);
+    if (ret == extent_protocol::OK) {
+        extent_protocol::op o(extent_protocol::OP_TRUNCATE, id);
+        o.off = size;
+        until = forward(o);
+    }
+    finish(id, until);
+    return ret;
+}
+
+extent_protocol::status replicated_store::get_with_attr(
+    extent_protocol::extentid_t id, unsigned int limit,
+    extent_protocol::extent& e) {
+    return inner->get_with_attr(id, limit, e);
+}
+
+extent_protocol::status replicated_store::remove(
+    extent_protocol::extentid_t id) {
+    extent_protocol::op o(extent_protocol::OP_REMOVE, id);
+    extent_protocol::attr a;
+    unsigned long long until = 0;
+    start(id);
+    // the version removed, for the replica to tell a late remove by
+    if (inner->getattr(id, a) == extent_protocol::OK)
+        o.version = a.version;
+    extent_protocol::status ret = inner->remove(id);
+    if (ret == extent_protocol::OK)
+        until = forward(o);
+    finish(id, until);
+    return ret;
+}
+
+void replicated_store::pin_version(extent_protocol::extentid_t id,
+                                   unsigned long long v) {
+    inner->pin_version(id, v);
+}
+
+void replicated_store::ids(std::vector<extent_protocol::extentid_t>& out) {
+    inner->ids(out);
+}
+
+void replicated_store::replicas(std::vector<std::string>& live) {
+    live.clear();
+    pthread_mutex_lock(&mutex);
+    for (unsigned i = 0; i < cls.size(); i++)
+        if (cls[i] != NULL && !stale[i] && !missed[i])
+            live.push_back(addrs[i]);
+    pthread_mutex_unlock(&mutex);
+}
+
+unsigned long long replicated_store::drops() {
+    unsigned long long now = stat_now();
+    pthread_mutex_lock(&mutex);
+    for (unsigned i = 0; i < pending.size();)
+        if (pending[i] <= now) {
+            pending[i] = pending.back();
+            pending.pop_back();
+        } else {
+            i++;
+        }
+    unsigned long long n = ndrops - pending.size();
+    pthread_mutex_unlock(&mutex);
+    return n;
+}
+
+// read coalescing -----------------------------------------
+
+bool coalescing_store::key::operator<(const key& k) const {
+    if (id != k.id)
+        return id < k.id;
+    if (kind != k.kind)
+        return kind < k.kind;
+    if (off != k.off)
+        return off < k.off;
+    return len < k.len;
+}
+
+coalescing_store::coalescing_store(extent_store* s) : inner(s) {
+    pthread_mutex_init(&mutex, NULL);
+}
+
+coalescing_store::~coalescing_store() {
+    pthread_mutex_destroy(&mutex);
+    delete inner;
+}
+
+// Called with mutex held.
+void coalescing_store::unref(flight* f) {
+    if (--f->refs == 0) {
+        pthread_cond_destroy(&f->cond);
+        delete f;
+    }
+}
+
+extent_protocol::status coalescing_store::read(const key& k,
+                                               extent_protocol::extent& e) {
+    pthread_mutex_lock(&mutex);
+    std::map<key, flight*>::iterator it = flights.find(k);
+    if (it != flights.end()) {
+        flight* f = it->second;
+        f->refs++;
+        while (!f->done)
+            pthread_cond_wait(&f->cond, &mutex);
+        e = f->e;
+        extent_protocol::status ret = f->ret;
+        unref(f);
+        pthread_mutex_unlock(&mutex);
+        return ret;
+    }
+    flight* f = new flight;
+    f->refs = 1;
+    f->done = false;
+    f->e.has_data = false;
+    memset(&f->e.a, 0, sizeof(f->e.a));
+    pthread_cond_init(&f->cond, NULL);
+    flights[k] = f;
+    pthread_mutex_unlock(&mutex);
+
+    switch (k.kind) {
+    case GET:
+        f->ret = inner->get(k.id, f->e.data);
+        break;
+    case GETATTR:
+        f->ret = inner->getattr(k.id, f->e.a);
+        break;
+    case GET_WITH_ATTR:
+        f->ret = inner->get_with_attr(k.id, k.len, f->e);
+        break;
+    default:
+        f->ret = inner->get_range(k.id, k.off, k.len, f->e.data);
+    }
+
+    pthread_mutex_lock(&mutex);
+    f->done = true;
+    it = flights.find(k);
+    if (it != flights.end() && it->second == f)
+        flights.erase(it);
+    pthread_cond_broadcast(&f->cond);
+    e = f->e;
+    extent_protocol::status ret = f->ret;
+    unref(f);
+    pthread_mutex_unlock(&mutex);
+    return ret;
+}
+
+// Later reads of id start a flight of their own; those already waiting
+// still get the detached one's reply.
+void coalescing_store::changed(extent_protocol::extentid_t id) {
+    key k;
+    k.id = id;
+    k.kind = GET;
+    k.off = k.len = 0;
+    pthread_mutex_lock(&mutex);
+    std::map<key, flight*>::iterator it = flights.lower_bound(k);
+    while (it != flights.end() && it->first.id == id)
+        flights.erase(it++);
+    pthread_mutex_unlock(&mutex);
+}
+
+extent_protocol::status coalescing_store::create(
+    uint32_t type, extent_protocol::extentid_t parent,
+    extent_protocol::extentid_t& id) {
+    extent_protocol::status ret = inner->create(type, parent, id);
+    if (ret == extent_protocol::OK)
+        changed(id);
+    return ret;
+}
+
+extent_protocol::status coalescing_store::create_at(
+    uint32_t type, extent_protocol::extentid_t id) {
+    extent_protocol::status ret = inner->create_at(type, id);
+    changed(id);
+    return ret;
+}
+
+extent_protocol::status coalescing_store::get(extent_protocol::extentid_t id,
+                                              std::string& buf) {
+    key k = {id, GET, 0, 0};
+    extent_protocol::extent e;
+    extent_protocol::status ret = read(k, e);
+    buf = e.data;
+    return ret;
+}
+
+extent_protocol::status coalescing_store::get_range(
+    extent_protocol::extentid_t id, unsigned int off, unsigned int len,
+    std::string& buf) {
+    key k = {id, GET_RANGE, off, len};
+    extent_protocol::extent e;
+    extent_protocol::status ret = read(k, e);
+    buf = e.data;
+    return ret;
+}
+
+extent_protocol::status coalescing_store::put(extent_protocol::extentid_t id,
+                                              const std::string& buf) {
+    extent_protocol::status ret = inner->put(id, buf);
+    changed(id);
+    return ret;
+}
+
+extent_protocol::status coalescing_store::put_range(
+    extent_protocol::extentid_t id, unsigned int off, const std::string& buf) {
+    extent_protocol::status ret = inner->put_range(id, off, buf);
+    changed(id);
+    return ret;
+}
+
+extent_protocol::status coalescing_store::getattr(
+    extent_protocol::extentid_t id, extent_protocol::attr& a) {
+    key k = {id, GETATTR, 0, 0};
+    extent_protocol::extent e;
+    extent_protocol::status ret = read(k, e);
+    a = e.a;
+    return ret;
+}
+
+extent_protocol::status coalescing_store::truncate(
+    extent_protocol::extentid_t id, unsigned int size) {
+    extent_protocol::status ret = inner->truncate(id, size);
+    changed(id);
+    return ret;
+}
+
+extent_protocol::status coalescing_store::get_with_attr(
+    extent_protocol::extentid_t id, unsigned int limit,
+    extent_protocol::extent& e) {
+    key k = {id, GET_WITH_ATTR, 0, limit};
+    return read(k, e);
+}
+
+extent_protocol::status coalescing_store::remove(
+    extent_protocol::extentid_t id) {
+    extent_protocol::status ret = inner->remove(id);
+    changed(id);
+    return ret;
+}
+
+void coalescing_store::pin_version(extent_protocol::extentid_t id,
+                                   unsigned long long v) {
+    inner->pin_version(id, v);
+}
+
+void coalescing_store::ids(std::vector<extent_protocol::extentid_t>& out) {
+    inner->ids(out);
+}
+
+void coalescing_store::replicas(std::vector<std::string>& addrs) {
+    inner->replicas(addrs);
+}
+
+unsigned long long coalescing_store::drops() {
+    return inner->drops();
+}
+
+// timing -----------------------------------------
+
+namespace {
+
+// adds the time until it goes out of scope to the thread's store phase
+struct store_timer {
+    unsigned long long start;
+    store_timer() : start(stat_now()) {}
+    ~store_timer() { stat_store_ns += stat_now() - start; }
+};
+
+}  // namespace
+
+timed_store::timed_store(extent_store* s) : inner(s) {}
+
+timed_store::~timed_store() { delete inner; }
+
+extent_protocol::status timed_store::create(uint32_t type,
+                                            extent_protocol::extentid_t parent,
+                                            extent_protocol::extentid_t& id) {
+    store_timer t;
+    return inner->create(type, parent, id);
+}
+
+extent_protocol::status timed_store::create_at(uint32_t type,
+                                               extent_protocol::extentid_t id) {
+    store_timer t;
+    return inner->create_at(type, id);
+}
+
+extent_protocol::status timed_store::get(extent_protocol::extentid_t id,
+                                         std::string& buf) {
+    store_timer t;
+    return inner->get(id, buf);
+}
+
+extent_protocol::status timed_store::get_range(extent_protocol::extentid_t id,
+                                               unsigned int off,
+                                               unsigned int len,
+                                               std::string& buf) {
+    store_timer t;
+    return inner->get_range(id, off, len, buf);
+}
+
+extent_protocol::status timed_store::put(extent_protocol::extentid_t id,
+                                         const std::string& buf) {
+    store_timer t;
+    return inner->put(id, buf);
+}
+
+extent_protocol::status timed_store::put_range(extent_protocol::extentid_t id,
+                                               unsigned int off,
+                                               const std::string& buf) {
+    store_timer t;
+    return inner->put_range(id, off, buf);
+}
+
+extent_protocol::status timed_store::getattr(extent_protocol::extentid_t id,
+                                             extent_protocol::attr& a) {
+    store_timer t;
+    return inner->getattr(id, a);
+}
+
+extent_protocol::status timed_store::truncate(extent_protocol::extentid_t id,
+                                              unsigned int size) {
+    store_timer t;
+    return inner->truncate(id, size);
+}
+
+extent_protocol::status timed_store::get_with_attr(
+    extent_protocol::extentid_t id, unsigned int limit,
+    extent_protocol::extent& e) {
+    store_timer t;
+    return inner->get_with_attr(id, limit, e);
+}
+
+extent_protocol::status timed_store::remove(extent_protocol::extentid_t id) {
+    store_timer t;
+    return inner->remove(id);
+}
+
+void timed_store::pin_version(extent_protocol::extentid_t id,
+                              unsigned long long v) {
+    inner->pin_version(id, v);
+}
+
+void timed_store::ids(std::vector<extent_protocol::extentid_t>& out) {
+    store_timer t;
+    inner->ids(out);
+}
+
+void timed_store::replicas(std::vector<std::string>& addrs) {
+    inner->replicas(addrs);
+}
+
+unsigned long long timed_store::drops() {
+    return inner->drops();
+}
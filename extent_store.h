@@ -0,0 +1,331 @@
+// storage engines behind extent_server.
+
+#ifndef extent_store_h
+#define extent_store_h
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <pthread.h>
+#include "extent_protocol.h"
+#include "inode_manager.h"
+
+// An engine stores extents by id. extent_server picks one at startup and
+// forwards every RPC to it, so engines can be swapped and benchmarked
+// behind the same protocol. Every engine answers an operation on an id
+// it holds no extent for with NOENT.
+class extent_store {
+public:
+    virtual ~extent_store() {}
+
+    // parent is the directory the extent is created in, a placement hint.
+    virtual extent_protocol::status create(uint32_t type,
+                                           extent_protocol::extentid_t parent,
+                                           extent_protocol::extentid_t& id) = 0;
+    // create extent id itself; replicas use it to mirror the primary.
+    virtual extent_protocol::status create_at(uint32_t type,
+                                              extent_protocol::extentid_t id) = 0;
+    virtual extent_protocol::status get(extent_protocol::extentid_t id,
+                                        std::string& buf) = 0;
+    virtual extent_protocol::status get_range(extent_protocol::extentid_t id,
+                                              unsigned int off,
+                                              unsigned int len,
+                                              std::string& buf) = 0;
+    virtual extent_protocol::status put(extent_protocol::extentid_t id,
+                                        const std::string& buf) = 0;
+    virtual extent_protocol::status put_range(extent_protocol::extentid_t id,
+                                              unsigned int off,
+                                              const std::string& buf) = 0;
+    virtual extent_protocol::status getattr(extent_protocol::extentid_t id,
+                                            extent_protocol::attr& a) = 0;
+    virtual extent_protocol::status truncate(extent_protocol::extentid_t id,
+                                             unsigned int size) = 0;
+    // attributes plus the data when it is at most limit bytes.
+    virtual extent_protocol::status get_with_attr(
+        extent_protocol::extentid_t id, unsigned int limit,
+        extent_protocol::extent& e);
+    virtual extent_protocol::status remove(extent_protocol::extentid_t id) = 0;
+    // Until called again with v 0, mutations of id get version v instead
+    // of a fresh one. A replica applies each mutation under the version
+    // its primary gave it, so a version means the same data on both.
+    virtual void pin_version(extent_protocol::extentid_t id,
+                             unsigned long long v) = 0;
+    // the id of every extent held, to copy them all to a replica.
+    virtual void ids(std::vector<extent_protocol::extentid_t>& out) = 0;
+    // servers holding copies of this store, for clients to read from.
+    virtual void replicas(std::vector<std::string>& addrs) { addrs.clear(); }
+    // how many times a replica was dropped and has since stopped serving
+    // reads; the clients it served may cache what it missed.
+    virtual unsigned long long drops() { return 0; }
+
+    // Build the engine called `name` ("inode" or "mem"), NULL if unknown.
+    static extent_store* make(const std::string& name);
+};
+
+// the block-layer engine: extents are inodes of an inode_manager.
+class inode_store : public extent_store {
+private:
+    inode_manager* im;
+
+public:
+    inode_store();
+    ~inode_store();
+
+    extent_protocol::status create(uint32_t type,
+                                   extent_protocol::extentid_t parent,
+                                   extent_protocol::extentid_t& id);
+    extent_protocol::status create_at(uint32_t type,
+                                      extent_protocol::extentid_t id);
+    extent_protocol::status get(extent_protocol::extentid_t id,
+                                std::string& buf);
+    extent_protocol::status get_range(extent_protocol::extentid_t id,
+                                      unsigned int off, unsigned int len,
+                                      std::string& buf);
+    extent_protocol::status put(extent_protocol::extentid_t id,
+                                const std::string& buf);
+    extent_protocol::status put_range(extent_protocol::extentid_t id,
+                                      unsigned int off,
+                                      const std::string& buf);
+    extent_protocol::status getattr(extent_protocol::extentid_t id,
+                                    extent_protocol::attr& a);
+    extent_protocol::status truncate(extent_protocol::extentid_t id,
+                                     unsigned int size);
+    extent_protocol::status get_with_attr(extent_protocol::extentid_t id,
+                                          unsigned int limit,
+                                          extent_protocol::extent& e);
+    extent_protocol::status remove(extent_protocol::extentid_t id);
+    void pin_version(extent_protocol::extentid_t id, unsigned long long v);
+    void ids(std::vector<extent_protocol::extentid_t>& out);
+};
+
+// a flat in-memory engine: one hash table entry per extent, no blocks.
+class mem_store : public extent_store {
+private:
+    struct extent {
+        std::string data;
+        extent_protocol::attr attr;
+    };
+    typedef std::unordered_map<extent_protocol::extentid_t, extent> table_t;
+
+    table_t extents;
+    extent_protocol::extentid_t next_id;
+    unsigned long long version_seq;  // source of extent versions
+    std::unordered_map<extent_protocol::extentid_t, unsigned long long>
+        pinned;
+    pthread_mutex_t mutex;
+
+    void init(extent_protocol::extentid_t id, uint32_t type);
+    unsigned long long next_version(extent_protocol::extentid_t id);
+
+public:
+    mem_store();
+    ~mem_store();
+
+    extent_protocol::status create(uint32_t type,
+                                   extent_protocol::extentid_t parent,
+                                   extent_protocol::extentid_t& id);
+    extent_protocol::status create_at(uint32_t type,
+                                      extent_protocol::extentid_t id);
+    extent_protocol::status get(extent_protocol::extentid_t id,
+                                std::string& buf);
+    extent_protocol::status get_range(extent_protocol::extentid_t id,
+                                      unsigned int off, unsigned int len,
+                                      std::string& buf);
+    extent_protocol::status put(extent_protocol::extentid_t id,
+                                const std::string& buf);
+    extent_protocol::status put_range(extent_protocol::extentid_t id,
+                                      unsigned int off,
+                                      const std::string& buf);
+    extent_protocol::status getattr(extent_protocol::extentid_t id,
+                                    extent_protocol::attr& a);
+    extent_protocol::status truncate(extent_protocol::extentid_t id,
+                                     unsigned int size);
+    extent_protocol::status remove(extent_protocol::extentid_t id);
+    void pin_version(extent_protocol::extentid_t id, unsigned long long v);
+    void ids(std::vector<extent_protocol::extentid_t>& out);
+};
+
+// The primary's side of replication: wraps the real engine, and sends
+// every mutation on to each replica before returning. Mutations of one
+// extent are ordered by its stripe lock, so replicas apply them in the
+// primary's order and are never behind a write the primary has
+// acknowledged; mutations of different extents go out in parallel. A
+// replica that cannot be reached is dropped and fenced, see
+// REPLICA_LEASE_MS; one that reports a failed mutation has fenced itself
+// and is no longer offered to clients, but keeps receiving mutations.
+// Either kind is brought back by the heartbeat thread, which copies every
+// extent over while mutations wait.
+class replicated_store : public extent_store {
+private:
+    enum { STRIPES = 64 };
+    enum { HEARTBEAT_MS = extent_protocol::REPLICA_LEASE_MS / 4 };
+    // bytes of extents sent per replicate RPC of a copy
+    enum { COPY_BYTES = 1 << 20 };
+    extent_store* inner;
+    std::vector<std::string> addrs;
+    std::vector<rpcc*> cls;    // NULL once a replica missed a mutation
+    std::vector<bool> stale;   // replicas that failed a mutation
+    std::vector<bool> missed;  // replicas that missed the last heartbeat
+    // stat_now() by which a dropped replica has stopped serving reads
+    std::vector<unsigned long long> fenced_at;
+    unsigned long long ndrops;
+    std::vector<unsigned long long> pending;  // fenced_at of recent drops
+    std::map<rpcc*, int> refs;  // calls in flight on each client
+    pthread_mutex_t mutex;      // guards these and stopping, never in an RPC
+    pthread_mutex_t stripes[STRIPES];
+    // shared by mutations, held alone while a replica is copied to
+    pthread_rwlock_t sync_lock;
+    bool stopping;
+    pthread_cond_t stop_cond;
+    pthread_t heartbeat_th;
+
+    pthread_mutex_t* stripe(extent_protocol::extentid_t id);
+    void start(extent_protocol::extentid_t id);
+    void finish(extent_protocol::extentid_t id, unsigned long long until);
+    rpcc* hold(unsigned i);
+    void release(rpcc* cl);
+    unsigned long long forward(const extent_protocol::op& o);
+    bool copy(rpcc* cl);
+    void rejoin(unsigned i);
+    static void* heartbeat_thread(void* arg);
+    void heartbeat();
+
+public:
+    replicated_store(extent_store* inner,
+                     const std::vector<std::string>& replicas);
+    ~replicated_store();
+
+    extent_protocol::status create(uint32_t type,
+                                   extent_protocol::extentid_t parent,
+                                   extent_protocol::extentid_t& id);
+    extent_protocol::status create_at(uint32_t type,
+                                      extent_protocol::extentid_t id);
+    extent_protocol::status get(extent_protocol::extentid_t id,
+                                std::string& buf);
+    extent_protocol::status get_range(extent_protocol::extentid_t id,
+                                      unsigned int off, unsigned int len,
+                                      std::string& buf);
+    extent_protocol::status put(extent_protocol::extentid_t id,
+                                const std::string& buf);
+    extent_protocol::status put_range(extent_protocol::extentid_t id,
+                                      unsigned int off,
+                                      const std::string& buf);
+    extent_protocol::status getattr(extent_protocol::extentid_t id,
+                                    extent_protocol::attr& a);
+    extent_protocol::status truncate(extent_protocol::extentid_t id,
+                                     unsigned int size);
+    extent_protocol::status get_with_attr(extent_protocol::extentid_t id,
+                                          unsigned int limit,
+                                          extent_protocol::extent& e);
+    extent_protocol::status remove(extent_protocol::extentid_t id);
+    void pin_version(extent_protocol::extentid_t id, unsigned long long v);
+    void ids(std::vector<extent_protocol::extentid_t>& out);
+    void replicas(std::vector<std::string>& addrs);
+    unsigned long long drops();
+};
+
+// Concurrent identical reads of one extent share a single read of the
+// wrapped engine: the first caller reads, and callers arriving while it
+// does wait for its reply and take a copy of it, which costs a memcpy
+// but no trip to the engine or the disk. A change to an extent detaches
+// the reads in flight on it, so a read that starts after a write returns
+// never gets data from before it.
+class coalescing_store : public extent_store {
+private:
+    enum kinds { GET, GETATTR, GET_WITH_ATTR, GET_RANGE };
+    struct key {
+        extent_protocol::extentid_t id;
+        int kind;
+        unsigned int off, len;  // len is the limit of get_with_attr
+        bool operator<(const key& k) const;
+    };
+    struct flight {
+        int refs;  // the reader and its waiters
+        bool done;
+        extent_protocol::status ret;
+        extent_protocol::extent e;
+        pthread_cond_t cond;
+    };
+
+    extent_store* inner;
+    std::map<key, flight*> flights;
+    pthread_mutex_t mutex;
+
+    extent_protocol::status read(const key& k, extent_protocol::extent& e);
+    void changed(extent_protocol::extentid_t id);
+    void unref(flight* f);
+
+public:
+    coalescing_store(extent_store* inner);
+    ~coalescing_store();
+
+    extent_protocol::status create(uint32_t type,
+                                   extent_protocol::extentid_t parent,
+                                   extent_protocol::extentid_t& id);
+    extent_protocol::status create_at(uint32_t type,
+                                      extent_protocol::extentid_t id);
+    extent_protocol::status get(extent_protocol::extentid_t id,
+                                std::string& buf);
+    extent_protocol::status get_range(extent_protocol::extentid_t id,
+                                      unsigned int off, unsigned int len,
+                                      std::string& buf);
+    extent_protocol::status put(extent_protocol::extentid_t id,
+                                const std::string& buf);
+    extent_protocol::status put_range(extent_protocol::extentid_t id,
+                                      unsigned int off,
+                                      const std::string& buf);
+    extent_protocol::status getattr(extent_protocol::extentid_t id,
+                                    extent_protocol::attr& a);
+    extent_protocol::status truncate(extent_protocol::extentid_t id,
+                                     unsigned int size);
+    extent_protocol::status get_with_attr(extent_protocol::extentid_t id,
+                                          unsigned int limit,
+                                          extent_protocol::extent& e);
+    extent_protocol::status remove(extent_protocol::extentid_t id);
+    void pin_version(extent_protocol::extentid_t id, unsigned long long v);
+    void ids(std::vector<extent_protocol::extentid_t>& out);
+    void replicas(std::vector<std::string>& addrs);
+    unsigned long long drops();
+};
+
+// Counts the time spent in the wrapped engine towards the calling
+// thread's stat_store_ns, for extent_server's per-op stats.
+class timed_store : public extent_store {
+private:
+    extent_store* inner;
+
+public:
+    timed_store(extent_store* inner);
+    ~timed_store();
+
+    extent_protocol::status create(uint32_t type,
+                                   extent_protocol::extentid_t parent,
+                                   extent_protocol::extentid_t& id);
+    extent_protocol::status create_at(uint32_t type,
+                                      extent_protocol::extentid_t id);
+    extent_protocol::status get(extent_protocol::extentid_t id,
+                                std::string& buf);
+    extent_protocol::status get_range(extent_protocol::extentid_t id,
+                                      unsigned int off, unsigned int len,
+                                      std::string& buf);
+    extent_protocol::status put(extent_protocol::extentid_t id,
+                                const std::string& buf);
+    extent_protocol::status put_range(extent_protocol::extentid_t id,
+                                      unsigned int off,
+                                      const std::string& buf);
+    extent_protocol::status getattr(extent_protocol::extentid_t id,
+                                    extent_protocol::attr& a);
+    extent_protocol::status truncate(extent_protocol::extentid_t id,
+                                     unsigned int size);
+    extent_protocol::status get_with_attr(extent_protocol::extentid_t id,
+                                          unsigned int limit,
+                                          extent_protocol::extent& e);
+    extent_protocol::status remove(extent_protocol::extentid_t id);
+    void pin_version(extent_protocol::extentid_t id, unsigned long long v);
+    void ids(std::vector<extent_protocol::extentid_t>& out);
+    void replicas(std::vector<std::string>& addrs);
+    unsigned long long drops();
+};
+
+#endif
@@ -15,12 +15,94 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
 #include "lang/verify.h"
 #include "yfs_client.h"
+#include "logger.h"
 
 int myid;
 yfs_client* yfs;
 
+// How long the kernel may take a name lookup found missing at its word,
+// unless YFS_NEGATIVE_TIMEOUT gives the seconds. Where libfuse can tell
+// the kernel to drop an entry, a negative one goes as soon as yfs_client
+// stops knowing the name to be missing, which it does before another
+// client can create it; see drop_negative. Elsewhere the kernel would
+// keep such a name missing here, so it holds none by default.
+#if FUSE_VERSION >= 28
+static double negative_timeout = 1.0;
+#else
+static double negative_timeout = 0.0;
+#endif
+
+#if FUSE_VERSION >= 28
+// Negative entries to drop. A lookup in flight may be about to hand the
+// kernel one that yfs_client has already forgotten, so the notifier sends
+// a batch only once the lookups started before it have replied; and it
+// never runs in a request, as the kernel may hold the locks of the
+// directory meanwhile.
+static struct fuse_chan* chan;
+static pthread_mutex_t negative_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t negative_cond = PTHREAD_COND_INITIALIZER;
+static std::vector<std::pair<fuse_ino_t, std::string> > negatives;
+static unsigned long long lookup_epoch;
+// lookups in flight, by the epoch they started in
+static std::map<unsigned long long, int> lookups;
+
+static void drop_negative(extent_protocol::extentid_t dir,
+                          const std::string& name) {
+    pthread_mutex_lock(&negative_mutex);
+    negatives.push_back(std::make_pair((fuse_ino_t)dir, name));
+    pthread_cond_broadcast(&negative_cond);
+    pthread_mutex_unlock(&negative_mutex);
+}
+
+static void* negative_thread(void*) {
+    std::vector<std::pair<fuse_ino_t, std::string> > batch;
+    pthread_mutex_lock(&negative_mutex);
+    while (true) {
+        while (negatives.empty())
+            pthread_cond_wait(&negative_cond, &negative_mutex);
+        batch.swap(negatives);
+        unsigned long long e = ++lookup_epoch;
+        while (!lookups.empty() && lookups.begin()->first < e)
+            pthread_cond_wait(&negative_cond, &negative_mutex);
+        pthread_mutex_unlock(&negative_mutex);
+        for (unsigned i = 0; i < batch.size(); i++)
+            fuse_lowlevel_notify_inval_entry(chan, batch[i].first,
+                                             batch[i].second.data(),
+                                             batch[i].second.size());
+        batch.clear();
+        pthread_mutex_lock(&negative_mutex);
+    }
+    return NULL;
+}
+
+static unsigned long long lookup_begin() {
+    pthread_mutex_lock(&negative_mutex);
+    unsigned long long e = lookup_epoch;
+    lookups[e]++;
+    pthread_mutex_unlock(&negative_mutex);
+    return e;
+}
+
+static void lookup_end(unsigned long long e) {
+    pthread_mutex_lock(&negative_mutex);
+    if (--lookups[e] == 0) {
+        lookups.erase(e);
+        pthread_cond_broadcast(&negative_cond);
+    }
+    pthread_mutex_unlock(&negative_mutex);
+}
+#else
+static unsigned long long lookup_begin() { return 0; }
+static void lookup_end(unsigned long long) {}
+#endif
+
 int id() { return myid; }
 
 //
@@ -53,7 +135,7 @@ yfs_client::status getattr(yfs_client::inum inum, struct stat& st) {
         st.st_mtime = info.mtime;
         st.st_ctime = info.ctime;
         st.st_size = info.size;
-        printf("   getattr -> %llu\n", info.size);
+        LOGD("   getattr -> %llu\n", info.size);
     } else if (type == extent_protocol::T_DIR) {
         yfs_client::dirinfo info;
         ret = yfs->getdir(inum, info);
@@ -64,8 +146,8 @@ yfs_client::status getattr(yfs_client::inum inum, struct stat& st) {
         st.st_atime = info.atime;
         st.st_mtime = info.mtime;
         st.st_ctime = info.ctime;
-        printf("   getattr -> %lu %lu %lu\n", info.atime, info.mtime,
-               info.ctime);
+        LOGD("   getattr -> %lu %lu %lu\n", info.atime, info.mtime,
+             info.ctime);
     } else {
         yfs_client::fileinfo info;
         ret = yfs->getfile(inum, info);
@@ -77,7 +159,7 @@ yfs_client::status getattr(yfs_client::inum inum, struct stat& st) {
         st.st_mtime = info.mtime;
         st.st_ctime = info.ctime;
         st.st_size = info.size;
-        printf("   getattr -> %llu\n", info.size);
+        LOGD("   getattr -> %llu\n", info.size);
     }
     return yfs_client::OK;
 }
@@ -126,9 +208,9 @@ void fuseserver_getattr(fuse_req_t req, fuse_ino_t ino,
 //
 void fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr,
                         int to_set, struct fuse_file_info* fi) {
-    printf("fuseserver_setattr 0x%x\n", to_set);
+    LOGD("fuseserver_setattr 0x%x\n", to_set);
     if (FUSE_SET_ATTR_SIZE & to_set) {
-        printf("   fuseserver_setattr set size to %zu\n", attr->st_size);
+        LOGD("   fuseserver_setattr set size to %zu\n", attr->st_size);
         struct stat st;
 
 #if 1
@@ -163,7 +245,7 @@ void fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr,
 void fuseserver_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
                      struct fuse_file_info* fi) {
 #if 1
-    std::string buf;
+    rcbuf buf;  // the cached bytes themselves, replied with no copy
     // Change the above "#if 0" to "#if 1", and your code goes here
     int r;
     if ((r = yfs->read(ino, size, off, buf)) == yfs_client::OK) {
@@ -255,7 +337,7 @@ void fuseserver_create(fuse_req_t req, fuse_ino_t parent, const char* name,
                                        extent_protocol::T_FILE)) ==
         yfs_client::OK) {
         fuse_reply_create(req, &e, fi);
-        printf("OK: create returns.\n");
+        LOGD("OK: create returns.\n");
     } else {
         if (ret == yfs_client::EXIST) {
             fuse_reply_err(req, EEXIST);
@@ -297,15 +379,24 @@ void fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
     bool found = false;
 
     yfs_client::inum ino;
-    yfs->lookup(parent, name, found, ino);
+    unsigned long long epoch = lookup_begin();
+    int ret = yfs->lookup(parent, name, found, ino);
 
     if (found) {
         e.ino = ino;
         getattr(ino, e.attr);
         fuse_reply_entry(req, &e);
+    } else if (ret == yfs_client::OK) {
+        // a negative entry, so that probes of the name stay in the kernel
+        // if negative_timeout allows
+        memset(&e.attr, 0, sizeof(e.attr));
+        e.ino = 0;
+        e.entry_timeout = negative_timeout;
+        fuse_reply_entry(req, &e);
     } else {
         fuse_reply_err(req, ENOENT);
     }
+    lookup_end(epoch);
 }
 
 struct dirbuf {
@@ -347,7 +438,7 @@ void fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
     yfs_client::inum inum = ino;  // req->in.h.nodeid;
     struct dirbuf b;
 
-    printf("fuseserver_readdir\n");
+    LOGD("fuseserver_readdir\n");
 
     if (!yfs->isdir(inum)) {
         fuse_reply_err(req, ENOTDIR);
@@ -434,8 +525,16 @@ void fuseserver_unlink(fuse_req_t req, fuse_ino_t parent, const char* name) {
 
 void fuseserver_statfs(fuse_req_t req) {
     struct statvfs buf;
+    yfs_client::cache_info ci;
 
-    printf("statfs\n");
+    LOGD("statfs\n");
+    // df on the mount is the handiest way to see how the cache is doing
+    yfs->get_cache_info(ci);
+    LOGI("cache: %llu bytes, %llu dirty, peak %llu, %llu evictions, "
+         "%llu writebacks, %llu flushed, %llu read ahead, "
+         "%llu missing hits\n",
+         ci.bytes, ci.dirty, ci.peak, ci.evictions, ci.writebacks, ci.flushed,
+         ci.read_ahead, ci.missing_hits);
 
     memset(&buf, 0, sizeof(buf));
 
@@ -486,6 +585,7 @@ int main(int argc, char* argv[]) {
     int err = -1;
     int fd;
 
+    // for librpc's jsl_log, which prints with printf rather than the logger
     setvbuf(stdout, NULL, _IONBF, 0);
 
 #if 1
@@ -508,6 +608,9 @@ int main(int argc, char* argv[]) {
     myid = random();
 
     yfs = new yfs_client(argv[2], argv[3]);
+    const char* negative = getenv("YFS_NEGATIVE_TIMEOUT");
+    if (negative)
+        negative_timeout = atof(negative);
     // yfs = new yfs_client();
 
     fuseserver_oper.getattr = fuseserver_getattr;
@@ -580,6 +683,14 @@ int main(int argc, char* argv[]) {
     }
 
     fuse_session_add_chan(se, ch);
+#if FUSE_VERSION >= 28
+    chan = ch;
+    if (negative_timeout > 0) {
+        pthread_t th;
+        VERIFY(pthread_create(&th, NULL, negative_thread, NULL) == 0);
+        yfs->set_missing_hook(drop_negative);
+    }
+#endif
     // err = fuse_session_loop_mt(se);   // FK: wheelfs does this; why?
     err = fuse_session_loop(se);
 
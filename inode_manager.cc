@@ -1,4 +1,6 @@
 #include "inode_manager.h"
+#include "logger.h"
+#include "stats.h"
 #include <ctime>
 
 // disk layer -----------------------------------------
@@ -19,19 +21,30 @@ void disk::write_block(blockid_t id, const char* buf) {
     memcpy(blocks[id], buf, BLOCK_SIZE);
 }
 
+bool disk::same_block(blockid_t id, const char* buf) {
+    if (id < 0 || id >= BLOCK_NUM || buf == NULL)
+        return false;
+
+    return memcmp(blocks[id], buf, BLOCK_SIZE) == 0;
+}
+
 // block layer -----------------------------------------
 
-// Allocate a free disk block.
-blockid_t block_manager::alloc_block() {
+// Allocate a free disk block, searching forward from goal.
+// Without a goal, continue from where the last allocation left off.
+blockid_t block_manager::alloc_block(blockid_t goal) {
     blockid_t data_start = sb.nblocks / BPB + INODE_NUM + 2;  // 1034
-    static blockid_t id = data_start;
+    static blockid_t cursor = data_start;
     pthread_mutex_lock(&mutex);
+    blockid_t id = goal >= data_start && goal < sb.nblocks ? goal : cursor;
     while (using_blocks[id]) {
         id = (id + 1) % sb.nblocks;
         if (id < data_start)
             id = data_start;
     }
     using_blocks[id] = 1;
+    if (goal == 0)
+        cursor = id;
     pthread_mutex_unlock(&mutex);
 
     return id;
@@ -55,38 +68,134 @@ block_manager::block_manager() {
 
 block_manager::~block_manager() { pthread_mutex_destroy(&mutex); }
 
+// block I/O time counts towards the calling thread's block phase
 void block_manager::read_block(uint32_t id, char* buf) {
+    unsigned long long start = stat_now();
     d->read_block(id, buf);
+    stat_block_ns += stat_now() - start;
 }
 
 void block_manager::write_block(uint32_t id, const char* buf) {
+    unsigned long long start = stat_now();
     d->write_block(id, buf);
+    stat_block_ns += stat_now() - start;
+}
+
+bool block_manager::same_block(uint32_t id, const char* buf) {
+    unsigned long long start = stat_now();
+    bool same = d->same_block(id, buf);
+    stat_block_ns += stat_now() - start;
+    return same;
 }
 
 // inode layer -----------------------------------------
 
 inode_manager::inode_manager() {
     pthread_mutex_init(&mutex, NULL);
+    pthread_mutex_init(&pin_mutex, NULL);
+    for (int g = 0; g < NGROUPS; ++g) {
+        ifree[g] = IPG;
+        ndirs[g] = 0;
+        cursor[g] = g * IPG;
+    }
+    memset(using_inodes, 0, sizeof(using_inodes));
+    using_inodes[0] = true;  // inode 0 is never used
+    ifree[0] -= 1;
+    nfree = INODE_NUM - 1;
+    version_seq = 0;
     bm = new block_manager();
     uint32_t root_dir = alloc_inode(extent_protocol::T_DIR);
     if (root_dir != 1) {
-        printf("\tim: error! alloc first inode %d, should be 1\n", root_dir);
+        LOGE("\tim: error! alloc first inode %d, should be 1\n", root_dir);
         exit(0);
     }
 }
 
-inode_manager::~inode_manager() { pthread_mutex_destroy(&mutex); }
+inode_manager::~inode_manager() {
+    pthread_mutex_destroy(&pin_mutex);
+    pthread_mutex_destroy(&mutex);
+}
+
+/* Choose the group for a new inode, FFS/Orlov style: files and nested
+ * directories stay with their parent while its group has room, top-level
+ * directories spread out to the emptiest group with the fewest dirs.
+ * parent is 0 for no hint, and otherwise a valid inum. */
+uint32_t inode_manager::pick_group(uint32_t type, uint32_t parent) {
+    if (parent == 0)
+        return 0;
+    int pg = IGROUP(parent);
+    if (type != extent_protocol::T_DIR && ifree[pg] > 0)
+        return pg;
+
+    int total = 0;
+    for (int g = 0; g < NGROUPS; ++g)
+        total += ifree[g];
+    if (type == extent_protocol::T_DIR && parent != 1 &&
+        ifree[pg] * NGROUPS >= total)
+        return pg;
+
+    int best = pg;
+    for (int g = 0; g < NGROUPS; ++g)
+        if (ifree[g] > ifree[best] ||
+            (ifree[g] == ifree[best] && ndirs[g] < ndirs[best]))
+            best = g;
+    return best;
+}
 
-/* Create a new file.
- * Return its inum. */
-uint32_t inode_manager::alloc_inode(uint32_t type) {
-    static uint32_t id = 1;
+/* Create a new file near its parent directory.
+ * Return its inum, 0 if there are no inodes left. A parent out of range,
+ * as a bad or another shard's id from the wire maps to, is no hint at
+ * all. Each group is searched from where its last search stopped, so a
+ * search passes over at most one group's worth of inodes. */
+uint32_t inode_manager::alloc_inode(uint32_t type, uint32_t parent) {
+    if (parent >= INODE_NUM)
+        parent = 0;
     pthread_mutex_lock(&mutex);
+    if (nfree == 0) {
+        pthread_mutex_unlock(&mutex);
+        LOGW("\tim: out of inodes\n");
+        return 0;
+    }
+    uint32_t g = pick_group(type, parent);
+    while (ifree[g] == 0)
+        g = (g + 1) % NGROUPS;
+    uint32_t id = cursor[g];
     while (using_inodes[id])
-        id = id % INODE_NUM + 1;
-    using_inodes[id] = 1;
+        id = id + 1 < (g + 1) * IPG ? id + 1 : g * IPG;
+    cursor[g] = id + 1 < (g + 1) * IPG ? id + 1 : g * IPG;
+    using_inodes[id] = true;
+    nfree--;
+    ifree[IGROUP(id)]--;
+    if (type == extent_protocol::T_DIR)
+        ndirs[IGROUP(id)]++;
     pthread_mutex_unlock(&mutex);
 
+    init_inode(id, type);
+    return id;
+}
+
+/* Create a file at a given inum, for a replica mirroring its primary.
+ * Return false if the inum is taken. */
+bool inode_manager::alloc_inode_at(uint32_t type, uint32_t inum) {
+    if (inum == 0 || inum >= INODE_NUM)
+        return false;
+    pthread_mutex_lock(&mutex);
+    if (using_inodes[inum]) {
+        pthread_mutex_unlock(&mutex);
+        return false;
+    }
+    using_inodes[inum] = true;
+    nfree--;
+    ifree[IGROUP(inum)]--;
+    if (type == extent_protocol::T_DIR)
+        ndirs[IGROUP(inum)]++;
+    pthread_mutex_unlock(&mutex);
+
+    init_inode(inum, type);
+    return true;
+}
+
+void inode_manager::init_inode(uint32_t inum, uint32_t type) {
     inode* ino = (inode*)malloc(sizeof(inode));
     memset(ino, 0, sizeof(inode));
     ino->type = type;
@@ -94,31 +203,56 @@ uint32_t inode_manager::alloc_inode(uint32_t type) {
     ino->mtime = tm;
     ino->ctime = tm;
     ino->atime = tm;
-    put_inode(id, ino);
+    put_inode(inum, ino);
     free(ino);
-    return id;
 }
 
+/* The counts go up only once the inode is cleared, so a search that
+ * finds a group with free inodes always finds one of them free. */
 void inode_manager::free_inode(uint32_t inum) {
-    if (using_inodes[inum]) {
-        inode* ino = (inode*)malloc(sizeof(inode));
+    if (inum == 0 || inum >= INODE_NUM)
+        return;
+    pthread_mutex_lock(&mutex);
+    bool used = using_inodes[inum];
+    pthread_mutex_unlock(&mutex);
+    if (used) {
+        inode* ino = get_inode(inum);
+        bool dir = ino && ino->type == extent_protocol::T_DIR;
+        free(ino);
+
+        ino = (inode*)malloc(sizeof(inode));
         memset(ino, 0, sizeof(inode));
         put_inode(inum, ino);
         free(ino);
-        using_inodes[inum] = 0;
+        pthread_mutex_lock(&mutex);
+        if (using_inodes[inum]) {
+            using_inodes[inum] = false;
+            nfree++;
+            ifree[IGROUP(inum)]++;
+            if (dir)
+                ndirs[IGROUP(inum)]--;
+        }
+        pthread_mutex_unlock(&mutex);
     }
 }
 
+/* First data block of the group inode inum belongs to. */
+blockid_t inode_manager::group_block(uint32_t inum) {
+    blockid_t data_start = bm->sb.nblocks / BPB + INODE_NUM + 2;
+    blockid_t per_group = (bm->sb.nblocks - data_start) / NGROUPS;
+    return data_start + IGROUP(inum) * per_group;
+}
+
 /* Return an inode structure by inum, NULL otherwise.
  * Caller should release the memory. */
 struct inode* inode_manager::get_inode(uint32_t inum) {
     struct inode *ino, *ino_disk;
     char buf[BLOCK_SIZE];
 
-    printf("\tim: get_inode %d\n", inum);
+    LOGD("\tim: get_inode %d\n", inum);
 
     if (inum < 0 || inum >= INODE_NUM) {
-        printf("\tim: inum out of range\n");
+        LOGW("\tim: inum out of range\n");
         return NULL;
     }
 
@@ -127,7 +261,7 @@ struct inode* inode_manager::get_inode(uint32_t inum) {
 
     ino_disk = (struct inode*)buf + inum % IPB;
     if (ino_disk->type == 0) {
-        printf("\tim: inode not exist\n");
+        LOGD("\tim: inode not exist\n");
         return NULL;
     }
     ino_disk->atime = std::time(0);
@@ -143,7 +277,7 @@ void inode_manager::put_inode(uint32_t inum, struct inode* ino) {
     char buf[BLOCK_SIZE];
     struct inode* ino_disk;
 
-    printf("\tim: put_inode %d\n", inum);
+    LOGD("\tim: put_inode %d\n", inum);
     if (ino == NULL)
         return;
 
@@ -153,15 +287,72 @@ void inode_manager::put_inode(uint32_t inum, struct inode* ino) {
     int tm = std::time(0);
     ino_disk->mtime = tm;
     ino_disk->ctime = tm;
+    ino_disk->version = next_version(inum);
     bm->write_block(IBLOCK(inum, bm->sb.nblocks), buf);
 }
 
+// the version pinned for inum, or a fresh one
+unsigned long long inode_manager::next_version(uint32_t inum) {
+    unsigned long long v = 0;
+    pthread_mutex_lock(&pin_mutex);
+    if (!pinned.empty()) {
+        std::map<uint32_t, unsigned long long>::iterator it =
+            pinned.find(inum);
+        if (it != pinned.end())
+            v = it->second;
+    }
+    pthread_mutex_unlock(&pin_mutex);
+    return v ? v : __sync_add_and_fetch(&version_seq, 1);
+}
+
+void inode_manager::pin_version(uint32_t inum, unsigned long long v) {
+    pthread_mutex_lock(&pin_mutex);
+    if (v)
+        pinned[inum] = v;
+    else
+        pinned.erase(inum);
+    pthread_mutex_unlock(&pin_mutex);
+}
+
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 /* Get all the data of a file by inum.
  * Return alloced data, should be freed by caller. */
-void inode_manager::read_file(uint32_t inum, char** buf_out, int* size) {
+extent_protocol::status inode_manager::read_file(uint32_t inum,
+                                                 char** buf_out, int* size) {
     inode* ino = get_inode(inum);
+    if (ino == NULL) {
+        *size = 0;
+        *buf_out = NULL;
+        return extent_protocol::NOENT;
+    }
+    read_blocks(ino, buf_out, size);
+    free(ino);
+    return extent_protocol::OK;
+}
+
+/* Get the attributes of a file, and its data too if it is at most limit
+ * bytes, with a single inode lookup. Caller frees *buf_out. */
+void inode_manager::read_file_attr(uint32_t inum, unsigned int limit,
+                                   extent_protocol::attr& a, char** buf_out,
+                                   int* size) {
+    *size = 0;
+    *buf_out = NULL;
+    inode* ino = get_inode(inum);
+    if (ino == NULL)
+        return;
+    a.type = ino->type;
+    a.size = ino->size;
+    a.atime = ino->atime;
+    a.ctime = ino->ctime;
+    a.mtime = ino->mtime;
+    a.version = ino->version;
+    if (ino->size <= limit)
+        read_blocks(ino, buf_out, size);
+    free(ino);
+}
+
+void inode_manager::read_blocks(inode* ino, char** buf_out, int* size) {
     *size = ino->size;
     char* now = *buf_out = (char*)malloc(
         (*size) % BLOCK_SIZE
@@ -185,31 +376,45 @@ void inode_manager::read_file(uint32_t inum, char** buf_out, int* size) {
                 break;
             }
     }
-    free(ino);
 }
 
-void inode_manager::write_blockn(uint32_t id, const char* buf, int size) {
+// Write up to a block of buf to block id, zero-padded. A block the file
+// already had is compared first and left alone if nothing changed, so
+// rewriting a file with a small edit only writes the blocks it touches.
+void inode_manager::write_blockn(uint32_t id, const char* buf, int size,
+                                 bool fresh) {
+    char tmp[BLOCK_SIZE];
     if (size < BLOCK_SIZE) {
-        char tmp[BLOCK_SIZE] = {0};
+        memset(tmp, 0, BLOCK_SIZE);
         memcpy(tmp, buf, size);
-        bm->write_block(id, tmp);
-    } else {
-        bm->write_block(id, buf);
+        buf = tmp;
     }
+    if (!fresh && bm->same_block(id, buf))
+        return;
+    bm->write_block(id, buf);
 }
 
-/* alloc/free blocks if needed */
-void inode_manager::write_file(uint32_t inum, const char* buf, int size) {
+/* alloc/free blocks if needed. IOERR, with the file left alone, if size
+ * is more than MAXFILE blocks. */
+extent_protocol::status inode_manager::write_file(uint32_t inum,
+                                                  const char* buf, int size) {
+    if (size < 0 || (unsigned int)size > MAXFILE * BLOCK_SIZE)
+        return extent_protocol::IOERR;
     inode* ino = get_inode(inum);
+    if (ino == NULL)
+        return extent_protocol::NOENT;
     int i = 0;
+    blockid_t goal = group_block(inum);  // keep the file's blocks together
     ino->size = size;
     while (size > 0 && i < NDIRECT) {
         blockid_t bid = ino->blocks[i];
-        if (bid == 0) {
-            bid = bm->alloc_block();
+        bool fresh = bid == 0;
+        if (fresh) {
+            bid = bm->alloc_block(goal);
             ino->blocks[i] = bid;
         }
-        write_blockn(bid, buf, size);
+        goal = bid + 1;
+        write_blockn(bid, buf, size, fresh);
 
         ++i, size -= BLOCK_SIZE, buf += BLOCK_SIZE;
     }
@@ -228,7 +433,7 @@ void inode_manager::write_file(uint32_t inum, const char* buf, int size) {
         blockid_t iid = ino->blocks[NDIRECT];
         uint iblock[NINDIRECT] = {0};
         if (iid == 0) {
-            iid = bm->alloc_block();
+            iid = bm->alloc_block(goal);
             ino->blocks[NDIRECT] = iid;
         } else {
             bm->read_block(iid, (char*)iblock);
@@ -236,11 +441,13 @@ void inode_manager::write_file(uint32_t inum, const char* buf, int size) {
         i = 0;
         while (size > 0 && i < (int)NINDIRECT) {
             blockid_t bid = iblock[i];
-            if (bid == 0) {
-                bid = bm->alloc_block();
+            bool fresh = bid == 0;
+            if (fresh) {
+                bid = bm->alloc_block(goal);
                 iblock[i] = bid;
             }
-            write_blockn(bid, buf, size);
+            goal = bid + 1;
+            write_blockn(bid, buf, size, fresh);
 
             ++i, size -= BLOCK_SIZE, buf += BLOCK_SIZE;
         }
@@ -249,6 +456,155 @@ void inode_manager::write_file(uint32_t inum, const char* buf, int size) {
     }
     put_inode(inum, ino);
     free(ino);
+    return extent_protocol::OK;
+}
+
+/* Collect the block ids of a file, direct ones first.
+ * Return how many blocks the file has. */
+int inode_manager::load_blocks(inode* ino, blockid_t* bids) {
+    int n = 0;
+    for (int i = 0; i < NDIRECT && ino->blocks[i]; ++i)
+        bids[n++] = ino->blocks[i];
+    if (ino->blocks[NDIRECT]) {
+        uint iblock[NINDIRECT];
+        bm->read_block(ino->blocks[NDIRECT], (char*)iblock);
+        for (int i = 0; i < (int)NINDIRECT && iblock[i]; ++i)
+            bids[n++] = iblock[i];
+    }
+    return n;
+}
+
+/* Grow or shrink a file from n to want blocks. New blocks are zeroed,
+ * so bytes past the end of a file always read as 0. */
+void inode_manager::resize_blocks(uint32_t inum, inode* ino, blockid_t* bids,
+                                  int n, int want) {
+    char zero[BLOCK_SIZE] = {0};
+    blockid_t goal = n ? bids[n - 1] + 1 : group_block(inum);
+    for (; n < want; ++n) {
+        bids[n] = bm->alloc_block(goal);
+        bm->write_block(bids[n], zero);
+        goal = bids[n] + 1;
+    }
+    for (int i = want; i < n; ++i)
+        bm->free_block(bids[i]);
+
+    for (int i = 0; i < NDIRECT; ++i)
+        ino->blocks[i] = i < want ? bids[i] : 0;
+    if (want > NDIRECT) {
+        uint iblock[NINDIRECT] = {0};
+        for (int i = NDIRECT; i < want; ++i)
+            iblock[i - NDIRECT] = bids[i];
+        if (ino->blocks[NDIRECT] == 0)
+            ino->blocks[NDIRECT] = bm->alloc_block(goal);
+        bm->write_block(ino->blocks[NDIRECT], (char*)iblock);
+    } else if (ino->blocks[NDIRECT]) {
+        bm->free_block(ino->blocks[NDIRECT]);
+        ino->blocks[NDIRECT] = 0;
+    }
+}
+
+/* Get up to len bytes of a file starting at off.
+ * Return alloced data, should be freed by caller. */
+extent_protocol::status inode_manager::read_file_range(uint32_t inum,
+                                                       unsigned int off,
+                                                       unsigned int len,
+                                                       char** buf_out,
+                                                       int* size) {
+    *size = 0;
+    *buf_out = NULL;
+    inode* ino = get_inode(inum);
+    if (ino == NULL)
+        return extent_protocol::NOENT;
+    if (off >= ino->size) {
+        free(ino);
+        return extent_protocol::OK;
+    }
+    len = MIN(len, ino->size - off);
+
+    blockid_t bids[MAXFILE];
+    load_blocks(ino, bids);
+    char* out = *buf_out = (char*)malloc(len);
+    char tmp[BLOCK_SIZE];
+    unsigned int done = 0;
+    while (done < len) {
+        unsigned int pos = off + done;
+        unsigned int boff = pos % BLOCK_SIZE;
+        unsigned int n = MIN(BLOCK_SIZE - boff, len - done);
+        bm->read_block(bids[pos / BLOCK_SIZE], tmp);
+        memcpy(out + done, tmp + boff, n);
+        done += n;
+    }
+    *size = len;
+    free(ino);
+    return extent_protocol::OK;
+}
+
+/* Write size bytes at off, growing the file if needed. Only the blocks
+ * the range covers are rewritten. IOERR, with nothing written, if the
+ * range ends past MAXFILE blocks. */
+extent_protocol::status inode_manager::write_file_range(uint32_t inum,
+                                                        unsigned int off,
+                                                        const char* buf,
+                                                        int size) {
+    if (size < 0 || (unsigned long long)off + size > MAXFILE * BLOCK_SIZE)
+        return extent_protocol::IOERR;
+    inode* ino = get_inode(inum);
+    if (ino == NULL)
+        return extent_protocol::NOENT;
+    unsigned int end = off + size;
+
+    blockid_t bids[MAXFILE];
+    int n = load_blocks(ino, bids);
+    int want = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (want > n)
+        resize_blocks(inum, ino, bids, n, want);
+
+    char tmp[BLOCK_SIZE];
+    for (unsigned int pos = off; pos < end;) {
+        unsigned int boff = pos % BLOCK_SIZE;
+        unsigned int len = MIN(BLOCK_SIZE - boff, end - pos);
+        blockid_t bid = bids[pos / BLOCK_SIZE];
+        if (len == BLOCK_SIZE) {
+            bm->write_block(bid, buf + (pos - off));
+        } else {
+            bm->read_block(bid, tmp);
+            memcpy(tmp + boff, buf + (pos - off), len);
+            bm->write_block(bid, tmp);
+        }
+        pos += len;
+    }
+    if (end > ino->size)
+        ino->size = end;
+    put_inode(inum, ino);
+    free(ino);
+    return extent_protocol::OK;
+}
+
+/* Cut or zero-extend a file to size bytes; IOERR past MAXFILE blocks. */
+extent_protocol::status inode_manager::truncate_file(uint32_t inum,
+                                                     unsigned int size) {
+    if (size > MAXFILE * BLOCK_SIZE)
+        return extent_protocol::IOERR;
+    inode* ino = get_inode(inum);
+    if (ino == NULL)
+        return extent_protocol::NOENT;
+
+    blockid_t bids[MAXFILE];
+    int n = load_blocks(ino, bids);
+    int want = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (size < ino->size && size % BLOCK_SIZE) {
+        // keep the tail of the new last block zeroed
+        char tmp[BLOCK_SIZE];
+        bm->read_block(bids[want - 1], tmp);
+        memset(tmp + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+        bm->write_block(bids[want - 1], tmp);
+    }
+    if (want != n)
+        resize_blocks(inum, ino, bids, n, want);
+    ino->size = size;
+    put_inode(inum, ino);
+    free(ino);
+    return extent_protocol::OK;
 }
 
 void inode_manager::getattr(uint32_t inum, extent_protocol::attr& a) {
@@ -259,6 +615,7 @@ void inode_manager::getattr(uint32_t inum, extent_protocol::attr& a) {
         a.atime = ino->atime;
         a.ctime = ino->ctime;
         a.mtime = ino->mtime;
+        a.version = ino->version;
         free(ino);
     }
 }
@@ -274,8 +631,10 @@ void inode_manager::remove_iblock(uint32_t inum) {
     bm->free_block(inum);
 }
 
-void inode_manager::remove_file(uint32_t inum) {
+extent_protocol::status inode_manager::remove_file(uint32_t inum) {
     inode* ino = get_inode(inum);
+    if (ino == NULL)
+        return extent_protocol::NOENT;
     for (int i = 0; i < NDIRECT; ++i)
         if (ino->blocks[i])
             bm->free_block(ino->blocks[i]);
@@ -285,4 +644,5 @@ void inode_manager::remove_file(uint32_t inum) {
         remove_iblock(ino->blocks[NDIRECT]);
     free(ino);
     free_inode(inum);
+    return extent_protocol::OK;
 }
@@ -22,6 +22,7 @@ public:
     disk();
     void read_block(uint32_t id, char* buf);
     void write_block(uint32_t id, const char* buf);
+    bool same_block(uint32_t id, const char* buf);
 };
 
 // block layer -----------------------------------------
@@ -43,10 +44,12 @@ public:
     ~block_manager();
     struct superblock sb;
 
-    uint32_t alloc_block();
+    uint32_t alloc_block(uint32_t goal = 0);
     void free_block(uint32_t id);
     void read_block(uint32_t id, char* buf);
     void write_block(uint32_t id, const char* buf);
+    // whether block id holds exactly the BLOCK_SIZE bytes at buf
+    bool same_block(uint32_t id, const char* buf);
 };
 
 // inode layer -----------------------------------------
@@ -66,6 +69,12 @@ public:
 // Block containing bit for block b
 #define BBLOCK(b) ((b) / BPB + 2)
 
+// Inodes and data blocks are split into NGROUPS cylinder groups; inode i
+// lives in group IGROUP(i) and prefers data blocks in the same group.
+#define NGROUPS 32
+#define IPG (INODE_NUM / NGROUPS)
+#define IGROUP(i) ((i) / IPG)
+
 #define NDIRECT 100
 #define NINDIRECT (BLOCK_SIZE / sizeof(uint))
 #define MAXFILE (NDIRECT + NINDIRECT)
@@ -77,6 +86,7 @@ typedef struct inode {
     unsigned int mtime;
     unsigned int ctime;
     blockid_t blocks[NDIRECT + 1];  // Data block addresses
+    unsigned long long version;     // set from version_seq on every write
 } inode_t;
 
 class inode_manager {
@@ -84,20 +94,50 @@ private:
     block_manager* bm;
     struct inode* get_inode(uint32_t inum);
     void put_inode(uint32_t inum, struct inode* ino);
-    std::map<uint32_t, int> using_inodes;
+    bool using_inodes[INODE_NUM];
     void remove_iblock(uint32_t inum);
-    void write_blockn(uint32_t id, const char* buf, int size);
-
+    void write_blockn(uint32_t id, const char* buf, int size, bool fresh);
+    uint32_t pick_group(uint32_t type, uint32_t parent);
+    void init_inode(uint32_t inum, uint32_t type);
+    blockid_t group_block(uint32_t inum);
+    int load_blocks(inode* ino, blockid_t* bids);
+    void read_blocks(inode* ino, char** buf, int* size);
+    void resize_blocks(uint32_t inum, inode* ino, blockid_t* bids, int n,
+                       int want);
+
+    int ifree[NGROUPS];  // free inodes per group
+    int nfree;           // free inodes in all
+    uint32_t cursor[NGROUPS];  // where the next search of each group starts
+    int ndirs[NGROUPS];  // directories per group
+    unsigned long long version_seq;
+    std::map<uint32_t, unsigned long long> pinned;  // see pin_version
     pthread_mutex_t mutex;
+    pthread_mutex_t pin_mutex;
+
+    unsigned long long next_version(uint32_t inum);
 
 public:
     inode_manager();
     ~inode_manager();
-    uint32_t alloc_inode(uint32_t type);
+    // 0 when every inode is in use
+    uint32_t alloc_inode(uint32_t type, uint32_t parent = 0);
+    bool alloc_inode_at(uint32_t type, uint32_t inum);
     void free_inode(uint32_t inum);
-    void read_file(uint32_t inum, char** buf, int* size);
-    void write_file(uint32_t inum, const char* buf, int size);
-    void remove_file(uint32_t inum);
+    // writes to inum get version v, until called again with v 0
+    void pin_version(uint32_t inum, unsigned long long v);
+    // The file operations return NOENT for an inum with no inode.
+    extent_protocol::status read_file(uint32_t inum, char** buf, int* size);
+    extent_protocol::status write_file(uint32_t inum, const char* buf,
+                                       int size);
+    void read_file_attr(uint32_t inum, unsigned int limit,
+                        extent_protocol::attr& a, char** buf, int* size);
+    extent_protocol::status read_file_range(uint32_t inum, unsigned int off,
+                                            unsigned int len, char** buf,
+                                            int* size);
+    extent_protocol::status write_file_range(uint32_t inum, unsigned int off,
+                                             const char* buf, int size);
+    extent_protocol::status truncate_file(uint32_t inum, unsigned int size);
+    extent_protocol::status remove_file(uint32_t inum);
     void getattr(uint32_t inum, extent_protocol::attr& a);
 };
 
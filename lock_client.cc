@@ -1,6 +1,7 @@
 // RPC stubs for clients to talk to lock_server
 
 #include "lock_client.h"
+#include "logger.h"
 #include "rpc.h"
 #include <arpa/inet.h>
 
@@ -13,7 +14,7 @@ lock_client::lock_client(std::string dst) {
     make_sockaddr(dst.c_str(), &dstsock);
     cl = new rpcc(dstsock);
     if (cl->bind() < 0) {
-        printf("lock_client: call bind\n");
+        LOGE("lock_client: call bind\n");
     }
 }
 
@@ -26,7 +26,6 @@ lock_client_cache::lock_client_cache(std::string xdst, yfs_client* c,
     rlsrpc->reg(rlock_protocol::revoke, this,
                 &lock_client_cache::revoke_handler);
     rlsrpc->reg(rlock_protocol::retry, this, &lock_client_cache::retry_handler);
-    rlsrpc->reg(rlock_protocol::flush, this, &lock_client_cache::flush_handler);
     pthread_mutex_init(&mutex, NULL);
     pthread_cond_init(&cond, NULL);
 }
@@ -60,6 +59,18 @@ END:
     return ret;
 }
 
+bool lock_client_cache::try_acquire(lock_protocol::lockid_t lid) {
+    bool ret = false;
+    pthread_mutex_lock(&mutex);
+    std::map<lock_protocol::lockid_t, lock_info>::iterator it = lock.find(lid);
+    if (it != lock.end() && it->second.lock_status == FREE) {
+        it->second.lock_status = LOCKED;
+        ret = true;
+    }
+    pthread_mutex_unlock(&mutex);
+    return ret;
+}
+
 lock_protocol::status lock_client_cache::release(lock_protocol::lockid_t lid) {
     lock_protocol::status ret = lock_protocol::OK;
     // fprintf(stderr, "%s => %X: release %d status %d\n", id.c_str(),
@@ -67,21 +78,14 @@ lock_protocol::status lock_client_cache::release(lock_protocol::lockid_t lid) {
 
     pthread_mutex_lock(&mutex);
     if (lock[lid].revoked) {
-        std::vector<extent_protocol::extentid_t> clr = client->flush_cache(lid);
-        std::string str;
-        char tmp[100];
-        for (std::vector<extent_protocol::extentid_t>::iterator it =
-                 clr.begin();
-             it != clr.end(); ++it) {
-            sprintf(tmp, "%d ", (int)*it);
-            str += tmp;
-        }
         int r;
-        if (!str.empty())
-            cl->call(lock_protocol::flush, id, str, r);
-
         lock[lid].lock_status = RELEASING;
         pthread_mutex_unlock(&mutex);
+        // extent_server calls back the other clients caching what changed.
+        // yfs_client takes its cache mutex before this one, never after,
+        // so the flush runs without it.
+        if (client)
+            client->released(lid);
         ret = cl->call(lock_protocol::release, lid, id, r);
         pthread_mutex_lock(&mutex);
         lock[lid].lock_status = NONE;
@@ -121,15 +125,3 @@ rlock_protocol::status lock_client_cache::retry_handler(
     pthread_mutex_unlock(&mutex);
     return rlock_protocol::OK;
 }
-
-rlock_protocol::status lock_client_cache::flush_handler(std::string str, int&) {
-    const char* now = str.c_str();
-    while (*now != '\0') {
-        int r = atoi(now);
-        client->clear_cache(r);
-        while (*now != ' ')
-            ++now;
-        ++now;
-    }
-    return rlock_protocol::OK;
-}
\ No newline at end of file
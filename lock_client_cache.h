@@ -46,10 +46,12 @@ public:
                       class lock_release_user* l = 0);
     virtual ~lock_client_cache();
     lock_protocol::status acquire(lock_protocol::lockid_t);
+    // Take lid only if it is cached here and free, without waiting: for
+    // a caller that already holds other locks.
+    bool try_acquire(lock_protocol::lockid_t);
     lock_protocol::status release(lock_protocol::lockid_t);
     rlock_protocol::status revoke_handler(lock_protocol::lockid_t, int&);
     rlock_protocol::status retry_handler(lock_protocol::lockid_t, int&);
-    rlock_protocol::status flush_handler(std::string, int&);
 };
 
 #endif
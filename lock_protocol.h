@@ -10,14 +10,14 @@ public:
     enum xxstatus { OK, RETRY, RPCERR, NOENT, IOERR };
     typedef int status;
     typedef unsigned long long lockid_t;
-    enum rpc_numbers { acquire = 0x7001, release, stat, flush };
+    enum rpc_numbers { acquire = 0x7001, release, stat };
 };
 
 class rlock_protocol {
 public:
     enum xxstatus { OK, RPCERR };
     typedef int status;
-    enum rpc_numbers { revoke = 0x8001, retry = 0x8002, flush = 0x8003 };
+    enum rpc_numbers { revoke = 0x8001, retry = 0x8002 };
 };
 
 #endif
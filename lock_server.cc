@@ -1,6 +1,7 @@
 // the lock server implementation
 
 #include "lock_server.h"
+#include "logger.h"
 #include <sstream>
 #include <stdio.h>
 #include <unistd.h>
@@ -19,7 +20,7 @@ lock_server::~lock_server() {
 lock_protocol::status lock_server::stat(int clt, lock_protocol::lockid_t lid,
                                         int& r) {
     lock_protocol::status ret = lock_protocol::OK;
-    printf("stat request from clt %d\n", clt);
+    LOGI("stat request from clt %d\n", clt);
     r = nacquire;
     return ret;
 }
@@ -20,7 +20,6 @@ private:
     pthread_mutex_t mutex;
     int nacquire;
     std::map<lock_protocol::lockid_t, lock_info> lock;
-    std::map<std::string, bool> conn;
 
 public:
     lock_server_cache();
@@ -28,7 +27,6 @@ public:
     lock_protocol::status stat(lock_protocol::lockid_t, int&);
     int acquire(lock_protocol::lockid_t, std::string, int&);
     int release(lock_protocol::lockid_t, std::string, int&);
-    int flush(std::string, std::string, int&);
 };
 
 #endif
@@ -13,6 +13,8 @@
 int main(int argc, char* argv[]) {
     int count = 0;
 
+    // librpc's jsl_log bypasses the logger, so keep stdio unbuffered to
+    // interleave its output with the logger's
     setvbuf(stdout, NULL, _IONBF, 0);
     setvbuf(stderr, NULL, _IONBF, 0);
 
@@ -42,7 +44,6 @@ int main(int argc, char* argv[]) {
     server.reg(lock_protocol::stat, &ls, &lock_server_cache::stat);
     server.reg(lock_protocol::release, &ls, &lock_server_cache::release);
     server.reg(lock_protocol::acquire, &ls, &lock_server_cache::acquire);
-    server.reg(lock_protocol::flush, &ls, &lock_server_cache::flush);
 #endif
 
     while (1)
@@ -7,6 +7,7 @@
 #include "lock_client_cache.h"
 #include "rpc.h"
 #include "jsl_log.h"
+#include "logger.h"
 #include <arpa/inet.h>
 #include <vector>
 #include <stdlib.h>
@@ -82,15 +83,15 @@ test2(void *x)
 {
   int i = * (int *) x;
 
-  printf ("test2: client %d acquire a release a\n", i);
+  LOGI("test2: client %d acquire a release a\n", i);
   lc[i]->acquire(a);
-  printf ("test2: client %d acquire done\n", i);
+  LOGI("test2: client %d acquire done\n", i);
   check_grant(a);
   sleep(1);
-  printf ("test2: client %d release\n", i);
+  LOGI("test2: client %d release\n", i);
   check_release(a);
   lc[i]->release(a);
-  printf ("test2: client %d release done\n", i);
+  LOGI("test2: client %d release done\n", i);
   return 0;
 }
 
@@ -99,11 +100,11 @@ test3(void *x)
 {
   int i = * (int *) x;
 
-  printf ("test3: client %d acquire a release a concurrent\n", i);
+  LOGI("test3: client %d acquire a release a concurrent\n", i);
   for (int j = 0; j < 10; j++) {
     lc[i]->acquire(a);
     check_grant(a);
-    printf ("test3: client %d got lock\n", i);
+    LOGI("test3: client %d got lock\n", i);
     check_release(a);
     lc[i]->release(a);
   }
@@ -115,11 +116,11 @@ test4(void *x)
 {
   int i = * (int *) x;
 
-  printf ("test4: thread %d acquire a release a concurrent; same clnt\n", i);
+  LOGI("test4: thread %d acquire a release a concurrent; same clnt\n", i);
   for (int j = 0; j < 10; j++) {
     lc[0]->acquire(a);
     check_grant(a);
-    printf ("test4: thread %d on client 0 got lock\n", i);
+    LOGI("test4: thread %d on client 0 got lock\n", i);
     check_release(a);
     lc[0]->release(a);
   }
@@ -131,12 +132,12 @@ test5(void *x)
 {
   int i = * (int *) x;
 
-  printf ("test5: client %d acquire a release a concurrent; same and diff clnt\n", i);
+  LOGI("test5: client %d acquire a release a concurrent; same and diff clnt\n", i);
   for (int j = 0; j < 10; j++) {
     if (i < 5)  lc[0]->acquire(a);
     else  lc[1]->acquire(a);
     check_grant(a);
-    printf ("test5: client %d got lock\n", i);
+    LOGI("test5: client %d got lock\n", i);
     check_release(a);
     if (i < 5) lc[0]->release(a);
     else lc[1]->release(a);
@@ -151,6 +152,8 @@ main(int argc, char *argv[])
     pthread_t th[nt];
     int test = 0;
 
+    // the verdict lines the lab scripts look for stay on raw stdio; the
+    // per-thread trace goes through the logger
     setvbuf(stdout, NULL, _IONBF, 0);
     setvbuf(stderr, NULL, _IONBF, 0);
     srandom(getpid());
@@ -237,6 +240,7 @@ main(int argc, char *argv[])
       }
     }
 
+    log_flush();
     printf ("%s: passed all tests successfully\n", argv[0]);
 
 }
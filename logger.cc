@@ -0,0 +1,190 @@
+// asynchronous, level-gated logging.
+//
+// Each thread owns a single-producer ring of fixed-size records. The
+// producer only formats into its next free slot and publishes it with a
+// release store, so logging on a hot path takes no lock and makes no
+// system call. One drain thread walks all rings, stamps the lines and
+// writes them to stdout in one write() per pass.
+
+#include "logger.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_RING_SLOTS 256  // per thread, a power of two
+#define LOG_MSG_SIZE 240
+#define LOG_DRAIN_US 10000
+
+int log_runtime_level = LOGL_INFO;
+
+namespace {
+
+struct log_record {
+    struct timespec ts;
+    int level;
+    char msg[LOG_MSG_SIZE];
+};
+
+struct log_ring {
+    log_record slots[LOG_RING_SLOTS];
+    unsigned head;  // written by the owning thread only
+    unsigned tail;  // written by the drain thread only
+    unsigned dropped;
+    int in_use;  // cleared when the owning thread exits, so it can be reused
+    unsigned long tid;
+    log_ring *next;
+};
+
+log_ring *rings = NULL;  // every ring ever created, newest first
+pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t drain_once = PTHREAD_ONCE_INIT;
+pthread_key_t ring_key;
+__thread log_ring *my_ring = NULL;
+
+const char *level_name[] = {"", "E", "W", "I", "D"};
+
+// the coarse clock is read from the vDSO without entering the kernel
+void now(struct timespec *ts) {
+#ifdef CLOCK_REALTIME_COARSE
+    clock_gettime(CLOCK_REALTIME_COARSE, ts);
+#else
+    clock_gettime(CLOCK_REALTIME, ts);
+#endif
+}
+
+void write_out(const char *buf, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(1, buf, n);
+        if (w <= 0)
+            return;
+        buf += w;
+        n -= w;
+    }
+}
+
+// Move every published record to stdout. Returns the number written.
+int drain() {
+    char out[LOG_RING_SLOTS * 64];
+    int total = 0;
+
+    pthread_mutex_lock(&drain_mutex);
+    pthread_mutex_lock(&rings_mutex);
+    log_ring *r = rings;
+    pthread_mutex_unlock(&rings_mutex);
+    // rings are only ever pushed at the head, so the list below r is stable
+    for (; r != NULL; r = r->next) {
+        size_t n = 0;
+        unsigned head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        unsigned dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped)
+            n += snprintf(out + n, sizeof(out) - n,
+                          "[logger] thread %lx dropped %u messages\n", r->tid,
+                          dropped);
+        while (r->tail != head) {
+            log_record &rec = r->slots[r->tail & (LOG_RING_SLOTS - 1)];
+            size_t len = strlen(rec.msg);
+            if (n + len + 64 > sizeof(out)) {
+                write_out(out, n);
+                n = 0;
+            }
+            n += snprintf(out + n, sizeof(out) - n, "%ld.%03ld %s %lx ",
+                          (long)rec.ts.tv_sec, rec.ts.tv_nsec / 1000000,
+                          level_name[rec.level], r->tid);
+            memcpy(out + n, rec.msg, len);
+            n += len;
+            if (len == 0 || rec.msg[len - 1] != '\n')
+                out[n++] = '\n';
+            __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+            total++;
+        }
+        write_out(out, n);
+    }
+    pthread_mutex_unlock(&drain_mutex);
+    return total;
+}
+
+void release_ring(void *p) {
+    log_ring *r = (log_ring *)p;
+    pthread_mutex_lock(&rings_mutex);
+    r->in_use = 0;
+    pthread_mutex_unlock(&rings_mutex);
+}
+
+void *drain_thread(void *) {
+    while (true) {
+        if (drain() == 0)
+            usleep(LOG_DRAIN_US);
+    }
+    return NULL;
+}
+
+void start_drain() {
+    pthread_t th;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&th, &attr, drain_thread, NULL);
+    pthread_attr_destroy(&attr);
+    pthread_key_create(&ring_key, release_ring);
+    atexit(log_flush);
+}
+
+// Adopt the ring of an exited thread, or add a new one. Records still
+// queued in an adopted ring are drained in order before the new ones.
+log_ring *get_ring() {
+    if (my_ring != NULL)
+        return my_ring;
+
+    pthread_once(&drain_once, start_drain);
+    pthread_mutex_lock(&rings_mutex);
+    log_ring *r = rings;
+    while (r != NULL && r->in_use)
+        r = r->next;
+    if (r == NULL) {
+        r = (log_ring *)calloc(1, sizeof(log_ring));
+        r->next = rings;
+        rings = r;
+    }
+    r->in_use = 1;
+    r->tid = (unsigned long)pthread_self();
+    pthread_mutex_unlock(&rings_mutex);
+    pthread_setspecific(ring_key, r);
+    my_ring = r;
+    return r;
+}
+
+struct log_setup {
+    log_setup() {
+        const char *s = getenv("LOG_LEVEL");
+        if (s != NULL)
+            log_runtime_level = atoi(s);
+    }
+} setup;
+
+}  // namespace
+
+void log_write(int level, const char *fmt, ...) {
+    log_ring *r = get_ring();
+    unsigned tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (r->head - tail == LOG_RING_SLOTS) {
+        __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    log_record &rec = r->slots[r->head & (LOG_RING_SLOTS - 1)];
+    now(&rec.ts);
+    rec.level = level < LOGL_ERROR ? LOGL_ERROR
+                : level > LOGL_DEBUG ? LOGL_DEBUG : level;
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(rec.msg, sizeof(rec.msg), fmt, ap);
+    va_end(ap);
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+void log_flush() { drain(); }
@@ -0,0 +1,45 @@
+// asynchronous, level-gated logging.
+
+#ifndef logger_h
+#define logger_h
+
+// Levels follow jsl_log: lower is more severe.
+enum log_level {
+    LOGL_OFF = 0,
+    LOGL_ERROR = 1,
+    LOGL_WARN = 2,
+    LOGL_INFO = 3,
+    LOGL_DEBUG = 4,
+};
+
+// Messages above LOG_MAX_LEVEL are compiled out entirely; build with
+// -DLOG_MAX_LEVEL=2 to keep only errors and warnings in the binary.
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOGL_DEBUG
+#endif
+
+// The runtime level, LOGL_INFO unless the LOG_LEVEL environment variable
+// says otherwise. Messages above it cost one compare.
+extern int log_runtime_level;
+
+// Format the message into the calling thread's ring buffer; a background
+// thread writes it out. Never blocks: when the ring is full the message is
+// dropped and counted.
+void log_write(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Write out everything logged so far. Called at exit.
+void log_flush();
+
+#define LOG(level, ...)                                             \
+    do {                                                            \
+        if ((level) <= LOG_MAX_LEVEL && (level) <= log_runtime_level) \
+            log_write((level), __VA_ARGS__);                        \
+    } while (0)
+
+#define LOGE(...) LOG(LOGL_ERROR, __VA_ARGS__)
+#define LOGW(...) LOG(LOGL_WARN, __VA_ARGS__)
+#define LOGI(...) LOG(LOGL_INFO, __VA_ARGS__)
+#define LOGD(...) LOG(LOGL_DEBUG, __VA_ARGS__)
+
+#endif
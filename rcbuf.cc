@@ -0,0 +1,79 @@
+// refcounted byte buffers for the data yfs_client caches
+
+#include "rcbuf.h"
+#include <algorithm>
+#include "lang/verify.h"
+
+// A block gains refs only by copying an rcbuf of it, which yfs_client
+// does under cache_mutex, as it does edit(): so the count edit() sees is
+// never too low. Refs are dropped on any thread, hence the atomics.
+void rcbuf::hold() {
+    if (b)
+        __sync_add_and_fetch(&b->refs, 1);
+}
+
+void rcbuf::drop() {
+    if (b && __sync_sub_and_fetch(&b->refs, 1) == 0)
+        delete b;
+    b = NULL;
+}
+
+rcbuf& rcbuf::operator=(const rcbuf& o) {
+    if (o.b != b) {
+        drop();
+        b = o.b;
+        hold();
+    }
+    off = o.off;
+    len = o.len;
+    return *this;
+}
+
+void rcbuf::swap(rcbuf& o) {
+    std::swap(b, o.b);
+    std::swap(off, o.off);
+    std::swap(len, o.len);
+}
+
+void rcbuf::adopt(std::string& s) {
+    drop();
+    b = new block;
+    b->refs = 1;
+    b->bytes.swap(s);
+    off = 0;
+    len = WHOLE;
+}
+
+const char* rcbuf::data() const {
+    return b ? b->bytes.data() + off : "";
+}
+
+size_t rcbuf::size() const {
+    if (!b)
+        return 0;
+    return len == WHOLE ? b->bytes.size() : len;
+}
+
+rcbuf rcbuf::slice(size_t from, size_t n) const {
+    rcbuf s(*this);
+    size_t have = size();
+    if (from > have)
+        from = have;
+    s.off = off + from;
+    s.len = n < have - from ? n : have - from;
+    return s;
+}
+
+const std::string& rcbuf::str() const {
+    static const std::string none;
+    VERIFY(len == WHOLE);
+    return b ? b->bytes : none;
+}
+
+std::string& rcbuf::edit() {
+    if (!b || b->refs > 1 || len != WHOLE) {
+        std::string mine(data(), size());
+        adopt(mine);
+    }
+    return b->bytes;
+}
@@ -0,0 +1,50 @@
+// refcounted byte buffers for the data yfs_client caches.
+
+#ifndef rcbuf_h
+#define rcbuf_h
+
+#include <stddef.h>
+#include <string>
+
+// A view of bytes in a block shared by refcount. Copies and slices share
+// the block, so handing out cached data copies nothing. The bytes of a
+// shared block never change: edit() gives the caller a block of its own
+// first, copying only if the block is shared.
+class rcbuf {
+public:
+    rcbuf() : b(NULL), off(0), len(WHOLE) {}
+    rcbuf(const rcbuf& o) : b(o.b), off(o.off), len(o.len) { hold(); }
+    ~rcbuf() { drop(); }
+    rcbuf& operator=(const rcbuf& o);
+    void swap(rcbuf& o);
+
+    // Take over the bytes of s, leaving it empty: a move, not a copy.
+    void adopt(std::string& s);
+
+    const char* data() const;
+    size_t size() const;
+    bool empty() const { return size() == 0; }
+    // len bytes from off, sharing the block; clipped to the end
+    rcbuf slice(size_t off, size_t len) const;
+
+    // The whole block, for reading. Not for slices, whose block holds
+    // more than they do.
+    const std::string& str() const;
+    // The bytes as a string to change in place, resized as need be.
+    std::string& edit();
+
+private:
+    static const size_t WHOLE = ~(size_t)0;  // len of a view of all of b
+    struct block {
+        std::string bytes;
+        int refs;
+    };
+    block* b;
+    size_t off;
+    size_t len;
+
+    void hold();
+    void drop();
+};
+
+#endif
@@ -0,0 +1,95 @@
+// latency and volume counters for extent_server.
+
+#include "stats.h"
+#include <string.h>
+#include <time.h>
+
+__thread unsigned long long stat_store_ns = 0;
+__thread unsigned long long stat_block_ns = 0;
+
+unsigned long long stat_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+latency_hist::latency_hist() { memset(counts, 0, sizeof(counts)); }
+
+unsigned latency_hist::bucket(unsigned long long ns) {
+    if (ns < SUB)
+        return ns;
+    if (ns >> MAX_BITS)
+        ns = (1ULL << MAX_BITS) - 1;
+    unsigned e = 63 - __builtin_clzll(ns);  // ns is in [2^e, 2^(e+1))
+    return (e - SUB_BITS + 1) * SUB + ((ns >> (e - SUB_BITS)) & (SUB - 1));
+}
+
+// the largest value that lands in bucket b
+unsigned long long latency_hist::bucket_top(unsigned b) {
+    if (b < SUB)
+        return b;
+    unsigned e = b / SUB + SUB_BITS - 1;
+    unsigned long long low = (unsigned long long)(SUB + b % SUB)
+                             << (e - SUB_BITS);
+    return low + (1ULL << (e - SUB_BITS)) - 1;
+}
+
+void latency_hist::record(unsigned long long ns) {
+    __sync_fetch_and_add(&counts[bucket(ns)], 1);
+}
+
+void latency_hist::snapshot(std::vector<unsigned long long>& out) const {
+    out.assign(counts, counts + BUCKETS);
+}
+
+unsigned long long latency_hist::percentile(
+    const std::vector<unsigned long long>& counts, double q) {
+    unsigned long long total = 0;
+    for (unsigned b = 0; b < counts.size(); b++)
+        total += counts[b];
+    if (total == 0)
+        return 0;
+
+    // the rank of the value wanted, counting from 1
+    unsigned long long rank = (unsigned long long)(q * total);
+    if (rank < 1)
+        rank = 1;
+    unsigned long long seen = 0;
+    for (unsigned b = 0; b < counts.size(); b++) {
+        seen += counts[b];
+        if (seen >= rank)
+            return bucket_top(b);
+    }
+    return bucket_top(counts.size() - 1);
+}
+
+server_stats::server_stats() {
+    for (int i = 0; i < NOPS; i++) {
+        c[i].calls = 0;
+        c[i].bytes = 0;
+    }
+}
+
+void server_stats::record(int op, unsigned long long bytes,
+                          const unsigned long long* ns) {
+    __sync_fetch_and_add(&c[op].calls, 1);
+    if (bytes)
+        __sync_fetch_and_add(&c[op].bytes, bytes);
+    for (int p = 0; p < NPHASES; p++)
+        c[op].hist[p].record(ns[p]);
+}
+
+void server_stats::snapshot(std::vector<extent_protocol::op_stats>& out) const {
+    static const char* names[NOPS] = {"get",    "put",    "getattr",
+                                      "create", "remove", "dir",
+                                      "delta",  "stage"};
+    out.resize(NOPS);
+    for (int i = 0; i < NOPS; i++) {
+        out[i].name = names[i];
+        out[i].calls = c[i].calls;
+        out[i].bytes = c[i].bytes;
+        c[i].hist[RPC].snapshot(out[i].rpc);
+        c[i].hist[STORE].snapshot(out[i].store);
+        c[i].hist[BLOCK].snapshot(out[i].block);
+    }
+}
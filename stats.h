@@ -0,0 +1,88 @@
+// latency and volume counters for extent_server.
+
+#ifndef stats_h
+#define stats_h
+
+#include <vector>
+#include "extent_protocol.h"
+
+// HDR-style histogram of nanosecond latencies. Values below 16 get a
+// bucket each; above that every power of two is split into 16 equal
+// buckets, so a reported percentile is within 1/16 of the true value.
+// Recording is one atomic add, so any thread may record at any time.
+class latency_hist {
+public:
+    enum { SUB_BITS = 4, SUB = 1 << SUB_BITS, MAX_BITS = 40 };
+    enum { BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB };
+
+    latency_hist();
+    void record(unsigned long long ns);
+    void snapshot(std::vector<unsigned long long>& counts) const;
+
+    // the value below which a fraction q of the recorded values lie,
+    // from counts as filled by snapshot(); 0 when nothing was recorded.
+    static unsigned long long percentile(
+        const std::vector<unsigned long long>& counts, double q);
+
+private:
+    unsigned long long counts[BUCKETS];
+
+    static unsigned bucket(unsigned long long ns);
+    static unsigned long long bucket_top(unsigned b);
+};
+
+// Time spent in the storage engine and in the block layer beneath it by
+// the calling thread, ever. A phase's share of one request is the
+// difference across it.
+extern __thread unsigned long long stat_store_ns;
+extern __thread unsigned long long stat_block_ns;
+
+// CLOCK_MONOTONIC in nanoseconds.
+unsigned long long stat_now();
+
+// Per-op counters of one extent_server. Ops of a batch count as their
+// own kind; the chunks of a staged put count as stage, and its commit as
+// a put.
+class server_stats {
+public:
+    enum ops { GET, PUT, GETATTR, CREATE, REMOVE, DIR, DELTA, STAGE, NOPS };
+    // phases of a request: all of it, the engine, the block layer
+    enum phases { RPC, STORE, BLOCK, NPHASES };
+
+    server_stats();
+    void record(int op, unsigned long long bytes, const unsigned long long* ns);
+    void snapshot(std::vector<extent_protocol::op_stats>& out) const;
+
+private:
+    struct counters {
+        unsigned long long calls;
+        unsigned long long bytes;
+        latency_hist hist[NPHASES];
+    };
+    counters c[NOPS];
+};
+
+// Times one request for server_stats from construction to destruction.
+// Set bytes to the payload moved before it goes out of scope.
+class stat_scope {
+public:
+    unsigned long long bytes;
+
+    stat_scope(server_stats& s, int op)
+        : bytes(0), st(s), op(op), start(stat_now()), store0(stat_store_ns),
+          block0(stat_block_ns) {}
+    ~stat_scope() {
+        unsigned long long ns[server_stats::NPHASES];
+        ns[server_stats::RPC] = stat_now() - start;
+        ns[server_stats::STORE] = stat_store_ns - store0;
+        ns[server_stats::BLOCK] = stat_block_ns - block0;
+        st.record(op, bytes, ns);
+    }
+
+private:
+    server_stats& st;
+    int op;
+    unsigned long long start, store0, block0;
+};
+
+#endif
@@ -0,0 +1,180 @@
+//
+// stats tester: percentiles of latency_hist against known distributions
+//
+
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static int failures = 0;
+
+// add the counts of b into a, as extent_stat sums the servers it lists
+static void merge(std::vector<unsigned long long>& a,
+                  const std::vector<unsigned long long>& b) {
+    if (a.size() < b.size())
+        a.resize(b.size());
+    for (unsigned i = 0; i < b.size(); i++)
+        a[i] += b[i];
+}
+
+// Check that the q percentile of counts is the top of the bucket holding
+// want: no less than want, and above it by at most want/16.
+static void check(const char* name, const std::vector<unsigned long long>& counts,
+                  double q, unsigned long long want) {
+    unsigned long long got = latency_hist::percentile(counts, q);
+    if (got < want || got - want > want / latency_hist::SUB) {
+        printf("%s: p%g is %llu, expected %llu to %llu\n", name, q * 100, got,
+               want, want + want / latency_hist::SUB);
+        failures++;
+    } else {
+        printf("%s: p%g OK, %llu\n", name, q * 100, got);
+    }
+}
+
+// Check that the q percentile of counts is exactly want.
+static void check_exact(const char* name,
+                        const std::vector<unsigned long long>& counts, double q,
+                        unsigned long long want) {
+    unsigned long long got = latency_hist::percentile(counts, q);
+    if (got != want) {
+        printf("%s: p%g is %llu, expected %llu\n", name, q * 100, got, want);
+        failures++;
+    } else {
+        printf("%s: p%g OK, %llu\n", name, q * 100, got);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<unsigned long long> counts;
+    const unsigned long long top = (1ULL << latency_hist::MAX_BITS) - 1;
+
+    {
+        latency_hist h;
+        h.snapshot(counts);
+        if (counts.size() != latency_hist::BUCKETS) {
+            printf("snapshot: %u buckets, expected %u\n",
+                   (unsigned)counts.size(), (unsigned)latency_hist::BUCKETS);
+            failures++;
+        }
+        check_exact("empty", counts, 0.5, 0);
+    }
+
+    // values below SUB get a bucket each
+    {
+        latency_hist h;
+        for (unsigned long long v = 0; v < latency_hist::SUB; v++)
+            h.record(v);
+        h.snapshot(counts);
+        check_exact("small", counts, 0.5, latency_hist::SUB / 2 - 1);
+        check_exact("small", counts, 1.0, latency_hist::SUB - 1);
+        check_exact("small", counts, 0.0, 0);
+    }
+
+    // every value of 1..100000 once
+    {
+        latency_hist h;
+        for (unsigned long long v = 1; v <= 100000; v++)
+            h.record(v);
+        h.snapshot(counts);
+        check("uniform", counts, 0.50, 50000);
+        check("uniform", counts, 0.99, 99000);
+        check("uniform", counts, 0.999, 99900);
+    }
+
+    // the edges of power-of-two ranges land at their bucket's bottom
+    for (unsigned e = latency_hist::SUB_BITS; e < latency_hist::MAX_BITS; e++) {
+        latency_hist h;
+        h.record(1ULL << e);
+        h.record((1ULL << e) - 1);
+        h.snapshot(counts);
+        check("power of two", counts, 1.0, 1ULL << e);
+        check("below a power of two", counts, 0.5, (1ULL << e) - 1);
+    }
+
+    // a slow tail: 1 in 100 at 1ms, 1 in 1000 of those at 1s
+    {
+        latency_hist h;
+        for (int i = 0; i < 100000; i++) {
+            if (i % 1000 == 0)
+                h.record(1000000000ULL);
+            else if (i % 100 == 0)
+                h.record(1000000ULL);
+            else
+                h.record(20000ULL + i % 7);
+        }
+        h.snapshot(counts);
+        check("tail", counts, 0.50, 20006);
+        check("tail", counts, 0.99, 20006);
+        check("tail", counts, 0.995, 1000000ULL);
+        check("tail", counts, 0.9995, 1000000000ULL);
+    }
+
+    // values at and past 2^MAX_BITS all land in the last bucket
+    {
+        latency_hist h;
+        h.record(top);
+        h.snapshot(counts);
+        check_exact("2^40-1", counts, 0.5, top);
+        h.record(1ULL << latency_hist::MAX_BITS);
+        h.record(1ULL << 50);
+        h.record(~0ULL);
+        h.snapshot(counts);
+        check_exact("past 2^40", counts, 0.5, top);
+        check_exact("past 2^40", counts, 0.999, top);
+        if (counts[latency_hist::BUCKETS - 1] != 4) {
+            printf("past 2^40: %llu in the last bucket, expected 4\n",
+                   counts[latency_hist::BUCKETS - 1]);
+            failures++;
+        }
+    }
+
+    // merging across servers: one fast, one slow, and one that sent no
+    // buckets at all
+    {
+        latency_hist fast, slow;
+        for (int i = 0; i < 980; i++)
+            fast.record(5000);
+        for (int i = 0; i < 20; i++)
+            slow.record(800000);
+        std::vector<unsigned long long> a, b, total;
+        fast.snapshot(a);
+        slow.snapshot(b);
+        merge(total, std::vector<unsigned long long>());
+        merge(total, a);
+        merge(total, b);
+        check("merged", total, 0.50, 5000);
+        check("merged", total, 0.98, 5000);
+        check("merged", total, 0.99, 800000);
+        check("merged", total, 0.999, 800000);
+    }
+
+    // server_stats keeps a histogram per op and phase
+    {
+        server_stats s;
+        unsigned long long ns[server_stats::NPHASES] = {3000, 2000, 1000};
+        for (int i = 0; i < 10; i++)
+            s.record(server_stats::PUT, 4096, ns);
+        std::vector<extent_protocol::op_stats> out;
+        s.snapshot(out);
+        if (out.size() != server_stats::NOPS ||
+            out[server_stats::PUT].name != "put" ||
+            out[server_stats::PUT].calls != 10 ||
+            out[server_stats::PUT].bytes != 40960 ||
+            out[server_stats::GET].calls != 0) {
+            printf("server_stats: counters wrong\n");
+            failures++;
+        }
+        if (out.size() == server_stats::NOPS) {
+            check("server_stats rpc", out[server_stats::PUT].rpc, 0.5, 3000);
+            check("server_stats store", out[server_stats::PUT].store, 0.5, 2000);
+            check("server_stats block", out[server_stats::PUT].block, 0.5, 1000);
+        }
+    }
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("./stats_tester: passed all tests successfully\n");
+    return 0;
+}
@@ -1,10 +1,8 @@
 #ifndef TPRINTF_H
 #define TPRINTF_H
 
-#define tprintf(args...) do { \
-        struct timeval tv;     \
-        gettimeofday(&tv, 0); \
-        printf("%ld:\t", tv.tv_sec * 1000 + tv.tv_usec / 1000);\
-        printf(args);   \
-        } while (0);
+#include "logger.h"
+
+// the logger stamps every line, so tprintf is plain info logging now
+#define tprintf(args...) LOGI(args)
 #endif
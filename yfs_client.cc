@@ -1,20 +1,55 @@
 // yfs client.  implements FS operations using extent and lock server
 #include "yfs_client.h"
 #include "extent_client.h"
+#include "delta.h"
+#include "directory.h"
+#include "logger.h"
+#include "slock.h"
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <ctime>
 
+int yfs_client::last_port = 0;
+
 yfs_client::yfs_client(std::string extent_dst, std::string lock_dst) {
-    ec = new extent_client(extent_dst);
+    // before the callback servers start
+    pthread_mutex_init(&cache_mutex, NULL);
+    pthread_mutex_init(&inval_mutex, NULL);
+    pthread_cond_init(&flush_cond, NULL);
+    pthread_cond_init(&ra_cond, NULL);
+    epochs = 0;
+    missing_count = 0;
+    missing_hook = NULL;
+    // YFS_CACHE_BYTES bounds the cache, 0 for no bound
+    const char* budget = getenv("YFS_CACHE_BYTES");
+    cache_budget = budget ? strtoull(budget, NULL, 10) : CACHE_BUDGET;
+    memset(&usage, 0, sizeof(usage));
+
+    // extent servers call back here when extents we cache change
+    srand(time(NULL) ^ getpid() ^ last_port);
+    int port = (rand() % 32000) | (0x1 << 10);
+    last_port = port;
+    rpcs* ersrpc = new rpcs(port);
+    ersrpc->reg(rextent_protocol::invalidate, this,
+                &yfs_client::invalidate_handler);
+    std::ostringstream host;
+    host << "127.0.0.1:" << port;
+    ec = new extent_client(extent_dst, host.str());
+    // the root directory is created by the extent server that owns it
     lc = new lock_client_cache(lock_dst, this);
-    if (ec_put(1, "") != extent_protocol::OK)
-        printf("error init root dir\n");  // XYB: init root dir
+
+    pthread_t th;
+    if (pthread_create(&th, NULL, flusher, this) == 0)
+        pthread_detach(th);
+    if (pthread_create(&th, NULL, read_ahead, this) == 0)
+        pthread_detach(th);
 }
 
 yfs_client::inum yfs_client::n2i(std::string n) {
@@ -30,67 +65,13 @@ std::string yfs_client::filename(inum inum) {
     return ost.str();
 }
 
-void yfs_client::buildlist(const char* buf, std::list<dirent>& list) {
-    dirent dir;
-    int size;
-    while ((size = nextmap(buf, dir)) != 0) {
-        list.push_back(dir);
-        buf += size;
-    }
-}
-
-int yfs_client::nextmap(const char* buf, dirent& dir) {
-    std::string name;
-    yfs_client::inum inum;
-    const char* now = buf;
-
-    while (*now != '\0') {
-        name.push_back(*now);
-        ++now;
-    }
-    ++now;
-    if (name.empty())
-        return 0;
-
-    inum = *((uint32_t*)now);
-    now += 4;
-
-    dir.name = name;
-    dir.inum = inum;
-    return now - buf;
-}
-
-bool yfs_client::addmap(std::string& buf, const char* name, inum node) {
-    if (buf.size() + strlen(name) + 5 >=
-        (NDIRECT + NINDIRECT) * BLOCK_SIZE)  // last always 0
-        return false;
-    uint32_t tmp = node;
-    buf.append(name);
-    buf.append(1, 0);
-    buf.append((const char*)&tmp, 4);
-    return true;
-}
-
-void yfs_client::deletemap(std::string& buf, const char* name) {
-    dirent tmp;
-    const char* now = buf.c_str();
-    int size;
-    while ((size = nextmap(now, tmp)) != 0) {
-        if (tmp.name == name) {
-            buf.erase(now - buf.c_str(), size);
-            break;
-        }
-        now += size;
-    }
-}
-
 int yfs_client::checktype(inum inum) {
     extent_protocol::attr a;
     int ret = 0;
     lc->acquire(inum);
 
     if (ec_getattr(inum, a) != extent_protocol::OK) {
-        printf("error getting attr\n");
+        LOGW("error getting attr\n");
         goto RET;
     }
     ret = a.type;
@@ -115,7 +96,7 @@ int yfs_client::getfile(inum inum, fileinfo& fin) {
     int r = OK;
     lc->acquire(inum);
 
-    printf("getfile %016llx\n", inum);
+    LOGD("getfile %016llx\n", inum);
     extent_protocol::attr a;
     if (ec_getattr(inum, a) != extent_protocol::OK) {
         r = IOERR;
@@ -126,7 +107,7 @@ int yfs_client::getfile(inum inum, fileinfo& fin) {
     fin.mtime = a.mtime;
     fin.ctime = a.ctime;
     fin.size = a.size;
-    printf("getfile %016llx -> sz %llu\n", inum, fin.size);
+    LOGD("getfile %016llx -> sz %llu\n", inum, fin.size);
 
 RET:
     lc->release(inum);
@@ -137,7 +118,7 @@ int yfs_client::getdir(inum inum, dirinfo& din) {
     int r = OK;
     lc->acquire(inum);
 
-    printf("getdir %016llx\n", inum);
+    LOGD("getdir %016llx\n", inum);
     extent_protocol::attr a;
     if (ec_getattr(inum, a) != extent_protocol::OK) {
         r = IOERR;
@@ -155,7 +136,7 @@ RET:
 #define EXT_RPC(xx)                                                \
     do {                                                           \
         if ((xx) != extent_protocol::OK) {                         \
-            printf("EXT_RPC Error: %s:%d \n", __FILE__, __LINE__); \
+            LOGE("EXT_RPC Error: %s:%d \n", __FILE__, __LINE__);   \
             r = IOERR;                                             \
             goto release;                                          \
         }                                                          \
@@ -167,30 +148,21 @@ int yfs_client::setattr(inum ino, size_t size) {
     lc->acquire(ino);
 
     extent_protocol::attr attr;
-    std::string buf;
     if ((r = ec_getattr(ino, attr)) != extent_protocol::OK)
         goto RET;
     if (attr.size == size)
         goto RET;
 
-    if ((r = ec_get(ino, buf)) != extent_protocol::OK)
-        goto RET;
-
-    if (attr.size > size)
-        buf.erase(buf.begin() + size, buf.end());
-    else
-        buf.append(size - attr.size, 0);
-    ec_put(ino, buf);
+    r = ec_truncate(ino, size);
 
 RET:
     lc->release(ino);
     return r;
 }
 
-/*
-directory format
-|  name  |  node(uint32)  |
-*/
+// Directories live in directory.h's format. When a directory is cached
+// it is edited locally and written back on revoke; otherwise the server
+// edits it in place through the dir_* RPCs.
 
 int yfs_client::createhelper(inum parent, const char* name, mode_t mode,
                              inum& ino_out, uint32_t type) {
@@ -198,7 +170,13 @@ int yfs_client::createhelper(inum parent, const char* name, mode_t mode,
     lc->acquire(parent);
 
     bool found = true;
-    std::string buf;
+    if (!have_data(parent)) {
+        r = ec_create(type, parent, name, ino_out);
+        if (r == extent_protocol::EXIST)
+            r = EXIST;
+        goto RET;
+    }
+
     if ((r = lookup_nl(parent, name, found, ino_out)) != OK)
         goto RET;
     if (found) {
@@ -206,20 +184,14 @@ int yfs_client::createhelper(inum parent, const char* name, mode_t mode,
         goto RET;
     }
 
-    ec_create(type, ino_out);
-
-    if ((r = ec_get(parent, buf)) != extent_protocol::OK)
+    if ((r = ec_create(type, parent, NULL, ino_out)) != extent_protocol::OK)
         goto RET;
-
-    if (!addmap(buf, name, ino_out)) {
-        r = IOERR;
-        goto RET;
-    }
-
-    if ((r = ec_put(parent, buf)) != extent_protocol::OK)
+    if ((r = ec_dir_add(parent, name, ino_out)) != extent_protocol::OK)
         goto RET;
 
 RET:
+    if (r == OK)
+        set_missing(parent, name, false);
     lc->release(parent);
     return r;
 }
@@ -238,30 +210,49 @@ int yfs_client::lookup_nl(inum parent, const char* name, bool& found,
                           inum& ino_out) {
     int r = OK;
 
-    std::list<dirent> list;
-    readdir_nl(parent, list);
-
     found = false;
-    for (std::list<dirent>::iterator it = list.begin(); it != list.end();
-         ++it) {
-        if ((*it).name == name) {
-            found = true;
-            ino_out = (*it).inum;
-            break;
-        }
-    }
-
-    return r;
+    if (is_missing(parent, name))
+        return OK;
+    if (!have_data(parent))
+        r = ec->dir_lookup(parent, name, ino_out);
+    else
+        r = ec_dir_lookup(parent, name, ino_out);
+    found = r == extent_protocol::OK;
+    if (r != extent_protocol::NOENT)
+        return r;
+    set_missing(parent, name, true);
+    return OK;
 }
 
 int yfs_client::readdir_nl(inum dir, std::list<dirent>& list) {
     int r = OK;
 
-    std::string buf;
-    if ((r = ec_get(dir, buf)) != extent_protocol::OK)
-        return r;
+    std::vector<extent_protocol::dirent> ents;
+    if (have_data(dir)) {
+        rcbuf buf;
+        if ((r = ec_get(dir, buf)) != extent_protocol::OK)
+            return r;
+        unsigned int cookie = 0;
+        directory::list(buf.str(), cookie, ~0U, ents);
+    } else {
+        // page through the directory instead of fetching it whole
+        extent_protocol::dir_page page;
+        page.next = 0;
+        do {
+            page.entries.clear();
+            if ((r = ec->dir_list(dir, page.next, DIR_PAGE, page)) !=
+                extent_protocol::OK)
+                return r;
+            ents.insert(ents.end(), page.entries.begin(), page.entries.end());
+        } while (!page.eof);
+    }
 
-    buildlist(buf.c_str(), list);
+    dirent ent;
+    for (unsigned int i = 0; i < ents.size(); ++i) {
+        ent.name = ents[i].name;
+        ent.inum = ents[i].inum;
+        list.push_back(ent);
+    }
 
     return r;
 }
@@ -277,22 +268,24 @@ int yfs_client::lookup(inum parent, const char* name, bool& found,
 int yfs_client::readdir(inum dir, std::list<dirent>& list) {
     lc->acquire(dir);
     int ret = readdir_nl(dir, list);
+    if (ret == OK)
+        prefetch_attrs(list);
     lc->release(dir);
     return ret;
 }
 
-int yfs_client::read(inum ino, size_t size, off_t off, std::string& data) {
+int yfs_client::read(inum ino, size_t size, off_t off, rcbuf& data) {
     int r = OK;
     lc->acquire(ino);
 
-    std::string buf;
-    if ((r = ec_get(ino, buf)) != extent_protocol::OK)
+    extent_protocol::attr a;
+    if ((r = ec_getattr(ino, a)) != extent_protocol::OK)
         goto RET;
-    if (off >= (off_t)buf.size()) {
+    if (off >= (off_t)a.size) {
         r = IOERR;
         goto RET;
     }
-    data = buf.substr(off, size);
+    r = ec_get_range(ino, off, size, data);
 
 RET:
     lc->release(ino);
@@ -305,19 +298,8 @@ int yfs_client::write(inum ino, size_t size, off_t off, const char* data,
     lc->acquire(ino);
 
     bytes_written = size;
-    std::string buf;
-    if ((r = ec_get(ino, buf)) != extent_protocol::OK)
-        goto RET;
-
-    if (off > (off_t)buf.size()) {
-        buf.append(off - buf.size(), 0);
-        bytes_written += off - buf.size();
-    }
-    buf.replace(buf.begin() + off, buf.begin() + off + size, data, data + size);
-    if ((r = ec_put(ino, buf)) != extent_protocol::OK)
-        goto RET;
+    r = ec_put_range(ino, off, data, size);
 
-RET:
     lc->release(ino);
     return r;
 }
@@ -327,25 +309,29 @@ int yfs_client::unlink(inum parent, const char* name) {
     lc->acquire(parent);
 
     inum ino;
-    bool found = true;
-    std::string buf;
-    if ((r = lookup_nl(parent, name, found, ino)) != extent_protocol::OK)
-        goto RET;
-    if (!found) {
-        r = NOENT;
-        goto RET;
+    if (!have_data(parent)) {
+        r = ec->dir_remove(parent, name, ino);
+        if (r == extent_protocol::NOENT)
+            r = NOENT;
+        if (r != OK)
+            goto RET;
+        changed_remotely(parent);
+    } else {
+        r = ec_dir_remove(parent, name, ino);
+        if (r == extent_protocol::NOENT)
+            r = NOENT;
+        if (r != OK)
+            goto RET;
     }
+    set_missing(parent, name, true);
 
     lc->acquire(ino);
-    ec_remove(ino);
+    if (ec_remove(ino) != extent_protocol::OK) {
+        LOGW("yfs_client: unlink left %llu on the server\n", ino);
+        r = IOERR;
+    }
     lc->release(ino);
 
-    if ((r = ec_get(parent, buf)) != extent_protocol::OK)
-        goto RET;
-    deletemap(buf, name);
-    if ((r = ec_put(parent, buf)) != extent_protocol::OK)
-        goto RET;
-
 RET:
     lc->release(parent);
     return r;
@@ -368,140 +354,1227 @@ int yfs_client::symlink(inum parent, const char* link, const char* name,
 
 int yfs_client::readlink(inum ino, std::string& buf) {
     int r = OK;
+    rcbuf data;
 
-    if ((r = read(ino, 4096, 0, buf)) != OK)
+    if ((r = read(ino, 4096, 0, data)) != OK)
         return r;
+    buf.assign(data.data(), data.size());
 
     return r;
 }
 
 yfs_client::cache_entry* yfs_client::find_cache(extent_protocol::extentid_t eid,
                                                 cache_type type) {
-    for (std::vector<cache_entry>::iterator it = cache.begin();
-         it != cache.end(); ++it)
-        if (it->eid == eid && it->type == type)
-            return &(*it);
-    return NULL;
+    cache_entry* e = cache.find(eid, type);
+    if (!e || e->stale)
+        return NULL;
+    lru.splice(lru.begin(), lru, e->lru);
+    return e;
 }
 
+// only data entries go stale
+yfs_client::cache_entry* yfs_client::find_stale(
+    extent_protocol::extentid_t eid) {
+    cache_entry* e = cache.find(eid, CACHE_DATA);
+    return e && e->stale ? e : NULL;
+}
+
+// Cache e in place of any entry of its extent and type, and make room
+// for it.
+yfs_client::cache_entry* yfs_client::add_cache(const cache_entry& e) {
+    uncache(e.eid, e.type);
+    cache_entry& n = cache.insert(e.eid, e.type);
+    n = e;
+    lru.push_front(cache_key(e.eid, e.type));
+    n.lru = lru.begin();
+    n.charge = 0;
+    n.dirty = 0;
+    n.dirtied = 0;
+    n.epoch = ++epochs;
+    recharge(&n);
+    trim_cache(e.eid);
+    return &n;
+}
+
+void yfs_client::uncache(extent_protocol::extentid_t eid, cache_type type) {
+    cache_entry* e = cache.find(eid, type);
+    if (!e)
+        return;
+    usage.bytes -= e->charge;
+    usage.dirty -= e->dirty;
+    lru.erase(e->lru);
+    cache.erase(eid, type);
+}
+
+// Count what e holds now against the budget. data and base share one
+// block until data is edited.
+void yfs_client::recharge(cache_entry* e) {
+    unsigned long long charge = sizeof(cache_entry) + e->data.size() +
+                                e->pages.size() * (sizeof(page) + CACHE_PAGE);
+    if (e->base.data() != e->data.data())
+        charge += e->base.size();
+    usage.bytes += charge - e->charge;
+    e->charge = charge;
+    if (usage.bytes > usage.peak)
+        usage.peak = usage.bytes;
+
+    unsigned long long dirty = e->modified ? charge : 0;
+    usage.dirty += dirty - e->dirty;
+    e->dirty = dirty;
+    if (!e->modified)
+        e->dirtied = 0;
+    else if (!e->dirtied)
+        e->dirtied = time(NULL);
+    if (usage.dirty > DIRTY_LIMIT)
+        pthread_cond_signal(&flush_cond);
+}
+
+// Evict least recently used entries until the cache is within budget,
+// leaving keep, the extent at hand, alone. Dirty entries are not written
+// back here, which would mean an RPC and taking their locks: they are
+// left to the flusher, woken to do it, and go once clean. Until then the
+// cache stays over budget. Called with cache_mutex held.
+void yfs_client::trim_cache(extent_protocol::extentid_t keep) {
+    bool dirty = false;
+    std::list<cache_key>::iterator it = lru.end();
+    while (cache_budget && usage.bytes > cache_budget && it != lru.begin()) {
+        std::list<cache_key>::iterator victim = --it;
+        cache_key k = *victim;
+        if (k.first == keep)
+            continue;
+        if (cache.find(k.first, k.second)->modified) {
+            dirty = true;
+            continue;
+        }
+        ++it;
+        LOGD("yfs_client: evict %llu\n", k.first);
+        uncache(k.first, k.second);
+        usage.evictions++;
+    }
+    if (dirty && usage.bytes > cache_budget)
+        pthread_cond_signal(&flush_cond);
+}
+
+void yfs_client::get_cache_info(cache_info& info) {
+    ScopedLock ml(&cache_mutex);
+    info = usage;
+}
+
+// Whether eid's data is cached, revalidating a stale copy first.
+bool yfs_client::have_data(extent_protocol::extentid_t eid) {
+    ScopedLock ml(&cache_mutex);
+    apply_invalidations();
+    return cached_data(eid);
+}
+
+// have_data, called with cache_mutex held.
+bool yfs_client::cached_data(extent_protocol::extentid_t eid) {
+    if (find_cache(eid, CACHE_DATA))
+        return true;
+    if (!find_stale(eid))
+        return false;
+    extent_protocol::extent e;
+    rcbuf data;
+    return fetch(eid, ~0U, e, data) == extent_protocol::OK &&
+           find_cache(eid, CACHE_DATA);
+}
+
+// eid is about to be read from its server. Called with cache_mutex held.
+void yfs_client::begin_fetch(extent_protocol::extentid_t eid) {
+    fetching[eid]++;
+}
+
+// The read of eid begun by begin_fetch is back, and its invalidations
+// applied: whether what it got may be cached. Called with cache_mutex
+// held.
+bool yfs_client::end_fetch(extent_protocol::extentid_t eid) {
+    bool fresh = !raced.count(eid);
+    if (--fetching[eid] == 0) {
+        fetching.erase(eid);
+        raced.erase(eid);
+    }
+    return fresh;
+}
+
+// get_with_attr for a cache miss, or get_if_changed when a stale copy is
+// around: usually nothing changed and no data comes back. The reply is
+// cached unless an invalidation for eid came in while it was on its way.
+// Its data, moved out of e.data, ends up in data: the stale copy's bytes
+// if they are still good, shared rather than copied. Called with
+// cache_mutex held, which it lets go of around the RPC.
+extent_protocol::status yfs_client::fetch(extent_protocol::extentid_t eid,
+                                          unsigned int limit,
+                                          extent_protocol::extent& e,
+                                          rcbuf& data) {
+    extent_protocol::status ret;
+    cache_entry* stale = find_stale(eid);
+    bool revalidate = stale != NULL;
+    unsigned long long version = stale ? stale->version : 0;
+    rcbuf old = stale ? stale->data : rcbuf();
+
+    begin_fetch(eid);
+    pthread_mutex_unlock(&cache_mutex);
+    if (revalidate)
+        ret = ec->get_if_changed(eid, version, e);
+    else
+        ret = ec->get_with_attr(eid, limit, e);
+    pthread_mutex_lock(&cache_mutex);
+    apply_invalidations();
+    bool fresh = end_fetch(eid);
+
+    if (revalidate && ret == extent_protocol::OK && !e.has_data &&
+        e.a.version == version) {
+        e.has_data = true;
+        data = old;
+    } else {
+        data.adopt(e.data);
+    }
+    if (revalidate && find_stale(eid))
+        uncache(eid, CACHE_DATA);
+    if (ret == extent_protocol::OK && fresh)
+        fill_cache(eid, e, data);
+    return ret;
+}
+
+// With a name, the new extent is also linked into parent on the server,
+// in the same batch as the create. If the link fails the new extent is
+// removed again.
 extent_protocol::status yfs_client::ec_create(
-    uint32_t type, extent_protocol::extentid_t& eid) {
-    extent_protocol::status ret = ec->create(type, eid);
-    if (ret == extent_protocol::OK) {
-        extent_protocol::attr a;
-        cache_entry newentry;
-        a.type = type;
-        int tm = std::time(0);
-        a.mtime = tm;
-        a.ctime = tm;
-        a.atime = tm;
-        newentry.eid = eid;
-        newentry.type = CACHE_ATTR;
-        newentry.attr = a;
-        newentry.modified = false;
-        cache.push_back(newentry);
+    uint32_t type, extent_protocol::extentid_t parent, const char* name,
+    extent_protocol::extentid_t& eid) {
+    std::vector<extent_protocol::op> ops;
+    std::vector<extent_protocol::op_result> rs;
+    ops.push_back(extent_protocol::op(extent_protocol::OP_CREATE, parent));
+    ops.back().type = type;
+    if (name) {
+        ops.push_back(extent_protocol::op(extent_protocol::OP_DIR_ADD, parent));
+        ops.back().data = name;
+    }
+    ec->batch(ops, rs);
+    if (rs.size() != ops.size())
+        return extent_protocol::RPCERR;
 
-        newentry.eid = eid;
-        newentry.type = CACHE_DATA;
-        newentry.data = "";
-        newentry.modified = false;
-        cache.push_back(newentry);
+    extent_protocol::status ret = rs[0].status;
+    if (ret != extent_protocol::OK)
+        return ret;
+    eid = rs[0].eid;
+    if (name) {
+        if ((ret = rs[1].status) != extent_protocol::OK) {
+            if (ec->remove(eid) != extent_protocol::OK)
+                LOGW("yfs_client: leaked %llu after a failed create\n", eid);
+            return ret;
+        }
     }
+
+    ScopedLock ml(&cache_mutex);
+    apply_invalidations();
+    if (name)
+        uncache(parent, CACHE_ATTR);  // see changed_remotely
+    extent_protocol::attr a;
+    cache_entry newentry;
+    a.type = type;
+    a.size = 0;
+    a.version = 0;
+    int tm = std::time(0);
+    a.mtime = tm;
+    a.ctime = tm;
+    a.atime = tm;
+    newentry.eid = eid;
+    newentry.type = CACHE_ATTR;
+    newentry.attr = a;
+    newentry.modified = false;
+    add_cache(newentry);
+
+    // a new file starts out as an empty set of pages
+    newentry.eid = eid;
+    newentry.type = type == extent_protocol::T_DIR ? CACHE_DATA : CACHE_PAGES;
+    newentry.modified = false;
+    newentry.has_base = true;
+    add_cache(newentry);
     return ret;
 }
 
 extent_protocol::status yfs_client::ec_get(extent_protocol::extentid_t eid,
-                                           std::string& buf) {
+                                           rcbuf& buf) {
+    ScopedLock ml(&cache_mutex);
+    apply_invalidations();
     cache_entry* entry = find_cache(eid, CACHE_DATA);
     if (entry) {
         buf = entry->data;
         return extent_protocol::OK;
     } else {
-        extent_protocol::status ret = ec->get(eid, buf);
-        if (ret == extent_protocol::OK) {
-            cache_entry newentry;
-            newentry.eid = eid;
-            newentry.type = CACHE_DATA;
-            newentry.data = buf;
-            newentry.modified = false;
-            cache.push_back(newentry);
-        }
-        return ret;
+        extent_protocol::extent e;
+        return fetch(eid, ~0U, e, buf);
     }
 }
 
 extent_protocol::status yfs_client::ec_getattr(extent_protocol::extentid_t eid,
                                                extent_protocol::attr& a) {
+    ScopedLock ml(&cache_mutex);
+    apply_invalidations();
+    return cached_attr(eid, a);
+}
+
+// ec_getattr, called with cache_mutex held.
+extent_protocol::status yfs_client::cached_attr(extent_protocol::extentid_t eid,
+                                                extent_protocol::attr& a) {
     cache_entry* entry = find_cache(eid, CACHE_ATTR);
     if (entry) {
         a = entry->attr;
         return extent_protocol::OK;
     } else {
-        extent_protocol::status ret = ec->getattr(eid, a);
-        if (ret == extent_protocol::OK) {
-            cache_entry newentry;
-            newentry.eid = eid;
-            newentry.type = CACHE_ATTR;
-            newentry.attr = a;
-            newentry.modified = false;
-            cache.push_back(newentry);
-        }
+        // small extents are usually read right after their getattr, so
+        // bring the data along in the same round trip
+        extent_protocol::extent e;
+        rcbuf data;
+        extent_protocol::status ret = fetch(eid, PREFETCH_SIZE, e, data);
+        if (ret == extent_protocol::OK)
+            a = e.a;
         return ret;
     }
 }
 
+// Cache whatever part of a get_with_attr reply is not cached yet, the
+// data being in data rather than e.data.
+void yfs_client::fill_cache(extent_protocol::extentid_t eid,
+                            const extent_protocol::extent& e,
+                            const rcbuf& data) {
+    cache_entry newentry;
+    newentry.eid = eid;
+    newentry.modified = false;
+    if (!find_cache(eid, CACHE_ATTR)) {
+        newentry.type = CACHE_ATTR;
+        newentry.attr = e.a;
+        local_size(eid, newentry.attr);
+        add_cache(newentry);
+    }
+    if (e.has_data && !find_cache(eid, CACHE_DATA) &&
+        !cache.find(eid, CACHE_PAGES)) {
+        newentry.type = CACHE_DATA;
+        newentry.data = data;
+        newentry.version = e.a.version;
+        newentry.base = data;
+        newentry.has_base = true;
+        add_cache(newentry);
+    }
+}
+
+// Fetch the attributes of directory entries in one round trip, since
+// listing a directory is usually followed by a getattr of each entry.
+void yfs_client::prefetch_attrs(const std::list<dirent>& list) {
+    ScopedLock ml(&cache_mutex);
+    apply_invalidations();
+    std::vector<extent_protocol::extentid_t> eids;
+    for (std::list<dirent>::const_iterator it = list.begin();
+         it != list.end() && eids.size() < ATTR_BATCH; ++it)
+        if (!find_cache(it->inum, CACHE_ATTR))
+            eids.push_back(it->inum);
+    if (eids.empty())
+        return;
+
+    std::vector<extent_protocol::attr> as;
+    for (unsigned int i = 0; i < eids.size(); ++i)
+        begin_fetch(eids[i]);
+    pthread_mutex_unlock(&cache_mutex);
+    extent_protocol::status ret = ec->getattr_many(eids, as);
+    pthread_mutex_lock(&cache_mutex);
+    apply_invalidations();
+    std::vector<bool> fresh(eids.size());
+    for (unsigned int i = 0; i < eids.size(); ++i)
+        fresh[i] = end_fetch(eids[i]);
+    if (ret != extent_protocol::OK || as.size() != eids.size())
+        return;
+    cache_entry newentry;
+    newentry.type = CACHE_ATTR;
+    newentry.modified = false;
+    for (unsigned int i = 0; i < eids.size(); ++i)
+        if (as[i].type != 0 && fresh[i] && !find_cache(eids[i], CACHE_ATTR)) {
+            newentry.eid = eids[i];
+            newentry.attr = as[i];
+            local_size(eids[i], newentry.attr);
+            add_cache(newentry);
+        }
+}
+
 extent_protocol::status yfs_client::ec_put(extent_protocol::extentid_t eid,
-                                           std::string buf) {
+                                           std::string& buf) {
+    ScopedLock ml(&cache_mutex);
+    apply_invalidations();
+    uncache(eid, CACHE_PAGES);  // all of it is replaced
+    unsigned int size = buf.size();
     cache_entry* entry = find_cache(eid, CACHE_DATA);
     if (entry) {
-        entry->data = buf;
+        entry->data.adopt(buf);
         entry->modified = true;
+        recharge(entry);
+        trim_cache(eid);
     } else {
+        // a stale copy is replaced outright
         cache_entry newentry;
         newentry.eid = eid;
         newentry.type = CACHE_DATA;
-        newentry.data = buf;
+        newentry.data.adopt(buf);
         newentry.modified = true;
-        cache.push_back(newentry);
+        add_cache(newentry);
+    }
+    resized(eid, size);
+    return extent_protocol::OK;
+}
+
+// The cached copy of directory eid, fetched whole if need be, again if
+// an invalidation kept the fetch out of the cache. Called with
+// cache_mutex held.
+extent_protocol::status yfs_client::dir_data(extent_protocol::extentid_t eid,
+                                             cache_entry*& e) {
+    extent_protocol::status ret;
+    while (!(e = find_cache(eid, CACHE_DATA))) {
+        extent_protocol::extent ext;
+        rcbuf data;
+        if ((ret = fetch(eid, ~0U, ext, data)) != extent_protocol::OK)
+            return ret;
+    }
+    return extent_protocol::OK;
+}
+
+extent_protocol::status yfs_client::ec_dir_lookup(
+    extent_protocol::extentid_t eid, const char* name,
+    extent_protocol::extentid_t& inum) {
+    ScopedLock ml(&cache_mutex);
+    apply_invalidations();
+    cache_entry* entry;
+    extent_protocol::status ret;
+    if ((ret = dir_data(eid, entry)) != extent_protocol::OK)
+        return ret;
+    return directory::lookup(entry->data.str(), name, inum)
+               ? extent_protocol::OK
+               : extent_protocol::NOENT;
+}
+
+// Adding a name that is there already is left to the caller to rule out.
+extent_protocol::status yfs_client::ec_dir_add(
+    extent_protocol::extentid_t eid, const char* name,
+    extent_protocol::extentid_t inum) {
+    ScopedLock ml(&cache_mutex);
+    apply_invalidations();
+    cache_entry* entry;
+    extent_protocol::status ret;
+    if ((ret = dir_data(eid, entry)) != extent_protocol::OK)
+        return ret;
+    if (!directory::add(entry->data.edit(), name, inum))
+        return extent_protocol::IOERR;
+    entry->modified = true;
+    resized(eid, entry->data.size());
+    recharge(entry);
+    trim_cache(eid);
+    return extent_protocol::OK;
+}
+
+extent_protocol::status yfs_client::ec_dir_remove(
+    extent_protocol::extentid_t eid, const char* name,
+    extent_protocol::extentid_t& inum) {
+    ScopedLock ml(&cache_mutex);
+    apply_invalidations();
+    cache_entry* entry;
+    extent_protocol::status ret;
+    if ((ret = dir_data(eid, entry)) != extent_protocol::OK)
+        return ret;
+    if (!directory::remove(entry->data.edit(), name, inum))
+        return extent_protocol::NOENT;
+    entry->modified = true;
+    resized(eid, entry->data.size());
+    recharge(entry);
+    trim_cache(eid);
+    return extent_protocol::OK;
+}
+
+bool yfs_client::is_missing(extent_protocol::extentid_t dir,
+                            const char* name) {
+    ScopedLock ml(&cache_mutex);
+    std::map<extent_protocol::extentid_t, std::set<std::string> >::iterator
+        it = missing.find(dir);
+    if (it == missing.end() || !it->second.count(name))
+        return false;
+    usage.missing_hits++;
+    return true;
+}
+
+// Note name as missing from dir, or as there after all.
+void yfs_client::set_missing(extent_protocol::extentid_t dir,
+                             const char* name, bool gone) {
+    ScopedLock ml(&cache_mutex);
+    if (!gone) {
+        std::map<extent_protocol::extentid_t, std::set<std::string> >::iterator
+            it = missing.find(dir);
+        if (it != missing.end() && it->second.erase(name)) {
+            missing_count--;
+            if (it->second.empty())
+                missing.erase(it);
+        }
+        return;
+    }
+    while (missing_count >= MISSING_MAX)
+        forget_missing(missing.begin()->first);
+    if (missing[dir].insert(name).second)
+        missing_count++;
+}
+
+// Drop the names noted missing from dir. Called with cache_mutex held.
+void yfs_client::forget_missing(extent_protocol::extentid_t dir) {
+    std::map<extent_protocol::extentid_t, std::set<std::string> >::iterator
+        it = missing.find(dir);
+    if (it == missing.end())
+        return;
+    if (missing_hook)
+        for (std::set<std::string>::iterator n = it->second.begin();
+             n != it->second.end(); ++n)
+            missing_hook(dir, *n);
+    missing_count -= it->second.size();
+    missing.erase(it);
+}
+
+void yfs_client::set_missing_hook(void (*hook)(extent_protocol::extentid_t,
+                                               const std::string&)) {
+    ScopedLock ml(&cache_mutex);
+    missing_hook = hook;
+}
+
+// The remove goes to the server right away, under eid's lock, so an
+// unlinked extent neither outlives a crash here nor stays readable to
+// other clients.
+extent_protocol::status yfs_client::ec_remove(extent_protocol::extentid_t eid) {
+    pthread_mutex_lock(&cache_mutex);
+    apply_invalidations();
+    drop_cache(eid);
+    pthread_mutex_unlock(&cache_mutex);
+    return ec->remove(eid);
+}
+
+// What is read is a view of the cached bytes: of the extent cached whole,
+// or of the page it lies in. Only a read across pages gathers them into
+// a buffer of its own.
+extent_protocol::status yfs_client::ec_get_range(
+    extent_protocol::extentid_t eid, unsigned int off, unsigned int len,
+    rcbuf& buf) {
+    ScopedLock ml(&cache_mutex);
+    apply_invalidations();
+    cache_entry* entry;
+    extent_protocol::status ret;
+    unsigned int end;
+    // pages on their way from the read-ahead are waited for, not read
+    // again; the entry may be gone after the wait, or after a load
+    while (true) {
+        buf = rcbuf();
+        if ((ret = file_pages(eid, entry)) != extent_protocol::OK)
+            return ret;
+        if (!entry) {
+            entry = find_cache(eid, CACHE_DATA);
+            buf = entry->data.slice(off, len);
+            return extent_protocol::OK;
+        }
+        if (off >= entry->size || len == 0)
+            return extent_protocol::OK;
+        end = len < entry->size - off ? off + len : entry->size;
+        if (reading_ahead(entry, off / CACHE_PAGE, (end - 1) / CACHE_PAGE)) {
+            pthread_cond_wait(&ra_cond, &cache_mutex);
+            continue;
+        }
+        plan_read_ahead(entry, off, end);
+        if ((ret = load_pages(entry, off / CACHE_PAGE,
+                              (end - 1) / CACHE_PAGE)) != extent_protocol::OK)
+            return ret;
+        if (entry)
+            break;
+    }
+    std::map<unsigned int, page>::iterator it =
+        entry->pages.find(off / CACHE_PAGE);
+    if (off / CACHE_PAGE == (end - 1) / CACHE_PAGE && it != entry->pages.end()) {
+        buf = it->second.data.slice(off % CACHE_PAGE, end - off);
+        return extent_protocol::OK;
+    }
+    std::string out;
+    out.reserve(end - off);
+    while (off < end) {
+        unsigned int in = off % CACHE_PAGE;
+        unsigned int n = end - off < CACHE_PAGE - in ? end - off : CACHE_PAGE - in;
+        it = entry->pages.find(off / CACHE_PAGE);
+        if (it == entry->pages.end())
+            out.append(n, '\0');  // a hole
+        else
+            out.append(it->second.data.data() + in, n);
+        off += n;
+    }
+    buf.adopt(out);
+    return extent_protocol::OK;
+}
+
+// Writes go into the cached copy, to be flushed on revoke: in place for
+// an extent cached whole, into the pages it covers for a file. A page
+// written only in part is read first.
+extent_protocol::status yfs_client::ec_put_range(
+    extent_protocol::extentid_t eid, unsigned int off, const char* buf,
+    size_t len) {
+    ScopedLock ml(&cache_mutex);
+    apply_invalidations();
+    cache_entry* entry;
+    extent_protocol::status ret;
+    unsigned int end = off + len;
+    unsigned int first = off / CACHE_PAGE, last = (end - 1) / CACHE_PAGE;
+    // the entry may be gone after a load: start over
+    do {
+        if ((ret = file_pages(eid, entry)) != extent_protocol::OK)
+            return ret;
+        if (!entry) {
+            entry = find_cache(eid, CACHE_DATA);
+            std::string& data = entry->data.edit();
+            if (off + len > data.size())
+                data.resize(off + len);
+            data.replace(off, len, buf, len);
+            entry->modified = true;
+            recharge(entry);
+            resized(eid, entry->data.size());
+            trim_cache(eid);
+            return extent_protocol::OK;
+        }
+        if (len == 0)
+            return extent_protocol::OK;
+        if ((off % CACHE_PAGE &&
+             (ret = load_pages(entry, first, first)) != extent_protocol::OK) ||
+            (entry && end % CACHE_PAGE &&
+             (ret = load_pages(entry, last, last)) != extent_protocol::OK))
+            return ret;
+    } while (!entry);
+    for (unsigned int o = off; o < end;) {
+        unsigned int in = o % CACHE_PAGE;
+        unsigned int n = end - o < CACHE_PAGE - in ? end - o : CACHE_PAGE - in;
+        page& pg = entry->pages[o / CACHE_PAGE];
+        std::string& data = pg.data.edit();
+        if (data.empty())
+            data.assign(CACHE_PAGE, '\0');
+        data.replace(in, n, buf + (o - off), n);
+        pg.dirty = true;
+        o += n;
+    }
+    if (end > entry->size)
+        entry->size = end;
+    entry->modified = true;
+    recharge(entry);
+    resized(eid, entry->size);
+    trim_cache(eid);
+    return extent_protocol::OK;
+}
+
+extent_protocol::status yfs_client::ec_truncate(
+    extent_protocol::extentid_t eid, unsigned int size) {
+    ScopedLock ml(&cache_mutex);
+    apply_invalidations();
+    cache_entry* entry;
+    extent_protocol::status ret;
+    if ((ret = file_pages(eid, entry)) != extent_protocol::OK)
+        return ret;
+    if (!entry) {
+        entry = find_cache(eid, CACHE_DATA);
+        entry->data.edit().resize(size);
+        entry->modified = true;
+        recharge(entry);
+        resized(eid, size);
+        return extent_protocol::OK;
+    }
+
+    if (size < entry->size) {
+        // pages past the end go, and the last one is zeroed past it
+        entry->pages.erase(
+            entry->pages.lower_bound((size + CACHE_PAGE - 1) / CACHE_PAGE),
+            entry->pages.end());
+        std::map<unsigned int, page>::iterator it =
+            entry->pages.find(size / CACHE_PAGE);
+        if (size % CACHE_PAGE && it != entry->pages.end())
+            it->second.data.edit().replace(size % CACHE_PAGE,
+                                           CACHE_PAGE - size % CACHE_PAGE,
+                                           CACHE_PAGE - size % CACHE_PAGE,
+                                           '\0');
+        if (size < entry->low)
+            entry->low = size;
+    }
+    entry->size = size;
+    entry->modified = true;
+    recharge(entry);
+    resized(eid, size);
+    return extent_protocol::OK;
+}
+
+// eid's pages entry in e, made on first use; NULL if eid is cached whole
+// instead. Called with cache_mutex held.
+extent_protocol::status yfs_client::file_pages(extent_protocol::extentid_t eid,
+                                               cache_entry*& e) {
+    extent_protocol::status ret;
+    extent_protocol::attr a;
+    if ((e = find_cache(eid, CACHE_PAGES)) || cached_data(eid))
+        return extent_protocol::OK;
+    // the getattr brings all of a small extent along
+    if ((ret = cached_attr(eid, a)) != extent_protocol::OK || cached_data(eid))
+        return ret;
+    cache_entry newentry;
+    newentry.eid = eid;
+    newentry.type = CACHE_PAGES;
+    newentry.size = newentry.low = newentry.synced = a.size;
+    e = add_cache(newentry);
+    return extent_protocol::OK;
+}
+
+// Read the pages first..last of e that are neither cached nor holes,
+// a run of them per get_range. Called with cache_mutex held, which it
+// lets go of around each read. e is NULL after if the entry went
+// meanwhile, or an invalidation kept a read out of it.
+extent_protocol::status yfs_client::load_pages(cache_entry*& e,
+                                               unsigned int first,
+                                               unsigned int last) {
+    const unsigned int run = extent_protocol::CHUNK_SIZE / CACHE_PAGE;
+    extent_protocol::extentid_t eid = e->eid;
+    unsigned long long epoch = e->epoch;
+    for (unsigned int p = first; p <= last;) {
+        unsigned int n = 0;
+        while (p + n <= last && n < run &&
+               (unsigned long long)(p + n) * CACHE_PAGE < e->low &&
+               !e->pages.count(p + n))
+            n++;
+        if (n == 0) {
+            p++;
+            continue;
+        }
+        std::string buf;
+        begin_fetch(eid);
+        pthread_mutex_unlock(&cache_mutex);
+        extent_protocol::status ret =
+            ec->get_range(eid, p * CACHE_PAGE, n * CACHE_PAGE, buf);
+        pthread_mutex_lock(&cache_mutex);
+        apply_invalidations();
+        bool fresh = end_fetch(eid);
+        if (ret != extent_protocol::OK)
+            return ret;
+        e = cache.find(eid, CACHE_PAGES);
+        if (!e || e->epoch != epoch || !fresh) {
+            e = NULL;
+            return extent_protocol::OK;
+        }
+        install_pages(e, p, n, buf);
+        p += n;
     }
-    entry = find_cache(eid, CACHE_ATTR);
+    return extent_protocol::OK;
+}
+
+// Cache the n pages from first read into buf, but for any cached since
+// and any past low. buf is taken over, and its whole pages become views
+// of it; only a short page, padded with zeros, is copied.
+void yfs_client::install_pages(cache_entry* e, unsigned int first,
+                               unsigned int n, std::string& buf) {
+    rcbuf all;
+    all.adopt(buf);
+    for (unsigned int i = 0; i < n; i++) {
+        unsigned int off = (first + i) * CACHE_PAGE;
+        if (off >= e->low || e->pages.count(first + i))
+            continue;
+        // bytes past low are zero, whatever the server still has
+        unsigned int valid =
+            e->low - off < CACHE_PAGE ? e->low - off : CACHE_PAGE;
+        page& pg = e->pages[first + i];
+        pg.data = all.slice(i * CACHE_PAGE, valid);
+        if (pg.data.size() < CACHE_PAGE)
+            pg.data.edit().resize(CACHE_PAGE);
+    }
+    recharge(e);
+    trim_cache(e->eid);
+}
+
+// Keep the read-ahead of e in step with a read of off..end. A read that
+// starts where the last one ended is sequential: once less than half a
+// window is left read ahead of it, the window doubles and the next one
+// is queued. Any other read drops the window.
+void yfs_client::plan_read_ahead(cache_entry* e, unsigned int off,
+                                 unsigned int end) {
+    bool sequential = off == e->ra_next;
+    e->ra_next = end;
+    if (!sequential) {
+        e->ra_window = 0;
+        return;
+    }
+    unsigned int ahead = e->ra_hi > end ? e->ra_hi - end : 0;
+    if (end >= e->size || (e->ra_window && ahead > e->ra_window / 2))
+        return;
+    e->ra_window = e->ra_window == 0          ? RA_MIN
+                   : e->ra_window < RA_MAX / 2 ? e->ra_window * 2
+                                               : RA_MAX;
+    unsigned int from = e->ra_hi > end ? e->ra_hi : end;
+    unsigned int to =
+        e->size - end < e->ra_window ? e->size : end + e->ra_window;
+    if (from >= to)
+        return;
+    if (e->ra_lo >= e->ra_hi) {
+        e->ra_lo = from;
+        ra_queue.push_back(std::make_pair(e->eid, e->epoch));
+        pthread_cond_broadcast(&ra_cond);
+    }
+    e->ra_hi = to;
+}
+
+// Whether any of the pages first..last of e is missing but on its way.
+bool yfs_client::reading_ahead(const cache_entry* e, unsigned int first,
+                               unsigned int last) {
+    if (e->ra_lo >= e->ra_hi)
+        return false;
+    for (unsigned int p = first; p <= last; p++) {
+        unsigned long long off = (unsigned long long)p * CACHE_PAGE;
+        if (off + CACHE_PAGE > e->ra_lo && off < e->ra_hi && off < e->low &&
+            !e->pages.count(p))
+            return true;
+    }
+    return false;
+}
+
+// Reads ahead for the queued entries, CHUNK_SIZE at a time, letting go
+// of cache_mutex around each read. What comes back is cached only if the
+// entry it was read for is still there and no invalidation came in
+// meanwhile: the pages may be from before the change.
+void* yfs_client::read_ahead(void* arg) {
+    yfs_client* yfs = (yfs_client*)arg;
+    pthread_mutex_lock(&yfs->cache_mutex);
+    while (true) {
+        while (yfs->ra_queue.empty())
+            pthread_cond_wait(&yfs->ra_cond, &yfs->cache_mutex);
+        extent_protocol::extentid_t eid = yfs->ra_queue.front().first;
+        unsigned long long epoch = yfs->ra_queue.front().second;
+        yfs->ra_queue.pop_front();
+
+        cache_entry* e;
+        while ((e = yfs->cache.find(eid, CACHE_PAGES)) && e->epoch == epoch &&
+               e->ra_lo < e->ra_hi) {
+            unsigned int first = e->ra_lo / CACHE_PAGE;
+            unsigned int stop =
+                e->ra_hi - e->ra_lo < extent_protocol::CHUNK_SIZE
+                    ? e->ra_hi
+                    : e->ra_lo + extent_protocol::CHUNK_SIZE;
+            unsigned int n = (stop - 1) / CACHE_PAGE - first + 1;
+            std::string buf;
+            yfs->begin_fetch(eid);
+            pthread_mutex_unlock(&yfs->cache_mutex);
+            extent_protocol::status ret = yfs->ec->get_range(
+                eid, first * CACHE_PAGE, n * CACHE_PAGE, buf);
+            pthread_mutex_lock(&yfs->cache_mutex);
+            yfs->apply_invalidations();
+            bool fresh = yfs->end_fetch(eid);
+            if (!(e = yfs->cache.find(eid, CACHE_PAGES)) || e->epoch != epoch)
+                break;
+            if (ret != extent_protocol::OK || !fresh) {
+                e->ra_lo = e->ra_hi;
+                break;
+            }
+            yfs->usage.read_ahead += buf.size();
+            yfs->install_pages(e, first, n, buf);
+            e->ra_lo = (first + n) * CACHE_PAGE < e->ra_hi
+                           ? (first + n) * CACHE_PAGE
+                           : e->ra_hi;
+            pthread_cond_broadcast(&yfs->ra_cond);
+        }
+        pthread_cond_broadcast(&yfs->ra_cond);
+    }
+    return NULL;
+}
+
+// A fresh copy of eid's attributes, corrected for writes not flushed.
+void yfs_client::local_size(extent_protocol::extentid_t eid,
+                            extent_protocol::attr& a) {
+    cache_entry* e = cache.find(eid, CACHE_PAGES);
+    if (e && e->modified)
+        a.size = e->size;
+    e = cache.find(eid, CACHE_DATA);
+    if (e && e->modified)
+        a.size = e->data.size();
+}
+
+// eid was just written and is now size bytes long.
+void yfs_client::resized(extent_protocol::extentid_t eid, unsigned int size) {
+    cache_entry* entry = find_cache(eid, CACHE_ATTR);
     if (entry) {
-        entry->attr.size = buf.size();
+        entry->attr.size = size;
         int tm = std::time(0);
         entry->attr.mtime = tm;
         entry->attr.ctime = tm;
     }
-    return extent_protocol::OK;
 }
 
-extent_protocol::status yfs_client::ec_remove(extent_protocol::extentid_t eid) {
-    clear_cache(eid);
-    deleted.push_back(eid);
-    return ec->remove(eid);
+// eid was changed on the server behind the cache: forget its attributes.
+// The server calls back the other clients itself.
+void yfs_client::changed_remotely(extent_protocol::extentid_t eid) {
+    ScopedLock ml(&cache_mutex);
+    uncache(eid, CACHE_ATTR);
 }
 
+// Another client changed eid. Its attributes and pages are dropped; its
+// data is kept as a stale copy to revalidate on next use. Writes not yet
+// flushed are ours under the lock, so they are left alone. Called with
+// cache_mutex held.
 void yfs_client::clear_cache(extent_protocol::extentid_t eid) {
-    std::vector<cache_entry>::iterator it = cache.begin();
-    while (it != cache.end())
-        if (it->eid == eid)
-            it = cache.erase(it);
-        else
-            ++it;
+    uncache(eid, CACHE_ATTR);
+    cache_entry* pages = cache.find(eid, CACHE_PAGES);
+    if (pages && !pages->modified)
+        uncache(eid, CACHE_PAGES);
+    cache_entry* e = cache.find(eid, CACHE_DATA);
+    if (e && !e->modified)
+        e->stale = true;
 }
 
-std::vector<extent_protocol::extentid_t> yfs_client::flush_cache(
-    extent_protocol::extentid_t eid) {
-    std::vector<extent_protocol::extentid_t> ret = deleted;
-    std::vector<cache_entry>::iterator it = cache.begin();
-    while (it != cache.end()) {
-        if (it->eid == eid && it->type == CACHE_DATA && it->modified) {
-            ec->put(eid, it->data);
-            ret.push_back(eid);
-            it = cache.erase(it);
+void yfs_client::drop_cache(extent_protocol::extentid_t eid) {
+    uncache(eid, CACHE_ATTR);
+    uncache(eid, CACHE_DATA);
+    uncache(eid, CACHE_PAGES);
+}
+
+// Turn the edits to a cached extent into put_range ops for the blocks
+// that differ from base, plus a truncate if it shrank. False when base
+// is unknown or so much changed that the whole extent should go instead.
+bool yfs_client::diff_ops(const cache_entry& e,
+                          std::vector<extent_protocol::op>& ops) {
+    if (!e.has_base)
+        return false;
+    const std::string& data = e.data.str();
+    const std::string& base = e.base.str();
+    std::vector<extent_protocol::op> diff;
+    unsigned int total = 0;
+    for (unsigned int off = 0; off < data.size(); off += DIFF_BLOCK) {
+        unsigned int len = data.size() - off < DIFF_BLOCK ? data.size() - off
+                                                          : DIFF_BLOCK;
+        if (off + len <= base.size() &&
+            memcmp(data.data() + off, base.data() + off, len) == 0)
+            continue;
+        total += len;
+        if (total > data.size() / 2 || total > extent_protocol::CHUNK_SIZE)
+            return false;
+        // adjacent changed blocks go out as one range
+        if (!diff.empty() &&
+            diff.back().off + diff.back().data.size() == off) {
+            diff.back().data.append(data, off, len);
         } else {
-            ++it;
+            diff.push_back(
+                extent_protocol::op(extent_protocol::OP_PUT_RANGE, e.eid));
+            diff.back().off = off;
+            diff.back().data = data.substr(off, len);
         }
     }
-    deleted.clear();
-    return ret;
+    if (data.size() < base.size()) {
+        diff.push_back(extent_protocol::op(extent_protocol::OP_TRUNCATE, e.eid));
+        diff.back().off = data.size();
+    }
+    ops.insert(ops.end(), diff.begin(), diff.end());
+    return true;
+}
+
+// The edits to a cached extent as a delta against base, for edits that
+// shift data, such as an insert, and so change every block after them.
+// False when base is unknown or the delta would carry more than half the
+// extent, or more than a chunk.
+bool yfs_client::delta_ops(const cache_entry& e,
+                           std::vector<extent_protocol::delta_op>& ops) {
+    if (!e.has_base || e.base.empty())
+        return false;
+    unsigned int literal =
+        delta::encode(e.base.str(), e.data.str(), DIFF_BLOCK, ops);
+    return literal <= e.data.size() / 2 &&
+           literal <= extent_protocol::CHUNK_SIZE;
+}
+
+// eid's lock is going back to the lock server: write back what is dirty,
+// and forget the names only the lock kept missing.
+void yfs_client::released(extent_protocol::extentid_t eid) {
+    pthread_mutex_lock(&cache_mutex);
+    forget_missing(eid);
+    pthread_mutex_unlock(&cache_mutex);
+    flush_cache(eid);
+}
+
+// Write eid back before its lock goes to another client: the blocks that
+// changed, in one batch. Failing that the extent goes by put_delta, or
+// whole: in the batch, or streamed by put if it is big. A put_delta
+// against a version the server no longer has falls back to put.
+// The caller holds eid's lock, so nothing edits or evicts the entry while
+// cache_mutex is let go for the RPCs.
+void yfs_client::flush_cache(extent_protocol::extentid_t eid) {
+    pthread_mutex_lock(&cache_mutex);
+    apply_invalidations();
+    cache_entry* pages = find_cache(eid, CACHE_PAGES);
+    if (pages && pages->modified) {
+        flush_pages(pages);
+        pthread_mutex_unlock(&cache_mutex);
+        return;
+    }
+
+    std::vector<extent_protocol::op> ops;
+    cache_entry* entry = find_cache(eid, CACHE_DATA);
+    bool dirty = entry && entry->modified;
+    bool stream = false;
+    std::vector<extent_protocol::delta_op> delta;
+    bool use_delta = false;
+    if (dirty && !diff_ops(*entry, ops)) {
+        use_delta = delta_ops(*entry, delta);
+        stream = !use_delta && entry->data.size() > extent_protocol::CHUNK_SIZE;
+        if (!use_delta && !stream) {
+            ops.push_back(extent_protocol::op(extent_protocol::OP_PUT, eid));
+            ops.back().data = entry->data.str();
+        }
+    }
+
+    pthread_mutex_unlock(&cache_mutex);
+
+    std::vector<extent_protocol::op_result> rs;
+    if (!ops.empty())
+        ec->batch(ops, rs);
+    if (!dirty)
+        return;
+
+    extent_protocol::status ret = extent_protocol::OK;
+    extent_protocol::attr a;
+    a.version = entry->version;  // if nothing had to be sent
+    if (use_delta) {
+        ret = ec->put_delta(eid, entry->version, delta, a);
+        // the server has moved on from base: send it all
+        stream = ret == extent_protocol::STALE;
+    }
+    if (stream) {
+        if ((ret = ec->put(eid, entry->data.str())) == extent_protocol::OK)
+            ret = ec->getattr(eid, a);
+    } else if (use_delta) {
+        // ret and a came from put_delta
+    } else if (rs.size() != ops.size()) {
+        ret = extent_protocol::RPCERR;
+    } else {
+        for (unsigned int i = 0; i < ops.size(); i++)
+            if (rs[i].status != extent_protocol::OK)
+                ret = rs[i].status;
+        if (!ops.empty())
+            a = rs.back().a;
+    }
+    pthread_mutex_lock(&cache_mutex);
+    // the server keeps the writer as a reader, so what was written stays
+    // cached until someone else changes it
+    if (ret == extent_protocol::OK) {
+        entry->modified = false;
+        entry->version = a.version;
+        entry->base = entry->data;
+        entry->has_base = true;
+        recharge(entry);
+    } else {
+        drop_cache(eid);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+// The ops that bring the server's copy of a file in line with e: cut it
+// to low if it was cut, put the dirty pages, a run per op, and set the
+// size if the puts did not.
+void yfs_client::page_ops(const cache_entry& e,
+                          std::vector<extent_protocol::op>& ops) {
+    unsigned int size = e.synced;
+    if (e.low < e.synced) {
+        ops.push_back(extent_protocol::op(extent_protocol::OP_TRUNCATE, e.eid));
+        ops.back().off = size = e.low;
+    }
+    for (std::map<unsigned int, page>::const_iterator it = e.pages.begin();
+         it != e.pages.end(); ++it) {
+        unsigned int off = it->first * CACHE_PAGE;
+        if (!it->second.dirty)
+            continue;
+        if (off >= e.size)
+            break;
+        unsigned int len = e.size - off < CACHE_PAGE ? e.size - off : CACHE_PAGE;
+        extent_protocol::op* last = ops.empty() ? NULL : &ops.back();
+        if (last && last->kind == extent_protocol::OP_PUT_RANGE &&
+            last->eid == e.eid && last->off + last->data.size() == off &&
+            last->data.size() + len <= extent_protocol::CHUNK_SIZE) {
+            last->data.append(it->second.data.data(), len);
+        } else {
+            ops.push_back(
+                extent_protocol::op(extent_protocol::OP_PUT_RANGE, e.eid));
+            ops.back().off = off;
+            ops.back().data.assign(it->second.data.data(), len);
+        }
+        if (off + len > size)
+            size = off + len;
+    }
+    if (size != e.size) {
+        ops.push_back(extent_protocol::op(extent_protocol::OP_TRUNCATE, e.eid));
+        ops.back().off = e.size;
+    }
+}
+
+// Write back a file's pages, in batches of up to CHUNK_SIZE bytes.
+// Called with cache_mutex held, which it lets go of around each batch.
+void yfs_client::flush_pages(cache_entry* e) {
+    std::vector<extent_protocol::op> ops;
+    page_ops(*e, ops);
+
+    extent_protocol::status ret = extent_protocol::OK;
+    for (unsigned int i = 0; i < ops.size() && ret == extent_protocol::OK;) {
+        std::vector<extent_protocol::op> part;
+        std::vector<extent_protocol::op_result> rs;
+        unsigned int bytes = 0;
+        do {
+            bytes += ops[i].data.size();
+            part.push_back(ops[i++]);
+        } while (i < ops.size() &&
+                 bytes + ops[i].data.size() <= extent_protocol::CHUNK_SIZE);
+        pthread_mutex_unlock(&cache_mutex);
+        ec->batch(part, rs);
+        pthread_mutex_lock(&cache_mutex);
+        if (rs.size() != part.size()) {
+            ret = extent_protocol::RPCERR;
+            break;
+        }
+        for (unsigned int j = 0; j < rs.size(); j++)
+            if (rs[j].status != extent_protocol::OK)
+                ret = rs[j].status;
+    }
+
+    if (ret != extent_protocol::OK) {
+        drop_cache(e->eid);
+        return;
+    }
+    for (std::map<unsigned int, page>::iterator it = e->pages.begin();
+         it != e->pages.end(); ++it)
+        it->second.dirty = false;
+    e->synced = e->low = e->size;
+    e->modified = false;
+    recharge(e);
+}
+
+// Pick the dirty extents due for write-back, least recently used first,
+// and take their locks. Only locks cached here and free are taken, so
+// no one is editing what the flusher writes back. Past DIRTY_LIMIT, or
+// with the cache over budget, when trim_cache waits on it to evict, any
+// dirty extent is due.
+void yfs_client::pick_dirty(std::vector<extent_protocol::extentid_t>& eids) {
+    time_t now = time(NULL);
+    bool over = usage.dirty > DIRTY_LIMIT ||
+                (cache_budget && usage.bytes > cache_budget);
+    for (std::list<cache_key>::reverse_iterator it = lru.rbegin();
+         it != lru.rend() && eids.size() < FLUSH_BATCH; ++it) {
+        cache_entry* e = cache.find(it->first, it->second);
+        if (!e->modified || (!over && now - e->dirtied < DIRTY_AGE))
+            continue;
+        if (lc->try_acquire(it->first))
+            eids.push_back(it->first);
+    }
+}
+
+// One round of write-back. Workers claim extents in order and release
+// each one's lock once it is flushed.
+struct yfs_client::write_back_job {
+    yfs_client* yfs;
+    const std::vector<extent_protocol::extentid_t>* eids;
+    unsigned int next;
+    pthread_mutex_t mutex;
+};
+
+void* yfs_client::write_back_worker(void* arg) {
+    write_back_job* job = (write_back_job*)arg;
+    while (true) {
+        pthread_mutex_lock(&job->mutex);
+        unsigned int i = job->next++;
+        pthread_mutex_unlock(&job->mutex);
+        if (i >= job->eids->size())
+            break;
+        job->yfs->flush_cache((*job->eids)[i]);
+        job->yfs->lc->release((*job->eids)[i]);
+    }
+    return NULL;
+}
+
+// Flush eids, whose locks the caller took, up to FLUSH_WINDOW at a time.
+// The caller's thread is one of the workers.
+void yfs_client::write_back(
+    const std::vector<extent_protocol::extentid_t>& eids) {
+    write_back_job job;
+    job.yfs = this;
+    job.eids = &eids;
+    job.next = 0;
+    pthread_mutex_init(&job.mutex, NULL);
+
+    pthread_t th[FLUSH_WINDOW];
+    unsigned int n = 0;
+    while (n + 1 < FLUSH_WINDOW && n + 1 < eids.size() &&
+           pthread_create(&th[n], NULL, write_back_worker, &job) == 0)
+        n++;
+    write_back_worker(&job);
+    for (unsigned int i = 0; i < n; i++)
+        pthread_join(th[i], NULL);
+    pthread_mutex_destroy(&job.mutex);
+
+    ScopedLock ml(&cache_mutex);
+    usage.flushed += eids.size();
+    // what was flushed to make room can go now
+    trim_cache(0);
+}
+
+// Background write-back, so that revokes mostly find clean extents and
+// less is lost in a crash. Wakes early when too much is dirty.
+void* yfs_client::flusher(void* arg) {
+    yfs_client* yfs = (yfs_client*)arg;
+    bool again = false;
+    while (true) {
+        std::vector<extent_protocol::extentid_t> eids;
+        pthread_mutex_lock(&yfs->cache_mutex);
+        if (!again) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += FLUSH_INTERVAL;
+            pthread_cond_timedwait(&yfs->flush_cond, &yfs->cache_mutex, &until);
+        }
+        yfs->apply_invalidations();
+        yfs->pick_dirty(eids);
+        bool full = yfs->cache_budget && yfs->usage.bytes > yfs->cache_budget;
+        if (full)
+            yfs->usage.writebacks += eids.size();
+        again = !eids.empty() && (full || yfs->usage.dirty > DIRTY_LIMIT);
+        pthread_mutex_unlock(&yfs->cache_mutex);
+        if (!eids.empty())
+            yfs->write_back(eids);
+    }
+    return NULL;
+}
+
+// Clear what the servers called back about since the cache was last
+// used. Called with cache_mutex held.
+void yfs_client::apply_invalidations() {
+    std::vector<extent_protocol::extentid_t> eids;
+    pthread_mutex_lock(&inval_mutex);
+    eids.swap(invalidated);
+    pthread_mutex_unlock(&inval_mutex);
+    for (unsigned i = 0; i < eids.size(); ++i) {
+        if (eids[i] != 0) {
+            if (fetching.count(eids[i]))
+                raced.insert(eids[i]);
+            clear_cache(eids[i]);
+            continue;
+        }
+        for (std::map<extent_protocol::extentid_t, unsigned int>::iterator it =
+                 fetching.begin();
+             it != fetching.end(); ++it)
+            raced.insert(it->first);
+        // a server lost track of us: nothing cached can be trusted
+        std::set<extent_protocol::extentid_t> all;
+        for (std::list<cache_key>::iterator it = lru.begin(); it != lru.end();
+             ++it)
+            all.insert(it->first);
+        for (std::set<extent_protocol::extentid_t>::iterator it = all.begin();
+             it != all.end(); ++it)
+            clear_cache(*it);
+    }
+}
+
+// The reply goes out once eids are queued: whatever uses the cache next
+// applies them first, so no one trusts the old data after the server
+// hears back.
+rextent_protocol::status yfs_client::invalidate_handler(
+    std::vector<extent_protocol::extentid_t> eids, int&) {
+    pthread_mutex_lock(&inval_mutex);
+    invalidated.insert(invalidated.end(), eids.begin(), eids.end());
+    pthread_mutex_unlock(&inval_mutex);
+    return rextent_protocol::OK;
 }
@@ -8,7 +8,15 @@
 
 //#include "yfs_protocol.h"
 #include "extent_client.h"
+#include "cache_table.h"
+#include "rcbuf.h"
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
 #include <vector>
+#include <pthread.h>
+#include <time.h>
 
 class lock_client_cache;
 
@@ -36,46 +44,237 @@ public:
         std::string name;
         yfs_client::inum inum;
     };
+    struct cache_info {
+        unsigned long long bytes;  // held by the cache now
+        unsigned long long peak;
+        unsigned long long dirty;  // of bytes, not written back yet
+        unsigned long long evictions;
+        unsigned long long writebacks;  // dirty entries flushed to evict
+        unsigned long long flushed;  // extents written back by the flusher
+        unsigned long long read_ahead;  // bytes read ahead
+        unsigned long long missing_hits;  // lookups answered by missing
+    };
 
 private:
     static std::string filename(inum);
     static inum n2i(std::string);
-    static void buildlist(const char*, std::list<dirent>&);
-    static int nextmap(const char*, dirent&);
-    static bool addmap(std::string&, const char*, inum);
-    static void deletemap(std::string&, const char*);
     int createhelper(inum, const char*, mode_t, inum&, uint32_t);
     int lookup_nl(inum, const char*, bool&, inum&);
     int readdir_nl(inum, std::list<dirent>&);
 
 private:
-    enum cache_type { CACHE_DATA, CACHE_ATTR };
+    enum cache_type { CACHE_DATA, CACHE_ATTR, CACHE_PAGES };
+    typedef std::pair<extent_protocol::extentid_t, cache_type> cache_key;
+    // one CACHE_PAGE bytes of a file
+    struct page {
+        page() : dirty(false) {}
+        rcbuf data;
+        bool dirty;
+    };
+    // A stale data entry is one another client may have changed since;
+    // it is kept with the version it had and revalidated by
+    // get_if_changed instead of being fetched again. base is the server
+    // copy data was last in sync with, kept to flush only what changed;
+    // until data is edited the two share one block.
+    // Cached bytes are rcbufs: a read hands out a view of them, and an
+    // edit of bytes a reader still holds copies them first.
+    // Files are cached instead as CACHE_PAGES entries holding the pages
+    // read or written so far, so I/O costs what it covers rather than the
+    // file size. Past low, the least of the server's size and any size
+    // the file was cut to since, bytes no page holds are zero: holes
+    // never go to the server. An extent has a data or a pages entry,
+    // never both.
     struct cache_entry {
+        cache_entry()
+            : modified(false), stale(false), version(0), has_base(false),
+              size(0), low(0), synced(0), ra_next(0), ra_window(0), ra_lo(0),
+              ra_hi(0), epoch(0), charge(0), dirty(0), dirtied(0) {}
         yfs_client::cache_type type;
         extent_protocol::extentid_t eid;
         extent_protocol::attr attr;
-        std::string data;
+        rcbuf data;
         bool modified;
+        bool stale;
+        unsigned long long version;  // of the server copy data matches
+        rcbuf base;
+        bool has_base;
+        std::map<unsigned int, page> pages;  // by index
+        unsigned int size;
+        unsigned int low;
+        unsigned int synced;  // the server's size
+        // read-ahead of a pages entry: where a sequential read would
+        // start next, the window, 0 until reads are sequential, and the
+        // bytes being read ahead now
+        unsigned int ra_next;
+        unsigned int ra_window;
+        unsigned int ra_lo;
+        unsigned int ra_hi;
+        unsigned long long epoch;  // tells apart entries cached in turn
+        std::list<cache_key>::iterator lru;  // its place in yfs_client::lru
+        unsigned long long charge;  // bytes counted against the budget
+        unsigned long long dirty;   // bytes counted in usage.dirty
+        time_t dirtied;  // first modified since the last flush; 0 if clean
     };
 
-    std::vector<cache_entry> cache;
-    std::vector<extent_protocol::extentid_t> deleted;
+    // a getattr miss also fetches the data of extents up to this size
+    static const unsigned int PREFETCH_SIZE = 16384;
+    // most attributes prefetched by one readdir
+    static const unsigned int ATTR_BATCH = 128;
+    // directory entries per dir_list call
+    static const unsigned int DIR_PAGE = 256;
+    // unit of the diff flush_cache sends, one extent_server disk block
+    static const unsigned int DIFF_BLOCK = 512;
+    // unit of a CACHE_PAGES entry, the usual FUSE read and write
+    static const unsigned int CACHE_PAGE = 4096;
+    // cache budget in bytes unless YFS_CACHE_BYTES says otherwise
+    static const unsigned long long CACHE_BUDGET = 64ULL << 20;
+    // The flusher wakes every FLUSH_INTERVAL seconds and writes back what
+    // has been dirty for DIRTY_AGE seconds, or, while more than
+    // DIRTY_LIMIT bytes are dirty, whatever it can. It takes up to
+    // FLUSH_BATCH extents a round, FLUSH_WINDOW of them in flight.
+    static const unsigned int FLUSH_INTERVAL = 1;
+    static const unsigned int DIRTY_AGE = 2;
+    static const unsigned long long DIRTY_LIMIT = 8ULL << 20;
+    static const unsigned int FLUSH_BATCH = 16;
+    static const unsigned int FLUSH_WINDOW = 4;
+    // the read-ahead window starts at RA_MIN and doubles each time it is
+    // used up, to at most RA_MAX
+    static const unsigned int RA_MIN = 32 << 10;
+    static const unsigned int RA_MAX = 1 << 20;
+    // most names kept in missing; whole directories are forgotten, lowest
+    // id first, when it would grow past
+    static const unsigned int MISSING_MAX = 4096;
+
+    // at most one entry of each type per extent
+    cache_table<cache_entry> cache;
+    // cache entries by last use, most recent first
+    std::list<cache_key> lru;
+    unsigned long long cache_budget;  // 0 for no limit
+    cache_info usage;
+    // Guards the cache. Never held during an RPC: whatever talks to a
+    // server lets go of it around the call and looks its entries up again
+    // after, since they may have been evicted or invalidated meanwhile.
+    // Taken before the lock client's mutex, never after.
+    pthread_mutex_t cache_mutex;
+    pthread_cond_t flush_cond;  // wakes the flusher early
+    // Extents the servers called back about. invalidate_handler only
+    // queues them, so a callback never waits for cache_mutex; they are
+    // applied under it before the cache is next used. 0 is every extent.
+    std::vector<extent_protocol::extentid_t> invalidated;
+    pthread_mutex_t inval_mutex;  // guards invalidated
+    // Reads from the servers in flight, by extent, and the extents of
+    // those an invalidation was applied for meanwhile: such a read may
+    // have got the data from before the change, so it is not cached.
+    std::map<extent_protocol::extentid_t, unsigned int> fetching;
+    std::set<extent_protocol::extentid_t> raced;
+    unsigned long long epochs;  // the last epoch given to an entry
+    // pages entries, by eid and epoch, with read-ahead to do
+    std::deque<std::pair<extent_protocol::extentid_t, unsigned long long> >
+        ra_queue;
+    // signalled on ra_queue additions and read-ahead progress
+    pthread_cond_t ra_cond;
+    // Names looked up and not found, by directory. Every change to a
+    // directory takes its lock, so they hold while the lock is cached
+    // here, and are forgotten when it goes back.
+    std::map<extent_protocol::extentid_t, std::set<std::string> > missing;
+    unsigned int missing_count;
+    void (*missing_hook)(extent_protocol::extentid_t dir,
+                         const std::string& name);
+    static int last_port;  // of the last invalidation server, seeds the next
     cache_entry* find_cache(extent_protocol::extentid_t eid, cache_type type);
+    cache_entry* find_stale(extent_protocol::extentid_t eid);
+    cache_entry* add_cache(const cache_entry& e);
+    void uncache(extent_protocol::extentid_t eid, cache_type type);
+    void recharge(cache_entry* e);
+    void trim_cache(extent_protocol::extentid_t keep);
+    void drop_cache(extent_protocol::extentid_t eid);
+    void clear_cache(extent_protocol::extentid_t eid);
+    void apply_invalidations();
+    void begin_fetch(extent_protocol::extentid_t eid);
+    bool end_fetch(extent_protocol::extentid_t eid);
+    bool have_data(extent_protocol::extentid_t eid);
+    bool cached_data(extent_protocol::extentid_t eid);
+    extent_protocol::status cached_attr(extent_protocol::extentid_t eid,
+                                        extent_protocol::attr& a);
+    extent_protocol::status fetch(extent_protocol::extentid_t eid,
+                                  unsigned int limit,
+                                  extent_protocol::extent& e, rcbuf& data);
+    void fill_cache(extent_protocol::extentid_t eid,
+                    const extent_protocol::extent& e, const rcbuf& data);
+    void prefetch_attrs(const std::list<dirent>& list);
+    void changed_remotely(extent_protocol::extentid_t eid);
+    bool diff_ops(const cache_entry& e, std::vector<extent_protocol::op>& ops);
+    bool delta_ops(const cache_entry& e,
+                   std::vector<extent_protocol::delta_op>& ops);
+    void local_size(extent_protocol::extentid_t eid, extent_protocol::attr& a);
+    void resized(extent_protocol::extentid_t eid, unsigned int size);
+    extent_protocol::status file_pages(extent_protocol::extentid_t eid,
+                                       cache_entry*& e);
+    extent_protocol::status load_pages(cache_entry*& e, unsigned int first,
+                                       unsigned int last);
+    void install_pages(cache_entry* e, unsigned int first, unsigned int n,
+                       std::string& buf);
+    void plan_read_ahead(cache_entry* e, unsigned int off, unsigned int end);
+    bool reading_ahead(const cache_entry* e, unsigned int first,
+                       unsigned int last);
+    static void* read_ahead(void* arg);
+    void page_ops(const cache_entry& e, std::vector<extent_protocol::op>& ops);
+    void flush_pages(cache_entry* e);
+
+    struct write_back_job;
+    static void* flusher(void* arg);
+    static void* write_back_worker(void* arg);
+    void pick_dirty(std::vector<extent_protocol::extentid_t>& eids);
+    void write_back(const std::vector<extent_protocol::extentid_t>& eids);
 
     extent_protocol::status ec_create(uint32_t type,
+                                      extent_protocol::extentid_t parent,
+                                      const char* name,
                                       extent_protocol::extentid_t& eid);
     extent_protocol::status ec_get(extent_protocol::extentid_t eid,
-                                   std::string& buf);
+                                   rcbuf& buf);
     extent_protocol::status ec_getattr(extent_protocol::extentid_t eid,
                                        extent_protocol::attr& a);
+    // takes the bytes of buf, leaving it empty
     extent_protocol::status ec_put(extent_protocol::extentid_t eid,
-                                   std::string buf);
+                                   std::string& buf);
     extent_protocol::status ec_remove(extent_protocol::extentid_t eid);
+    bool is_missing(extent_protocol::extentid_t dir, const char* name);
+    void set_missing(extent_protocol::extentid_t dir, const char* name,
+                     bool gone);
+    void forget_missing(extent_protocol::extentid_t dir);
+    // edits of a directory cached here, made in the cached copy
+    extent_protocol::status dir_data(extent_protocol::extentid_t eid,
+                                     cache_entry*& e);
+    extent_protocol::status ec_dir_lookup(extent_protocol::extentid_t eid,
+                                          const char* name,
+                                          extent_protocol::extentid_t& inum);
+    extent_protocol::status ec_dir_add(extent_protocol::extentid_t eid,
+                                       const char* name,
+                                       extent_protocol::extentid_t inum);
+    extent_protocol::status ec_dir_remove(extent_protocol::extentid_t eid,
+                                          const char* name,
+                                          extent_protocol::extentid_t& inum);
+    extent_protocol::status ec_get_range(extent_protocol::extentid_t eid,
+                                         unsigned int off, unsigned int len,
+                                         rcbuf& buf);
+    extent_protocol::status ec_put_range(extent_protocol::extentid_t eid,
+                                         unsigned int off, const char* buf,
+                                         size_t len);
+    extent_protocol::status ec_truncate(extent_protocol::extentid_t eid,
+                                        unsigned int size);
 
 public:
-    void clear_cache(extent_protocol::extentid_t eid);
-    std::vector<extent_protocol::extentid_t> flush_cache(
-        extent_protocol::extentid_t eid);
+    void flush_cache(extent_protocol::extentid_t eid);
+    void released(extent_protocol::extentid_t eid);
+    // Names found missing may be held as negative entries above us too:
+    // hook hears of each once it is no longer known to be missing. It is
+    // called with cache_mutex held, so it must not call back in.
+    void set_missing_hook(void (*hook)(extent_protocol::extentid_t dir,
+                                       const std::string& name));
+    void get_cache_info(cache_info& info);
+    rextent_protocol::status invalidate_handler(
+        std::vector<extent_protocol::extentid_t> eids, int&);
 
 public:
     yfs_client(std::string, std::string);
@@ -93,7 +292,8 @@ public:
     int create(inum, const char*, mode_t, inum&);
     int readdir(inum, std::list<dirent>&);
     int write(inum, size_t, off_t, const char*, size_t&);
-    int read(inum, size_t, off_t, std::string&);
+    // the bytes read are a view of the cache, not a copy
+    int read(inum, size_t, off_t, rcbuf&);
     int unlink(inum, const char*);
     int mkdir(inum, const char*, mode_t, inum&);
 